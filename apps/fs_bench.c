@@ -0,0 +1,401 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define die(...)								\
+do {											\
+	fprintf(stderr, __VA_ARGS__);				\
+	fprintf(stderr, "\n");						\
+	exit(1);									\
+} while (0)
+
+#define BENCH_FILE "bench.dat"
+#define SMALL_FILE_SIZE 100		/* bytes written to each tiny file */
+#define SMALL_FILE_BATCH 64		/* tiny files alive at the same time */
+
+/* Parameters of a run */
+struct bench_opts {
+	size_t file_size;		/* size of the file of the sequential and random workloads */
+	size_t req_size;		/* request size of the sequential workloads (0: sweep) */
+	size_t count;			/* operations of the random and small-file workloads */
+	int json;
+	int log;				/* write in log mode */
+};
+
+/* Measurements of one workload */
+struct bench_result {
+	const char *workload;
+	size_t req_size;
+	size_t ops;
+	size_t bytes;
+	double seconds;
+	double *lat;			/* latency of each operation, in microseconds */
+};
+
+static int results_printed;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result_init(struct bench_result *res, const char *workload,
+			size_t req_size, size_t max_ops)
+{
+	memset(res, 0, sizeof(*res));
+	res->workload = workload;
+	res->req_size = req_size;
+	res->lat = malloc((max_ops ? max_ops : 1) * sizeof(double));
+	if (!res->lat)
+		die("Cannot allocate latency array");
+}
+
+/* Record one operation that started at @start and moved @bytes */
+static void result_add(struct bench_result *res, double start, size_t bytes)
+{
+	double end = now();
+
+	res->lat[res->ops++] = (end - start) * 1e6;
+	res->bytes += bytes;
+	res->seconds += end - start;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, size_t n, double q)
+{
+	size_t rank;
+
+	if (n == 0)
+		return 0;
+	rank = q * n;
+	if (rank >= n)
+		rank = n - 1;
+	return sorted[rank];
+}
+
+static void result_print(struct bench_result *res, int json)
+{
+	double p50, p99, p999;
+	double mbps = res->seconds > 0 ? res->bytes / res->seconds / 1e6 : 0;
+	double opsps = res->seconds > 0 ? res->ops / res->seconds : 0;
+
+	qsort(res->lat, res->ops, sizeof(double), compare_double);
+	p50 = percentile(res->lat, res->ops, 0.5);
+	p99 = percentile(res->lat, res->ops, 0.99);
+	p999 = percentile(res->lat, res->ops, 0.999);
+
+	if (json) {
+		printf("%s\n  {\"workload\": \"%s\", \"request_size\": %zu, "
+		       "\"ops\": %zu, \"bytes\": %zu, \"seconds\": %.6f, "
+		       "\"mb_per_s\": %.2f, \"ops_per_s\": %.1f, "
+		       "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}",
+		       results_printed ? "," : "[", res->workload, res->req_size,
+		       res->ops, res->bytes, res->seconds, mbps, opsps,
+		       p50, p99, p999);
+	} else {
+		if (!results_printed)
+			printf("workload,request_size,ops,bytes,seconds,mb_per_s,"
+			       "ops_per_s,p50_us,p99_us,p999_us\n");
+		printf("%s,%zu,%zu,%zu,%.6f,%.2f,%.1f,%.2f,%.2f,%.2f\n",
+		       res->workload, res->req_size, res->ops, res->bytes,
+		       res->seconds, mbps, opsps, p50, p99, p999);
+	}
+	results_printed++;
+
+	free(res->lat);
+}
+
+static int open_new(const char *filename)
+{
+	int fd;
+
+	fs_delete(filename);
+	if (fs_create(filename))
+		die("Cannot create file '%s'", filename);
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file '%s'", filename);
+	return fd;
+}
+
+static void fill_pattern(char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = 'a' + (i * 7 + i / 4096) % 26;
+}
+
+/* Write then read back a file of @opts->file_size bytes, @req_size bytes at a time */
+static void bench_sequential(struct bench_opts *opts, size_t req_size)
+{
+	struct bench_result res;
+	size_t nreq = (opts->file_size + req_size - 1) / req_size;
+	size_t done;
+	char *buf;
+	int fd;
+
+	buf = malloc(req_size);
+	if (!buf)
+		die("Cannot allocate buffer");
+	fill_pattern(buf, req_size);
+
+	fd = open_new(BENCH_FILE);
+	result_init(&res, "seq_write", req_size, nreq);
+	for (done = 0; done < opts->file_size; done += req_size) {
+		size_t len = opts->file_size - done < req_size ? opts->file_size - done : req_size;
+		double start = now();
+		int ret = fs_write(fd, buf, len);
+
+		result_add(&res, start, ret > 0 ? ret : 0);
+		if ((size_t)ret != len)
+			die("Disk full after %zu bytes, use a smaller file size", done);
+	}
+	fs_close(fd);
+	result_print(&res, opts->json);
+
+	fd = fs_open(BENCH_FILE);
+	result_init(&res, "seq_read", req_size, nreq);
+	for (done = 0; done < opts->file_size; done += req_size) {
+		double start = now();
+		int ret = fs_read(fd, buf, req_size);
+
+		if (ret <= 0)
+			die("Read failed at offset %zu", done);
+		result_add(&res, start, ret);
+	}
+	fs_close(fd);
+	result_print(&res, opts->json);
+
+	fs_delete(BENCH_FILE);
+	free(buf);
+}
+
+/*
+ * Read, then overwrite, @opts->count random aligned 4KiB blocks of a file of
+ * @opts->file_size bytes
+ */
+static void bench_random(struct bench_opts *opts)
+{
+	struct bench_result res;
+	size_t nblocks = opts->file_size / BLOCK_SIZE;
+	char buf[BLOCK_SIZE];
+	size_t i;
+	int fd;
+
+	if (nblocks == 0)
+		die("File size must be at least one block");
+
+	/* Lay the file out first */
+	fill_pattern(buf, BLOCK_SIZE);
+	fd = open_new(BENCH_FILE);
+	for (i = 0; i < nblocks; i++)
+		if (fs_write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE)
+			die("Disk full, use a smaller file size");
+
+	result_init(&res, "rand_read", BLOCK_SIZE, opts->count);
+	srand(150);
+	for (i = 0; i < opts->count; i++) {
+		size_t block = rand() % nblocks;
+		double start = now();
+
+		if (fs_lseek(fd, block * BLOCK_SIZE)
+		    || fs_read(fd, buf, BLOCK_SIZE) != BLOCK_SIZE)
+			die("Random read failed at block %zu", block);
+		result_add(&res, start, BLOCK_SIZE);
+	}
+	result_print(&res, opts->json);
+
+	result_init(&res, "rand_write", BLOCK_SIZE, opts->count);
+	srand(151);
+	for (i = 0; i < opts->count; i++) {
+		size_t block = rand() % nblocks;
+		double start = now();
+
+		if (fs_lseek(fd, block * BLOCK_SIZE)
+		    || fs_write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE)
+			die("Random write failed at block %zu", block);
+		result_add(&res, start, BLOCK_SIZE);
+	}
+	fs_close(fd);
+	result_print(&res, opts->json);
+
+	fs_delete(BENCH_FILE);
+}
+
+/*
+ * Create, write, close and delete @opts->count tiny files. Files are created
+ * in batches so that the root directory holds many entries at once.
+ */
+static void bench_small_files(struct bench_opts *opts)
+{
+	struct bench_result create, del;
+	char names[SMALL_FILE_BATCH][FS_FILENAME_LEN];
+	char buf[SMALL_FILE_SIZE];
+	size_t done, i, batch;
+
+	fill_pattern(buf, SMALL_FILE_SIZE);
+	result_init(&create, "small_create_write", SMALL_FILE_SIZE, opts->count);
+	result_init(&del, "small_delete", 0, opts->count);
+
+	for (done = 0; done < opts->count; done += batch) {
+		batch = opts->count - done < SMALL_FILE_BATCH ? opts->count - done : SMALL_FILE_BATCH;
+
+		for (i = 0; i < batch; i++) {
+			double start = now();
+			int fd;
+
+			snprintf(names[i], FS_FILENAME_LEN, "small%zu", i);
+			if (fs_create(names[i]))
+				die("Cannot create file '%s'", names[i]);
+			fd = fs_open(names[i]);
+			if (fd < 0 || fs_write(fd, buf, SMALL_FILE_SIZE) != SMALL_FILE_SIZE
+			    || fs_close(fd))
+				die("Cannot write file '%s'", names[i]);
+			result_add(&create, start, SMALL_FILE_SIZE);
+		}
+
+		for (i = 0; i < batch; i++) {
+			double start = now();
+
+			if (fs_delete(names[i]))
+				die("Cannot delete file '%s'", names[i]);
+			result_add(&del, start, 0);
+		}
+	}
+
+	result_print(&create, opts->json);
+	result_print(&del, opts->json);
+}
+
+/* Append 4KiB blocks to a file until the disk is full, then free it all */
+static void bench_fill(struct bench_opts *opts)
+{
+	struct bench_result fill, del;
+	char buf[BLOCK_SIZE];
+	size_t max_ops = 65536;
+	double start;
+	int fd;
+
+	fill_pattern(buf, BLOCK_SIZE);
+	fd = open_new(BENCH_FILE);
+	result_init(&fill, "fill_write", BLOCK_SIZE, max_ops);
+	while (fill.ops < max_ops) {
+		int ret;
+
+		start = now();
+		ret = fs_write(fd, buf, BLOCK_SIZE);
+		if (ret <= 0)
+			break;
+		result_add(&fill, start, ret);
+	}
+	fs_close(fd);
+	result_print(&fill, opts->json);
+
+	result_init(&del, "fill_delete", 0, 1);
+	start = now();
+	if (fs_delete(BENCH_FILE))
+		die("Cannot delete file");
+	result_add(&del, start, 0);
+	result_print(&del, opts->json);
+}
+
+static void usage(const char *program)
+{
+	die("Usage: %s [-w workload] [-s file size] [-r request size] [-n count] [-j] [-l] <diskname>\n"
+	    "Workloads: seq, rand, small, fill, all (default)\n"
+	    "Without -r, sequential workloads sweep request sizes from 512B to 1MiB\n"
+	    "Results are printed as CSV, or as JSON with -j\n"
+	    "With -l, the file system writes in log mode\n"
+	    "With a disk name of ram:<image>, the run uses an in-memory copy of the image", program);
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t sweep[] = { 512, 4096, 65536, 1 << 20 };
+	struct bench_opts opts = {
+		.file_size = 4 << 20,
+		.req_size = 0,
+		.count = 1000,
+		.json = 0,
+		.log = 0,
+	};
+	const char *workload = "all";
+	int all, opt;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "w:s:r:n:jl")) != -1) {
+		switch (opt) {
+		case 'w':
+			workload = optarg;
+			break;
+		case 's':
+			opts.file_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.req_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			opts.json = 1;
+			break;
+		case 'l':
+			opts.log = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (fs_mount(argv[optind]))
+		die("Cannot mount diskname");
+	if (opts.log && fs_log(1))
+		die("Cannot enable log mode");
+
+	all = !strcmp(workload, "all");
+	if (all || !strcmp(workload, "seq")) {
+		if (opts.req_size)
+			bench_sequential(&opts, opts.req_size);
+		else
+			for (i = 0; i < ARRAY_SIZE(sweep); i++)
+				bench_sequential(&opts, sweep[i]);
+	}
+	if (all || !strcmp(workload, "rand"))
+		bench_random(&opts);
+	if (all || !strcmp(workload, "small"))
+		bench_small_files(&opts);
+	if (all || !strcmp(workload, "fill"))
+		bench_fill(&opts);
+	if (!results_printed) {
+		fs_umount();
+		usage(argv[0]);
+	}
+	if (opts.json)
+		printf("\n]\n");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
@@ -0,0 +1,380 @@
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define die(...)								\
+do {											\
+	fprintf(stderr, __VA_ARGS__);				\
+	fprintf(stderr, "\n");						\
+	exit(1);									\
+} while (0)
+
+#define die_perror(msg)							\
+do {											\
+	perror(msg);								\
+	exit(1);									\
+} while (0)
+
+#define BLOCK_SIZE 4096
+#define FAT_EOC 0xFFFF
+#define SUMMARY_OFFSET 24	/* free counts libfs saves in the superblock at unmount */
+#define SUMMARY_END 32
+#define MAX_ARGS 16
+#define NUM_TOOLS 2
+
+/*
+ * Runs the same workload through test_fs.x (this libfs) and fs_ref.x (the
+ * reference implementation), each on a freshly formatted image, and compares
+ * their cost and what they leave behind. The on-disk layout is parsed here
+ * directly, independently of libfs.
+ */
+
+struct superblock {
+	char signature[8];
+	uint16_t total_disk_blocks;
+	uint16_t rootDir_blockIndex;
+	uint16_t dataBlock_startIndex;
+	uint16_t numOf_dataBlocks;
+	uint8_t numOf_fatBlocks;
+} __attribute__((packed));
+
+struct rootDirEntry {
+	char file_name[16];
+	uint32_t file_size;
+	uint16_t firstDataBlock_index;
+	uint8_t unused[10];
+} __attribute__((packed));
+
+/* Cost of running a workload with one tool */
+struct tool_stats {
+	const char *name;
+	char path[4096];
+	char image[64];
+	char output[64];
+	double wall;			/* seconds, best of all repetitions */
+	double user, sys;		/* seconds, last repetition */
+	unsigned long long syscr, syscw, rchar, wchar;	/* from /proc/<pid>/io */
+	long inblock, oublock;	/* from rusage */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read the I/O counters of a child that exited but was not reaped yet */
+static void read_proc_io(pid_t pid, struct tool_stats *stats)
+{
+	char path[64], key[32];
+	unsigned long long value;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2) {
+		if (!strcmp(key, "syscr"))
+			stats->syscr += value;
+		else if (!strcmp(key, "syscw"))
+			stats->syscw += value;
+		else if (!strcmp(key, "rchar"))
+			stats->rchar += value;
+		else if (!strcmp(key, "wchar"))
+			stats->wchar += value;
+	}
+	fclose(f);
+}
+
+/*
+ * Run @argv with stdout appended to @output, and add its cost to @stats.
+ * Return the wait status of the program.
+ */
+static int run(char **argv, const char *output, struct tool_stats *stats)
+{
+	struct rusage ru;
+	siginfo_t info;
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		die_perror("fork");
+	if (pid == 0) {
+		int out = open(output, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		int null = open("/dev/null", O_WRONLY);
+
+		/*
+		 * Leave with _exit(): exit() would sync the workload stream
+		 * shared with the parent and rewind the parent's position in it
+		 */
+		if (out < 0 || null < 0) {
+			perror("open");
+			_exit(127);
+		}
+		dup2(out, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execv(argv[0], argv);
+		perror("execv");
+		_exit(127);
+	}
+
+	/* Leave the child a zombie until its counters are read */
+	if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT))
+		die_perror("waitid");
+	read_proc_io(pid, stats);
+	if (wait4(pid, &status, 0, &ru) < 0)
+		die_perror("wait4");
+
+	stats->user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	stats->sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	stats->inblock += ru.ru_inblock;
+	stats->oublock += ru.ru_oublock;
+	return status;
+}
+
+/* Run the whole workload once with a tool, on a fresh image */
+static void run_workload(FILE *workload, const char *make_path,
+			 const char *blocks, struct tool_stats *stats)
+{
+	struct tool_stats scratch;
+	char line[1024];
+	char *argv[MAX_ARGS + 3];
+	double start, wall = 0;
+
+	memset(&scratch, 0, sizeof(scratch));
+	unlink(stats->image);
+	unlink(stats->output);
+	argv[0] = (char *)make_path;
+	argv[1] = stats->image;
+	argv[2] = (char *)blocks;
+	argv[3] = NULL;
+	if (run(argv, "/dev/null", &scratch))
+		die("%s could not format %s", make_path, stats->image);
+
+	/* Costs of the formatting are not part of the workload */
+	memset(&scratch, 0, sizeof(scratch));
+	rewind(workload);
+	while (fgets(line, sizeof(line), workload)) {
+		int argc = 0;
+		char *tok = strtok(line, " \t\n");
+
+		if (!tok || tok[0] == '#')
+			continue;
+
+		/* Every command takes the disk image as first argument */
+		argv[argc++] = stats->path;
+		argv[argc++] = tok;
+		argv[argc++] = stats->image;
+		while ((tok = strtok(NULL, " \t\n")) && argc < MAX_ARGS + 2)
+			argv[argc++] = tok;
+		argv[argc] = NULL;
+
+		start = now();
+		run(argv, stats->output, &scratch);
+		wall += now() - start;
+	}
+
+	if (stats->wall == 0 || wall < stats->wall)
+		stats->wall = wall;
+	stats->user = scratch.user;
+	stats->sys = scratch.sys;
+	stats->syscr = scratch.syscr;
+	stats->syscw = scratch.syscw;
+	stats->rchar = scratch.rchar;
+	stats->wchar = scratch.wchar;
+	stats->inblock = scratch.inblock;
+	stats->oublock = scratch.oublock;
+}
+
+static char *load_file(const char *path, size_t *size)
+{
+	struct stat st;
+	char *buf;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f || fstat(fileno(f), &st))
+		die("Cannot open '%s'", path);
+	buf = malloc(st.st_size + 1);
+	if (!buf || fread(buf, 1, st.st_size, f) != (size_t)st.st_size)
+		die("Cannot read '%s'", path);
+	fclose(f);
+	*size = st.st_size;
+	return buf;
+}
+
+/*
+ * Compare two images. The superblock, the FAT and the entries of the root
+ * directory that are in use must be identical, and so must the bytes of every
+ * file up to its size. What lies past the end of a file in its last block, in
+ * free blocks or in free directory entries carries no meaning and is only
+ * counted as slack, as is the summary libfs leaves in the superblock.
+ * Return 0 if the images hold the same file system, 1 otherwise.
+ */
+static int compare_images(const char *a, const char *b)
+{
+	size_t size_a, size_b, i, slack = 0;
+	char *img_a = load_file(a, &size_a);
+	char *img_b = load_file(b, &size_b);
+	struct superblock *sb = (struct superblock *)img_a;
+	struct rootDirEntry *rdir_a, *rdir_b;
+	size_t rdir_off;
+	uint16_t *fat;
+	int ret = 0;
+
+	if (size_a != size_b || size_a < 2 * BLOCK_SIZE) {
+		printf("image: sizes differ\n");
+		ret = 1;
+		goto out;
+	}
+
+	rdir_off = (size_t)sb->rootDir_blockIndex * BLOCK_SIZE;
+	if (rdir_off + BLOCK_SIZE > size_a || memcmp(img_a, img_b, SUMMARY_OFFSET)
+	    || memcmp(img_a + SUMMARY_END, img_b + SUMMARY_END, rdir_off - SUMMARY_END)) {
+		printf("image: superblock or FAT differs\n");
+		ret = 1;
+		goto out;
+	}
+
+	rdir_a = (struct rootDirEntry *)(img_a + rdir_off);
+	rdir_b = (struct rootDirEntry *)(img_b + rdir_off);
+	for (i = 0; i < BLOCK_SIZE / sizeof(struct rootDirEntry); i++) {
+		if (!rdir_a[i].file_name[0] && !rdir_b[i].file_name[0])
+			continue;
+		if (memcmp(&rdir_a[i], &rdir_b[i], sizeof(struct rootDirEntry))) {
+			printf("image: root directory entry %zu differs\n", i);
+			ret = 1;
+			goto out;
+		}
+	}
+
+	/* Metadata is identical, so both images have the same files in the same blocks */
+	fat = (uint16_t *)(img_a + BLOCK_SIZE);
+	for (i = 0; i < BLOCK_SIZE / sizeof(struct rootDirEntry) && !ret; i++) {
+		uint32_t left = rdir_a[i].file_size;
+		uint16_t block = rdir_a[i].firstDataBlock_index;
+
+		if (!rdir_a[i].file_name[0])
+			continue;
+		while (left > 0 && block != FAT_EOC && block < sb->numOf_dataBlocks) {
+			size_t off = ((size_t)sb->dataBlock_startIndex + block) * BLOCK_SIZE;
+			size_t len = left < BLOCK_SIZE ? left : BLOCK_SIZE;
+
+			if (off + len > size_a || memcmp(img_a + off, img_b + off, len)) {
+				printf("image: content of '%.16s' differs\n", rdir_a[i].file_name);
+				ret = 1;
+				break;
+			}
+			left -= len;
+			block = fat[block];
+		}
+	}
+
+	for (i = 0; i < size_a; i++)
+		slack += img_a[i] != img_b[i];
+	if (!ret) {
+		if (slack)
+			printf("image: identical (%zu bytes differ in unused space)\n", slack);
+		else
+			printf("image: byte-identical\n");
+	}
+
+out:
+	free(img_a);
+	free(img_b);
+	return ret;
+}
+
+static int compare_outputs(const char *a, const char *b)
+{
+	size_t size_a, size_b;
+	char *out_a = load_file(a, &size_a);
+	char *out_b = load_file(b, &size_b);
+	int ret = size_a != size_b || memcmp(out_a, out_b, size_a);
+
+	printf("stdout: %s\n", ret ? "differs" : "identical");
+	free(out_a);
+	free(out_b);
+	return ret;
+}
+
+static void print_row(const char *metric, double lib, double ref)
+{
+	printf("%-16s %14.3f %14.3f %8.2f\n", metric, lib, ref, lib > 0 ? ref / lib : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct tool_stats tools[NUM_TOOLS] = {
+		{ .name = "test_fs.x", .image = "compare_lib.fs", .output = "compare_lib.out" },
+		{ .name = "fs_ref.x", .image = "compare_ref.fs", .output = "compare_ref.out" },
+	};
+	const char *blocks = "4096";
+	char make_path[4096], *dir;
+	int repeat = 3, opt, i, t, ret;
+	FILE *workload;
+
+	while ((opt = getopt(argc, argv, "b:r:")) != -1) {
+		switch (opt) {
+		case 'b':
+			blocks = optarg;
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		default:
+			die("Usage: %s [-b data blocks] [-r repetitions] <workload>", argv[0]);
+		}
+	}
+	if (optind != argc - 1 || repeat < 1)
+		die("Usage: %s [-b data blocks] [-r repetitions] <workload>", argv[0]);
+
+	workload = fopen(argv[optind], "r");
+	if (!workload)
+		die_perror("fopen");
+
+	/* The tools are expected next to this program */
+	dir = dirname(strdup(argv[0]));
+	snprintf(make_path, sizeof(make_path), "%s/fs_make.x", dir);
+	for (t = 0; t < NUM_TOOLS; t++)
+		snprintf(tools[t].path, sizeof(tools[t].path), "%s/%s", dir, tools[t].name);
+
+	/* Alternate the tools so that both see the same system conditions */
+	for (i = 0; i < repeat; i++)
+		for (t = 0; t < NUM_TOOLS; t++)
+			run_workload(workload, make_path, blocks, &tools[t]);
+	fclose(workload);
+
+	printf("%-16s %14s %14s %8s\n", "metric", tools[0].name, tools[1].name, "ref/lib");
+	print_row("wall_ms", tools[0].wall * 1e3, tools[1].wall * 1e3);
+	print_row("user_ms", tools[0].user * 1e3, tools[1].user * 1e3);
+	print_row("sys_ms", tools[0].sys * 1e3, tools[1].sys * 1e3);
+	print_row("read_syscalls", tools[0].syscr, tools[1].syscr);
+	print_row("write_syscalls", tools[0].syscw, tools[1].syscw);
+	print_row("read_bytes", tools[0].rchar, tools[1].rchar);
+	print_row("written_bytes", tools[0].wchar, tools[1].wchar);
+	print_row("disk_in_blocks", tools[0].inblock, tools[1].inblock);
+	print_row("disk_out_blocks", tools[0].oublock, tools[1].oublock);
+
+	ret = compare_outputs(tools[0].output, tools[1].output);
+	ret |= compare_images(tools[0].image, tools[1].image);
+
+	for (t = 0; t < NUM_TOOLS; t++) {
+		unlink(tools[t].image);
+		unlink(tools[t].output);
+	}
+	return ret;
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fs.h>
+
+#define die(...)								\
+do {											\
+	fprintf(stderr, __VA_ARGS__);				\
+	fprintf(stderr, "\n");						\
+	exit(1);									\
+} while (0)
+
+int main(int argc, char *argv[])
+{
+	char *diskname;
+	size_t io_budget = 0;
+	int relocated;
+
+	if (argc < 2)
+		die("Usage: %s <diskname> [<block budget>]", argv[0]);
+
+	diskname = argv[1];
+	if (argc > 2)
+		io_budget = strtoul(argv[2], NULL, 0);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_defrag_info();
+
+	relocated = fs_defrag(io_budget);
+	if (relocated < 0) {
+		fs_umount();
+		die("Cannot defragment diskname");
+	}
+	printf("Relocated %d data blocks\n", relocated);
+
+	fs_defrag_info();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
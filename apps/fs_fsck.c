@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+#define die(...)								\
+do {											\
+	fprintf(stderr, __VA_ARGS__);				\
+	fprintf(stderr, "\n");						\
+	exit(1);									\
+} while (0)
+
+int main(int argc, char *argv[])
+{
+	int repair = 0, left;
+	char *diskname;
+
+	if (argc == 3 && !strcmp(argv[1], "-r"))
+		repair = 1;
+	else if (argc != 2)
+		die("Usage: %s [-r] <diskname>\n"
+		    "With -r, the problems that are found are repaired", argv[0]);
+	diskname = argv[argc - 1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	left = fs_check(repair);
+	if (left < 0) {
+		fs_umount();
+		die("Cannot check diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return left ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+#define die(...)								\
+do {											\
+	fprintf(stderr, __VA_ARGS__);				\
+	fprintf(stderr, "\n");						\
+	exit(1);									\
+} while (0)
+
+#define MAX_MEMBERS 16
+
+/*
+ * Volume description parsed from "raid0:<stripe>:<image>,<image>...",
+ * "raid1:<image>,<image>..." or "tier:<fast blocks>:<image>,<image>"
+ */
+struct volume {
+	size_t stripe;			/* 0 for a mirrored or tiered volume */
+	size_t fast_blocks;		/* 0 unless tiered */
+	int numOf_members;
+	char *members[MAX_MEMBERS];
+};
+
+static void parse_volume(char *desc, struct volume *vol)
+{
+	char *p, *name, *save;
+
+	vol->stripe = 0;
+	vol->fast_blocks = 0;
+	if (!strncmp(desc, "raid1:", 6)) {
+		p = desc + 5;
+	} else if (!strncmp(desc, "tier:", 5)) {
+		vol->fast_blocks = strtoul(desc + 5, &p, 10);
+		if (vol->fast_blocks == 0 || *p != ':')
+			die("Invalid fast tier size in '%s'", desc);
+	} else if (!strncmp(desc, "raid0:", 6)) {
+		vol->stripe = strtoul(desc + 6, &p, 10);
+		if (vol->stripe == 0 || *p != ':')
+			die("Invalid stripe unit in '%s'", desc);
+	} else {
+		die("Unknown volume type in '%s'", desc);
+	}
+
+	vol->numOf_members = 0;
+	p = strdup(p + 1);
+	for (name = strtok_r(p, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if (vol->numOf_members == MAX_MEMBERS)
+			die("More than %d images", MAX_MEMBERS);
+		vol->members[vol->numOf_members++] = name;
+	}
+	if (vol->numOf_members < 2)
+		die("A volume needs at least two images");
+	if (vol->fast_blocks && vol->numOf_members != 2)
+		die("A tiered volume needs a fast and a slow image");
+}
+
+/* Spread the blocks of disk image @image over the images of a new volume */
+static void split(char *image, char *desc)
+{
+	struct volume vol;
+	char buf[BLOCK_SIZE];
+	struct stat st;
+	size_t bcount, i;
+	int fd;
+
+	parse_volume(desc, &vol);
+
+	fd = open(image, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		die("Cannot open disk image '%s'", image);
+	bcount = st.st_size / BLOCK_SIZE;
+	if (vol.fast_blocks >= bcount)
+		die("The fast tier must be smaller than '%s'", image);
+
+	/* Lay out empty images of the right sizes, then fill them through libfs */
+	if (block_volume_create(desc, bcount))
+		die("Cannot create the images of the volume");
+
+	if (block_disk_open(desc))
+		die("Cannot open volume");
+	for (i = 0; i < bcount; i++) {
+		if (pread(fd, buf, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE)
+			die("Cannot read block %zu of '%s'", i, image);
+		if (block_write(i, buf))
+			die("Cannot write block %zu of the volume", i);
+	}
+	if (block_disk_close())
+		die("Cannot close volume");
+	close(fd);
+
+	printf("%s '%s' (%zu blocks) over %d images\n",
+	       vol.stripe || vol.fast_blocks ? "Split" : "Mirrored", image, bcount, vol.numOf_members);
+}
+
+/* Gather the blocks of a volume back into disk image @image */
+static void join(char *desc, char *image)
+{
+	char buf[BLOCK_SIZE];
+	size_t bcount, i;
+	int count, fd;
+
+	if (block_disk_open(desc) || (count = block_disk_count()) < 0)
+		die("Cannot open volume");
+	bcount = count;
+
+	fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die("Cannot create disk image '%s'", image);
+	for (i = 0; i < bcount; i++) {
+		if (block_read(i, buf))
+			die("Cannot read block %zu of the volume", i);
+		if (pwrite(fd, buf, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE)
+			die("Cannot write block %zu of '%s'", i, image);
+	}
+	if (close(fd))
+		die("Cannot write disk image '%s'", image);
+	block_disk_close();
+
+	printf("Joined %zu blocks into '%s'\n", bcount, image);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 4 && !strcmp(argv[1], "split"))
+		split(argv[2], argv[3]);
+	else if (argc == 4 && !strcmp(argv[1], "join"))
+		join(argv[2], argv[3]);
+	else
+		die("Usage: %s split <disk image> <volume>\n"
+		    "       %s join <volume> <disk image>\n"
+		    "A volume is described as raid0:<stripe unit in blocks>:<image>,<image>...\n"
+		    "or as raid1:<image>,<image>...\n"
+		    "or as tier:<fast tier size in blocks>:<fast image>,<slow image>",
+		    argv[0], argv[0]);
+
+	return 0;
+}
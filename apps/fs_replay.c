@@ -0,0 +1,330 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <capture.h>
+#include <fs.h>
+
+#define die(...)								\
+do {											\
+	fprintf(stderr, __VA_ARGS__);				\
+	fprintf(stderr, "\n");						\
+	exit(1);									\
+} while (0)
+
+#define MAX_FD FS_OPEN_MAX_COUNT	/* recorded file descriptors that can be mapped */
+
+static const char *op_names[] = {
+#define CAPTURE_NAME(name) #name,
+	CAPTURE_OPS(CAPTURE_NAME)
+#undef CAPTURE_NAME
+};
+
+/* A recorded call and its file name arguments */
+struct call {
+	struct captureRecord rec;
+	struct captureNames names;
+};
+
+/* Calls made by one recorded thread, played back by one replay thread */
+struct player {
+	pthread_t thread;
+	struct call **calls;
+	size_t count;
+	size_t errors;
+	uint64_t max_lag;		/* worst delay behind the original pacing, in ns */
+};
+
+static struct call *calls;
+static size_t numOf_calls;
+
+static int paced;
+static double speed = 1.0;
+static uint64_t start_time;
+
+/* Recorded file descriptors -> file descriptors of the replay */
+static int fd_map[MAX_FD];
+
+/* libfs is not thread-safe: calls of concurrent players are serialized */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t counts[CAPTURE_NUM_OPS];
+static size_t bytes;
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void load_log(const char *filename)
+{
+	struct captureHeader header;
+	size_t cap = 1024;
+	FILE *file;
+
+	file = fopen(filename, "rb");
+	if (!file)
+		die("Cannot open capture log");
+
+	if (fread(&header, sizeof(header), 1, file) != 1
+	    || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic))
+	    || header.recordSize != sizeof(struct captureRecord))
+		die("Not a capture log");
+
+	calls = malloc(cap * sizeof(*calls));
+	if (!calls)
+		die("Cannot allocate calls");
+
+	while (1) {
+		struct call *call;
+
+		if (numOf_calls == cap) {
+			cap *= 2;
+			calls = realloc(calls, cap * sizeof(*calls));
+			if (!calls)
+				die("Cannot allocate calls");
+		}
+		call = &calls[numOf_calls];
+		memset(call, 0, sizeof(*call));
+
+		if (fread(&call->rec, sizeof(call->rec), 1, file) != 1)
+			break;
+		if (call->rec.op >= CAPTURE_NUM_OPS)
+			die("Bad record %zu in capture log", numOf_calls);
+		if (CAPTURE_HAS_NAMES(call->rec.op)
+		    && fread(&call->names, sizeof(call->names), 1, file) != 1)
+			die("Truncated capture log");
+
+		/* Names are NUL-padded, not always NUL-terminated */
+		call->names.name[0][sizeof(call->names.name[0]) - 1] = '\0';
+		call->names.name[1][sizeof(call->names.name[1]) - 1] = '\0';
+		numOf_calls++;
+	}
+
+	fclose(file);
+}
+
+static int map_fd(int fd)
+{
+	if (fd < 0 || fd >= MAX_FD)
+		return -1;
+	return fd_map[fd];
+}
+
+/* Replay one call, with the file system lock held */
+static int replay_call(struct call *call, char **buf, size_t *buf_size)
+{
+	struct captureRecord *rec = &call->rec;
+	int fd, ret = 0;
+
+	if (rec->op == CAPTURE_READ || rec->op == CAPTURE_WRITE) {
+		if (rec->arg0 > *buf_size) {
+			size_t i;
+
+			free(*buf);
+			*buf = malloc(rec->arg0);
+			if (!*buf)
+				die("Cannot allocate buffer");
+			*buf_size = rec->arg0;
+			/* File contents are not recorded, writes carry a pattern */
+			for (i = 0; i < *buf_size; i++)
+				(*buf)[i] = 'a' + i % 26;
+		}
+	}
+
+	switch (rec->op) {
+	case CAPTURE_MOUNT:
+	case CAPTURE_UMOUNT:
+		/* The disk given on the command line stays mounted */
+		break;
+	case CAPTURE_CREATE:
+		ret = fs_create(call->names.name[0]);
+		break;
+	case CAPTURE_DELETE:
+		ret = fs_delete(call->names.name[0]);
+		break;
+	case CAPTURE_OPEN:
+		fd = fs_open(call->names.name[0]);
+		if (rec->fd >= 0 && rec->fd < MAX_FD)
+			fd_map[rec->fd] = fd;
+		ret = fd < 0 ? -1 : 0;
+		break;
+	case CAPTURE_CLOSE:
+		ret = fs_close(map_fd(rec->fd));
+		if (rec->fd >= 0 && rec->fd < MAX_FD)
+			fd_map[rec->fd] = -1;
+		break;
+	case CAPTURE_STAT:
+		ret = fs_stat(map_fd(rec->fd)) < 0 ? -1 : 0;
+		break;
+	case CAPTURE_LSEEK:
+		ret = fs_lseek(map_fd(rec->fd), rec->arg0);
+		break;
+	case CAPTURE_WRITE:
+		ret = fs_write(map_fd(rec->fd), *buf, rec->arg0);
+		bytes += ret > 0 ? ret : 0;
+		ret = ret < 0 ? -1 : 0;
+		break;
+	case CAPTURE_READ:
+		ret = fs_read(map_fd(rec->fd), *buf, rec->arg0);
+		bytes += ret > 0 ? ret : 0;
+		ret = ret < 0 ? -1 : 0;
+		break;
+	case CAPTURE_CLONE:
+		ret = fs_clone(call->names.name[0], call->names.name[1]);
+		break;
+	case CAPTURE_MKDIR:
+		ret = fs_mkdir(call->names.name[0]);
+		break;
+	case CAPTURE_RMDIR:
+		ret = fs_rmdir(call->names.name[0]);
+		break;
+	}
+	counts[rec->op]++;
+
+	return ret;
+}
+
+static void *play(void *arg)
+{
+	struct player *player = arg;
+	size_t buf_size = 0;
+	char *buf = NULL;
+	size_t i;
+
+	for (i = 0; i < player->count; i++) {
+		struct call *call = player->calls[i];
+
+		if (paced) {
+			uint64_t due = start_time + call->rec.timestamp / speed;
+			uint64_t t = now();
+
+			if (t < due) {
+				struct timespec ts = {
+					.tv_sec = (due - t) / 1000000000u,
+					.tv_nsec = (due - t) % 1000000000u,
+				};
+				nanosleep(&ts, NULL);
+			} else if (t - due > player->max_lag) {
+				player->max_lag = t - due;
+			}
+		}
+
+		pthread_mutex_lock(&fs_lock);
+		if (replay_call(call, &buf, &buf_size))
+			player->errors++;
+		pthread_mutex_unlock(&fs_lock);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void usage(const char *program)
+{
+	die("Usage: %s [-p] [-s speed] [-t] <capture log> <diskname>\n"
+	    "Calls are replayed as fast as possible, or with their original\n"
+	    "pacing with -p (-s 2 replays twice as fast). With -t, every\n"
+	    "recorded thread is replayed by its own thread", program);
+}
+
+int main(int argc, char *argv[])
+{
+	struct player *players;
+	size_t numOf_players = 1, errors = 0, i;
+	uint64_t max_lag = 0, elapsed;
+	int threaded = 0, opt, op;
+
+	while ((opt = getopt(argc, argv, "ps:t")) != -1) {
+		switch (opt) {
+		case 'p':
+			paced = 1;
+			break;
+		case 's':
+			speed = strtod(optarg, NULL);
+			if (speed <= 0)
+				usage(argv[0]);
+			break;
+		case 't':
+			threaded = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+
+	load_log(argv[optind]);
+	for (i = 0; i < MAX_FD; i++)
+		fd_map[i] = -1;
+
+	/* Hand every call to the player of its thread, in recorded order */
+	if (threaded)
+		for (i = 0; i < numOf_calls; i++)
+			if (calls[i].rec.thread >= numOf_players)
+				numOf_players = calls[i].rec.thread + 1;
+	players = calloc(numOf_players, sizeof(*players));
+	if (!players)
+		die("Cannot allocate players");
+	for (i = 0; i < numOf_calls; i++)
+		players[threaded ? calls[i].rec.thread : 0].count++;
+	for (i = 0; i < numOf_players; i++) {
+		players[i].calls = malloc((players[i].count + 1) * sizeof(struct call *));
+		if (!players[i].calls)
+			die("Cannot allocate players");
+		players[i].count = 0;
+	}
+	for (i = 0; i < numOf_calls; i++) {
+		struct player *player = &players[threaded ? calls[i].rec.thread : 0];
+
+		player->calls[player->count++] = &calls[i];
+	}
+
+	if (fs_mount(argv[optind + 1]))
+		die("Cannot mount diskname");
+
+	start_time = now();
+	if (numOf_players == 1) {
+		play(&players[0]);
+	} else {
+		for (i = 0; i < numOf_players; i++)
+			if (pthread_create(&players[i].thread, NULL, play, &players[i]))
+				die("Cannot create thread");
+		for (i = 0; i < numOf_players; i++)
+			pthread_join(players[i].thread, NULL);
+	}
+	elapsed = now() - start_time;
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (i = 0; i < numOf_players; i++) {
+		errors += players[i].errors;
+		if (players[i].max_lag > max_lag)
+			max_lag = players[i].max_lag;
+		free(players[i].calls);
+	}
+
+	for (op = 0; op < CAPTURE_NUM_OPS; op++)
+		if (counts[op])
+			printf("%-8s %zu\n", op_names[op], counts[op]);
+	printf("calls=%zu errors=%zu threads=%zu bytes=%zu seconds=%.6f calls_per_s=%.1f",
+	       numOf_calls, errors, numOf_players, bytes, elapsed / 1e9,
+	       elapsed ? numOf_calls / (elapsed / 1e9) : 0);
+	if (paced)
+		printf(" max_lag_us=%.1f", max_lag / 1e3);
+	printf("\n");
+
+	free(players);
+	free(calls);
+
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <trace.h>
+
+#define die(...)								\
+do {											\
+	fprintf(stderr, __VA_ARGS__);				\
+	fprintf(stderr, "\n");						\
+	exit(1);									\
+} while (0)
+
+static const char *event_names[] = {
+#define TRACE_NAME(name, fmt) #name,
+	TRACE_EVENTS(TRACE_NAME)
+#undef TRACE_NAME
+};
+
+static const char *event_formats[] = {
+#define TRACE_FORMAT(name, fmt) fmt,
+	TRACE_EVENTS(TRACE_FORMAT)
+#undef TRACE_FORMAT
+};
+
+/* Records of different threads are interleaved back by time */
+static int compare_records(const void *a, const void *b)
+{
+	const struct traceRecord *ra = a, *rb = b;
+
+	if (ra->timestamp != rb->timestamp)
+		return ra->timestamp < rb->timestamp ? -1 : 1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *file;
+	struct traceHeader header;
+	struct traceRecord *records;
+	size_t counts[TRACE_NUM_EVENTS] = { 0 };
+	int summary = 0;
+	uint32_t i;
+
+	if (argc > 2 && !strcmp(argv[1], "-s")) {
+		summary = 1;
+		argv++;
+		argc--;
+	}
+	if (argc < 2)
+		die("Usage: %s [-s] <trace file>", argv[0]);
+
+	file = fopen(argv[1], "rb");
+	if (!file)
+		die("Cannot open trace file");
+
+	if (fread(&header, sizeof(header), 1, file) != 1
+	    || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+	    || header.recordSize != sizeof(struct traceRecord))
+		die("Not a trace file");
+
+	records = malloc((header.numOf_records + 1) * sizeof(struct traceRecord));
+	if (!records)
+		die("Cannot allocate records");
+	if (fread(records, sizeof(struct traceRecord), header.numOf_records, file)
+	    != header.numOf_records)
+		die("Truncated trace file");
+	fclose(file);
+
+	qsort(records, header.numOf_records, sizeof(struct traceRecord), compare_records);
+
+	for (i = 0; i < header.numOf_records; i++) {
+		struct traceRecord *rec = &records[i];
+
+		if (rec->event >= TRACE_NUM_EVENTS)
+			die("Unknown event %u", rec->event);
+		counts[rec->event]++;
+		if (summary)
+			continue;
+
+		/* Time in microseconds since the first event */
+		printf("%12.3f t%-3u %-12s ",
+		       (rec->timestamp - records[0].timestamp) / 1000.0,
+		       rec->thread, event_names[rec->event]);
+		printf(event_formats[rec->event], (unsigned long long)rec->arg0,
+		       (unsigned long long)rec->arg1, (unsigned long long)rec->arg2);
+		printf("\n");
+	}
+
+	if (summary) {
+		for (i = 0; i < TRACE_NUM_EVENTS; i++)
+			if (counts[i])
+				printf("%-12s %zu\n", event_names[i], counts[i]);
+	}
+
+	free(records);
+	return 0;
+}
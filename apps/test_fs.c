@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +35,144 @@ struct thread_arg {
 	char **argv;
 };
 
+/*
+ * Files are copied in and out of the file system in chunks, so that memory use
+ * does not depend on the file size. The host side and the file system side run
+ * in two threads that hand buffers to each other through a ring of slots: while
+ * one side works on a chunk, the other one works on the previous or next one.
+ */
+#define STREAM_CHUNK (256 * 1024)
+#define STREAM_SLOTS 4
+
+struct stream {
+	char *buf[STREAM_SLOTS];
+	ssize_t len[STREAM_SLOTS];	/* bytes in slot, 0 at the end, -1 on error */
+	unsigned int head;			/* slots filled by the producer */
+	unsigned int tail;			/* slots emptied by the consumer */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;						/* host file descriptor */
+};
+
+void stream_init(struct stream *s, int fd)
+{
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	for (i = 0; i < STREAM_SLOTS; i++) {
+		s->buf[i] = malloc(STREAM_CHUNK);
+		if (!s->buf[i])
+			die_perror("malloc");
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->fd = fd;
+}
+
+void stream_destroy(struct stream *s)
+{
+	int i;
+
+	for (i = 0; i < STREAM_SLOTS; i++)
+		free(s->buf[i]);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+}
+
+/* Wait for an empty slot and return its buffer */
+char *stream_get_free(struct stream *s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->head - s->tail == STREAM_SLOTS)
+		pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+
+	return s->buf[s->head % STREAM_SLOTS];
+}
+
+/* Hand the slot returned by stream_get_free() over to the consumer */
+void stream_put(struct stream *s, ssize_t len)
+{
+	pthread_mutex_lock(&s->lock);
+	s->len[s->head % STREAM_SLOTS] = len;
+	s->head++;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Wait for a filled slot and return its buffer and length */
+char *stream_get_full(struct stream *s, ssize_t *len)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->head == s->tail)
+		pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+
+	*len = s->len[s->tail % STREAM_SLOTS];
+	return s->buf[s->tail % STREAM_SLOTS];
+}
+
+/* Give the slot returned by stream_get_full() back to the producer */
+void stream_release(struct stream *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->tail++;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Consumer thread: write chunks to the host file until the end of the stream */
+void *stream_to_host(void *arg)
+{
+	struct stream *s = arg;
+	int failed = 0;
+	ssize_t len;
+	char *buf;
+
+	while ((buf = stream_get_full(s, &len)), len > 0) {
+		ssize_t done = 0;
+
+		/* After an error, keep draining so that the producer never blocks */
+		while (!failed && done < len) {
+			ssize_t ret = write(s->fd, buf + done, len - done);
+
+			if (ret < 0)
+				failed = 1;
+			else
+				done += ret;
+		}
+		stream_release(s);
+	}
+	stream_release(s);
+
+	return failed ? s : NULL;
+}
+
+/* Producer thread: read chunks from the host file until its end */
+void *stream_from_host(void *arg)
+{
+	struct stream *s = arg;
+	ssize_t len;
+
+	do {
+		char *buf = stream_get_free(s);
+		ssize_t ret;
+
+		len = 0;
+		while (len < STREAM_CHUNK) {
+			ret = read(s->fd, buf + len, STREAM_CHUNK - len);
+			if (ret <= 0)
+				break;
+			len += ret;
+		}
+		if (ret < 0)
+			len = -1;
+		stream_put(s, len);
+	} while (len > 0);
+
+	return NULL;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -319,7 +458,10 @@ void thread_fs_stat(void *arg)
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
+	struct stream stream;
+	pthread_t writer;
+	void *failed;
 	int fs_fd;
 	int stat, read;
 
@@ -348,14 +490,30 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
 
-	read = fs_read(fs_fd, buf, stat);
+	/* Contents are streamed out as they are read, after the header */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+
+	stream_init(&stream, STDOUT_FILENO);
+	if (pthread_create(&writer, NULL, stream_to_host, &stream))
+		die("Cannot create thread");
+
+	for (read = 0; read < stat; ) {
+		char *buf = stream_get_free(&stream);
+		int len = stat - read < STREAM_CHUNK ? stat - read : STREAM_CHUNK;
+		int ret = fs_read(fs_fd, buf, len);
+
+		if (ret <= 0)
+			break;
+		stream_put(&stream, ret);
+		read += ret;
+	}
+	stream_get_free(&stream);
+	stream_put(&stream, 0);
+	pthread_join(writer, &failed);
+	stream_destroy(&stream);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -365,12 +523,10 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
+	if (read < stat)
+		die("Cannot read file (%d/%d bytes)", read, stat);
+	if (failed)
+		die_perror("write");
 }
 
 void thread_fs_rm(void *arg)
@@ -398,13 +554,171 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <directory>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(dirname)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <directory>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(dirname)) {
+		fs_umount();
+		die("Cannot remove directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", dirname);
+}
+
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <clone filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' into '%s'\n", src, dst);
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int enable;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <on|off>");
+
+	diskname = t_arg->argv[0];
+	enable = !strcmp(t_arg->argv[1], "on");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_dedup(enable)) {
+		fs_umount();
+		die("Cannot change deduplication mode");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Deduplication %s\n", enable ? "enabled" : "disabled");
+}
+
+void thread_fs_compress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int enable;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <on|off>");
+
+	diskname = t_arg->argv[0];
+	enable = !strcmp(t_arg->argv[1], "on");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_compress(enable)) {
+		fs_umount();
+		die("Cannot change compression mode");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Compression %s\n", enable ? "enabled" : "disabled");
+}
+
+void thread_fs_checksum(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int enable;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <on|off>");
+
+	diskname = t_arg->argv[0];
+	enable = !strcmp(t_arg->argv[1], "on");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_checksum(enable)) {
+		fs_umount();
+		die("Cannot change checksum mode");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Checksums %s\n", enable ? "enabled" : "disabled");
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
+	struct stream stream;
+	pthread_t reader;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	size_t written = 0;
+	int disk_full = 0, host_error = 0;
+	ssize_t len;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <host filename>");
@@ -421,11 +735,6 @@ void thread_fs_add(void *arg)
 	if (!S_ISREG(st.st_mode))
 		die("Not a regular file: %s\n", filename);
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
 	/* Now, deal with our filesystem:
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
@@ -444,7 +753,28 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	/* Copy the host file chunk by chunk, while the next chunk is being read */
+	stream_init(&stream, fd);
+	if (pthread_create(&reader, NULL, stream_from_host, &stream))
+		die("Cannot create thread");
+
+	while ((buf = stream_get_full(&stream, &len)), len != 0) {
+		if (len < 0) {
+			host_error = 1;
+			break;
+		}
+		/* Once the disk is full, the rest of the file is skipped */
+		if (!disk_full) {
+			int ret = fs_write(fs_fd, buf, len);
+
+			written += ret > 0 ? ret : 0;
+			disk_full = ret < len;
+		}
+		stream_release(&stream);
+	}
+	stream_release(&stream);
+	pthread_join(reader, NULL);
+	stream_destroy(&stream);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -454,10 +784,12 @@ void thread_fs_add(void *arg)
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	if (host_error)
+		die_perror("read");
+
+	printf("Wrote file '%s' (%zu/%zu bytes)\n", filename, written,
 		   st.st_size);
 
-	munmap(buf, st.st_size);
 	close(fd);
 }
 
@@ -480,6 +812,36 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fsDirEntry entries[16];
+	size_t cookie = 0;
+	char *diskname, *dirname;
+	int i, n;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<directory>]");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argc > 1 ? t_arg->argv[1] : NULL;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	while ((n = fs_readdir(dirname, &cookie, entries, ARRAY_SIZE(entries))) > 0)
+		for (i = 0; i < n; i++)
+			printf("%s: %s, size: %zu, data_blk: %u, blocks: %zu\n",
+			       entries[i].directory ? "dir" : "file",
+			       entries[i].name, entries[i].size,
+			       entries[i].first_block, entries[i].blocks);
+	if (n < 0)
+		die("Cannot read directory");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -507,19 +869,52 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_perf(void *arg);
+
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
+	{ "dir",	thread_fs_dir },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
+	{ "clone",	thread_fs_clone },
+	{ "dedup",	thread_fs_dedup },
+	{ "compress",	thread_fs_compress },
+	{ "checksum",	thread_fs_checksum },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "perf",	thread_fs_perf }
 };
 
+void thread_fs_perf(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	size_t i;
+
+	if (t_arg->argc < 1)
+		die("Usage: <command> [<arg>]");
+
+	cmd_arg.argc = t_arg->argc - 1;
+	cmd_arg.argv = &t_arg->argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(t_arg->argv[0], commands[i].name)) {
+			fs_perf_reset();
+			commands[i].func(&cmd_arg);
+			fs_perf_stats();
+			return;
+		}
+	}
+	die("invalid command '%s'", t_arg->argv[0]);
+}
+
 void usage(char *program)
 {
 	size_t i;
@@ -244,6 +244,64 @@ END_SCRIPT
     log "Score: ${score}"
 }
 
+#
+# Consistency checker
+#
+
+# repair a corrupted map entry of a sparse file on a disk with checksums
+check_repair_mapped() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x checksum test.fs on
+    cat <<END_SCRIPT > write_sparse.script
+MOUNT
+CREATE	file_sparse
+OPEN	file_sparse
+WRITE	DATA	head
+SEEK	40960
+WRITE	DATA	tail
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs write_sparse.script
+	# point the map entry of the last block past the end of the disk
+	python3 - <<END_PYTHON
+import struct
+disk = bytearray(open("test.fs", "rb").read())
+rdir, data = struct.unpack_from("<HH", disk, 10)
+for e in range(128):
+    entry = rdir * 4096 + e * 32
+    if disk[entry:entry + 12] == b"file_sparse\0":
+        index = struct.unpack_from("<H", disk, entry + 20)[0]
+block_map = struct.unpack_from("<H", disk, (data + index) * 4096)[0]
+struct.pack_into("<H", disk, (data + block_map) * 4096 + 10 * 2, 9999)
+open("test.fs", "wb").write(disk)
+END_PYTHON
+    cat <<END_SCRIPT > read_sparse.script
+MOUNT
+OPEN	file_sparse
+READ	4	DATA	head
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_test ./fs_fsck.x -r test.fs
+	local repair_out="${STDOUT}"
+	run_test ./test_fs.x script test.fs read_sparse.script
+	rm -f test.fs write_sparse.script read_sparse.script
+
+	local line_array=()
+	line_array+=("$(select_line "${repair_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	local corr_array=()
+	corr_array+=("file: file_sparse, 1 invalid map entries (made holes)")
+	corr_array+=("Read 4 bytes from file. Compared 4 correct.")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Run tests
 #
@@ -255,6 +313,8 @@ run_tests() {
 	create_simple
     # Phase 3 + 4
 	read_block
+	# Consistency checker
+	check_repair_mapped
 }
 
 make_fs() {
@@ -262,7 +322,7 @@ make_fs() {
     make > /dev/null 2>&1 ||
         die "Compilation failed"
 
-    local execs=("test_fs.x" "fs_make.x" "fs_ref.x")
+    local execs=("test_fs.x" "fs_make.x" "fs_ref.x" "fs_fsck.x")
 
     # Make sure executables were properly created
     local x
@@ -0,0 +1,100 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+/*
+ * Records go through a single buffered log file. Unlike trace events, every
+ * call must make it to the log, in order, so appending is serialized with a
+ * mutex. The timestamp is taken under the mutex too, so that records are
+ * written in timestamp order.
+ */
+
+int capture_enabled = 0;
+static FILE *log_file = NULL;
+static uint64_t start_time;
+static uint16_t numOf_threads = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int myThread = -1;
+
+// Function to get the current time in nanoseconds
+static uint64_t capture_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void capture_record(enum captureOp op, int fd, uint64_t arg0, uint64_t arg1,
+                    const char *name0, const char *name1)
+{
+	pthread_mutex_lock(&log_lock);
+	if (log_file == NULL) {
+		pthread_mutex_unlock(&log_lock);
+		return;
+	}
+
+	if (myThread == -1) {
+		myThread = numOf_threads++;
+	}
+
+	struct captureRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.timestamp = capture_now() - start_time;
+	rec.op = op;
+	rec.thread = myThread;
+	rec.fd = fd;
+	rec.arg0 = arg0;
+	rec.arg1 = arg1;
+	fwrite(&rec, sizeof(rec), 1, log_file);
+
+	if (CAPTURE_HAS_NAMES(op)) {
+		struct captureNames names;
+		memset(&names, 0, sizeof(names));
+		if (name0 != NULL) {
+			strncpy(names.name[0], name0, sizeof(names.name[0]));
+		}
+		if (name1 != NULL) {
+			strncpy(names.name[1], name1, sizeof(names.name[1]));
+		}
+		fwrite(&names, sizeof(names), 1, log_file);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+int capture_start(const char *filename)
+{
+	pthread_mutex_lock(&log_lock);
+	if (log_file != NULL || (log_file = fopen(filename, "wb")) == NULL) {
+		pthread_mutex_unlock(&log_lock);
+		return -1;
+	}
+
+	struct captureHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.recordSize = sizeof(struct captureRecord);
+	fwrite(&header, sizeof(header), 1, log_file);
+
+	start_time = capture_now();
+	capture_enabled = 1;
+	pthread_mutex_unlock(&log_lock);
+	return 0;
+}
+
+int capture_stop(void)
+{
+	pthread_mutex_lock(&log_lock);
+	if (log_file == NULL) {
+		pthread_mutex_unlock(&log_lock);
+		return -1;
+	}
+
+	capture_enabled = 0;
+	int ret = (ferror(log_file) || fclose(log_file)) ? -1 : 0;
+	log_file = NULL;
+	pthread_mutex_unlock(&log_lock);
+	return ret;
+}
@@ -0,0 +1,92 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * Workload capture. While capture is on, every call to the file system API
+ * that a workload is made of is appended to a binary log, with its arguments
+ * and a timestamp, so that fs_replay.x can play the workload again on another
+ * disk. File contents are not captured.
+ */
+#define CAPTURE_OPS(X)				\
+	X(MOUNT)						\
+	X(UMOUNT)						\
+	X(CREATE)						\
+	X(DELETE)						\
+	X(OPEN)							\
+	X(CLOSE)						\
+	X(STAT)							\
+	X(LSEEK)						\
+	X(WRITE)						\
+	X(READ)							\
+	X(CLONE)						\
+	X(MKDIR)						\
+	X(RMDIR)
+
+enum captureOp {
+#define CAPTURE_ENUM(name) CAPTURE_##name,
+	CAPTURE_OPS(CAPTURE_ENUM)
+#undef CAPTURE_ENUM
+	CAPTURE_NUM_OPS
+};
+
+// One captured call. CREATE, DELETE, OPEN, CLONE, MKDIR and RMDIR records are
+// followed by a struct captureNames holding their path arguments.
+#define CAPTURE_HAS_NAMES(op)												\
+	((op) == CAPTURE_CREATE || (op) == CAPTURE_DELETE || (op) == CAPTURE_OPEN ||	\
+	 (op) == CAPTURE_CLONE || (op) == CAPTURE_MKDIR || (op) == CAPTURE_RMDIR)
+
+struct captureRecord {
+	uint64_t timestamp;		// nanoseconds since capture started
+	uint16_t op;			// enum captureOp
+	uint16_t thread;		// thread number, in the order threads first made a call
+	int32_t fd;				// file descriptor argument (or result of OPEN)
+	uint64_t arg0;			// LSEEK: offset, READ/WRITE: count
+	uint64_t arg1;			// READ/WRITE: file offset at the time of the call
+};
+
+struct captureNames {
+	char name[2][FS_PATH_MAX];	// paths, NUL-padded (second one only for CLONE)
+};
+
+// Header of a capture log, followed by the records in the order calls were made
+struct captureHeader {
+	char magic[8];			// "FSCAPT02"
+	uint32_t recordSize;	// sizeof(struct captureRecord)
+	uint32_t unused;
+};
+
+#define CAPTURE_MAGIC "FSCAPT02"
+
+extern int capture_enabled;
+
+void capture_record(enum captureOp op, int fd, uint64_t arg0, uint64_t arg1,
+                    const char *name0, const char *name1);
+
+// Capture a call to the file system API if capture is on
+#define capture_call(op, fd, arg0, arg1, name0, name1)								\
+do {																				\
+	if (__builtin_expect(capture_enabled, 0))										\
+		capture_record(CAPTURE_##op, (fd), (arg0), (arg1), (name0), (name1));		\
+} while (0)
+
+/**
+ * capture_start - Start capturing calls into a log file
+ * @filename: Log file to create
+ *
+ * Return: -1 if capture is already on or if @filename cannot be created. 0
+ * otherwise.
+ */
+int capture_start(const char *filename);
+
+/**
+ * capture_stop - Stop capturing calls and close the log file
+ *
+ * Return: -1 if capture is off or if the log cannot be written. 0 otherwise.
+ */
+int capture_stop(void);
+
+#endif /* _CAPTURE_H */
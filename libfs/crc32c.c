@@ -0,0 +1,144 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82F63B78		// Castagnoli polynomial, bit-reflected
+#define CRC_STREAM 1360				// bytes per stream when three streams run in parallel
+
+/*
+ * All functions below work on the raw CRC register: the initial and final
+ * inversions of CRC-32C are only applied by crc32c(). Since the raw CRC is
+ * linear, the CRC of A followed by B is the CRC of A shifted over len(B) zero
+ * bytes, XORed with the CRC of B computed from 0. This is what allows the
+ * hardware path to checksum three independent streams at once.
+ */
+
+static uint32_t sliceTable[8][256];		// slicing-by-8 tables of the software path
+static uint32_t shiftTable[4][256];		// shifts a raw CRC over CRC_STREAM zero bytes
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *p, size_t len) = NULL;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;	// builds the tables before any thread uses them
+
+// Function to read 8 bytes from a possibly unaligned location
+static uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Function to update a raw CRC one byte at a time
+static uint32_t crc32c_bytes(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--) {
+		crc = sliceTable[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// Function to update a raw CRC 8 bytes at a time with the slicing-by-8 tables
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len >= 8) {
+		uint64_t v = read64(p) ^ crc;
+		crc = sliceTable[7][v & 0xFF] ^ sliceTable[6][(v >> 8) & 0xFF] ^
+		      sliceTable[5][(v >> 16) & 0xFF] ^ sliceTable[4][(v >> 24) & 0xFF] ^
+		      sliceTable[3][(v >> 32) & 0xFF] ^ sliceTable[2][(v >> 40) & 0xFF] ^
+		      sliceTable[1][(v >> 48) & 0xFF] ^ sliceTable[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	return crc32c_bytes(crc, p, len);
+}
+
+// Function to shift a raw CRC over CRC_STREAM zero bytes
+static uint32_t crc32c_shift(uint32_t crc)
+{
+	return shiftTable[0][crc & 0xFF] ^ shiftTable[1][(crc >> 8) & 0xFF] ^
+	       shiftTable[2][(crc >> 16) & 0xFF] ^ shiftTable[3][crc >> 24];
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+// Function to update a raw CRC with the SSE4.2 crc32 instruction. The instruction has a
+// latency of 3 cycles but a throughput of 1 per cycle, so large buffers are split into
+// three streams that are checksummed in parallel and combined afterwards.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc0 = crc;
+
+	while (len >= 3 * CRC_STREAM) {
+		uint64_t crc1 = 0, crc2 = 0;
+		for (size_t i = 0; i < CRC_STREAM; i += 8) {
+			crc0 = _mm_crc32_u64(crc0, read64(p + i));
+			crc1 = _mm_crc32_u64(crc1, read64(p + CRC_STREAM + i));
+			crc2 = _mm_crc32_u64(crc2, read64(p + 2 * CRC_STREAM + i));
+		}
+		crc0 = crc32c_shift(crc0) ^ crc1;
+		crc0 = crc32c_shift(crc0) ^ crc2;
+		p += 3 * CRC_STREAM;
+		len -= 3 * CRC_STREAM;
+	}
+
+	while (len >= 8) {
+		crc0 = _mm_crc32_u64(crc0, read64(p));
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc0 = _mm_crc32_u8(crc0, *p++);
+	}
+	return crc0;
+}
+#endif
+
+// Function to build the tables and pick the fastest implementation for this processor
+static void crc32c_init(void)
+{
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t crc = n;
+		for (int k = 0; k < 8; k++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		sliceTable[0][n] = crc;
+	}
+	for (uint32_t n = 0; n < 256; n++) {
+		for (int k = 1; k < 8; k++) {
+			sliceTable[k][n] = sliceTable[0][sliceTable[k - 1][n] & 0xFF] ^ (sliceTable[k - 1][n] >> 8);
+		}
+	}
+
+	// The shift is linear, so it is known from where it sends each bit of the register
+	static const uint8_t zeros[CRC_STREAM];
+	uint32_t column[32];
+	for (int bit = 0; bit < 32; bit++) {
+		column[bit] = crc32c_sw(1u << bit, zeros, CRC_STREAM);
+	}
+	for (int k = 0; k < 4; k++) {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t crc = 0;
+			for (int bit = 0; bit < 8; bit++) {
+				if (n & (1u << bit)) {
+					crc ^= column[8 * k + bit];
+				}
+			}
+			shiftTable[k][n] = crc;
+		}
+	}
+
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_hw;
+	}
+#endif
+}
+
+uint32_t crc32c(const void *buf, size_t len)
+{
+	pthread_once(&initOnce, crc32c_init);
+	return ~crc32c_impl(~0u, buf, len);
+}
@@ -0,0 +1,22 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * crc32c - Compute the CRC-32C (Castagnoli) checksum of a buffer
+ * @buf: Data to checksum
+ * @len: Number of bytes of data in @buf
+ *
+ * Compute the CRC-32C of @len bytes of @buf, as used by iSCSI, ext4 and SSE4.2.
+ * The SSE4.2 crc32 instruction is used when the processor supports it, which
+ * is detected at runtime the first time the function is called. Otherwise a
+ * table-driven implementation (slicing-by-8) is used. Both give the same
+ * result.
+ *
+ * Return: The checksum of @buf.
+ */
+uint32_t crc32c(const void *buf, size_t len);
+
+#endif /* _CRC32C_H */
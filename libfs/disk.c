@@ -1,8 +1,16 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 /**
@@ -10,6 +18,8 @@
  */
 
 #include "disk.h"
+#include "perf.h"
+#include "trace.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -17,21 +27,605 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Prefix of disk names that select the RAM backend */
+#define RAM_PREFIX "ram:"
+
+/* Prefix of disk names that stripe blocks over several images (RAID-0) */
+#define RAID0_PREFIX "raid0:"
+
+/* Prefix of disk names that mirror blocks on several images (RAID-1) */
+#define RAID1_PREFIX "raid1:"
+
+/* Prefix of disk names that put a fast image in front of a slow one */
+#define TIER_PREFIX "tier:"
+
+/* Consecutive blocks read from the same mirror before moving to the next one */
+#define MIRROR_CHUNK 16
+
+/* Blocks copied at a time while resyncing a mirror */
+#define RESYNC_CHUNK 64
+
+/*
+ * Suffix of the name a new mirror is built under until its resync completes.
+ * The image only grows as blocks are copied to it, so its size is how far the
+ * resync got.
+ */
+#define RESYNC_SUFFIX ".resync"
+
+/* State of an image of a volume */
+enum memberState {
+	MEMBER_OK,			/* holds every block */
+	MEMBER_FAILED,		/* unusable, left out of the volume */
+	MEMBER_RESYNC,		/* holds the blocks before @resync_pos only */
+};
+
+/* Most images a volume can be made of */
+#define MAX_MEMBERS 16
+
+/* Signature of the header block of the images of a striped or tiered volume */
+#define VOLUME_MAGIC "ECS150VL"
+
+/*
+ * Header stored in the last block of each image of a striped or tiered volume,
+ * after the blocks of the volume it holds
+ */
+struct volumeHeader {
+	char magic[8];
+	uint64_t volume_id;		/* shared by all the images of the volume */
+	uint32_t member;		/* position of the image in the volume */
+	uint32_t numOf_members;
+	uint64_t unit;			/* stripe unit, or fast blocks of a tiered volume */
+	uint32_t tiered;
+} __attribute__((packed));
+
+/* Most blocks moved by a single transfer of block_submit() */
+#define MAX_MERGE 256
+
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
+	/* File descriptor (of the first member of a volume) */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Blocks of a RAM disk (NULL for a disk file) */
+	char *mem;
+	/* Images of a striped or mirrored volume (0 for a single disk file) */
+	int numOf_members;
+	/* File descriptor of each image */
+	int member_fd[MAX_MEMBERS];
+	/* Blocks in each stripe unit */
+	size_t stripe;
+	/* Blocks of a tiered volume held by its fast image, which come first */
+	size_t fast_blocks;
+	/* Block after the last one block_submit() transferred, in each image */
+	size_t head[MAX_MEMBERS];
+	/* Every image holds every block (RAID-1) */
+	int mirrored;
+	/* State of each image of a mirrored volume */
+	enum memberState member_state[MAX_MEMBERS];
+	/* Blocks before this one are already copied to the images being resynced */
+	size_t resync_pos;
+	/* Name each image being resynced gets once complete (NULL if none) */
+	char *resync_name[MAX_MEMBERS];
+	/* Thread copying blocks to the images being resynced */
+	pthread_t resync_thread;
+	int resync_running;
+	int resync_stop;
+	/* Serializes I/O on a mirrored volume with its resync thread */
+	pthread_mutex_t lock;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = { .fd = INVALID_FD, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Blocks of a striped volume go round-robin over its images, one stripe unit
+ * at a time: block @block lives in the returned image, at index @mblock. The
+ * images of a tiered volume are simply laid end to end.
+ */
+static int locate(size_t block, size_t *mblock)
+{
+	size_t unit;
+
+	if (!disk.numOf_members) {
+		*mblock = block;
+		return 0;
+	}
+
+	if (disk.fast_blocks) {
+		if (block < disk.fast_blocks) {
+			*mblock = block;
+			return 0;
+		}
+		*mblock = block - disk.fast_blocks;
+		return 1;
+	}
+
+	unit = block / disk.stripe;
+	*mblock = unit / disk.numOf_members * disk.stripe + block % disk.stripe;
+	return unit % disk.numOf_members;
+}
+
+/* Number of blocks image @member of a volume of @bcount blocks holds */
+static size_t member_blocks(int member, size_t bcount, int numOf_members, size_t stripe)
+{
+	size_t units = bcount / stripe;
+	size_t blocks = (units / numOf_members + ((size_t)member < units % numOf_members)) * stripe;
+
+	if ((size_t)member == units % numOf_members)
+		blocks += bcount % stripe;
+	return blocks;
+}
+
+/* Temporary name of image @name while it is being resynced */
+static void resync_tmp_name(char *buf, const char *name)
+{
+	snprintf(buf, PATH_MAX, "%s" RESYNC_SUFFIX, name);
+}
+
+static void volume_close(void)
+{
+	int i;
+
+	if (disk.resync_running) {
+		pthread_mutex_lock(&disk.lock);
+		disk.resync_stop = 1;
+		pthread_mutex_unlock(&disk.lock);
+		pthread_join(disk.resync_thread, NULL);
+		disk.resync_running = 0;
+	}
+
+	for (i = 0; i < disk.numOf_members; i++) {
+		/* A resync cut short goes on from where it stopped at the next open */
+		if (disk.resync_name[i] && disk.member_fd[i] != INVALID_FD)
+			fdatasync(disk.member_fd[i]);
+		if (disk.member_fd[i] != INVALID_FD)
+			close(disk.member_fd[i]);
+		free(disk.resync_name[i]);
+		disk.resync_name[i] = NULL;
+	}
+	disk.numOf_members = 0;
+	disk.mirrored = 0;
+	disk.fast_blocks = 0;
+}
+
+/* Whether mirror @member holds an up-to-date copy of @block */
+static int in_sync(int member, size_t block)
+{
+	return disk.member_state[member] == MEMBER_OK
+		|| (disk.member_state[member] == MEMBER_RESYNC && block < disk.resync_pos);
+}
+
+/* Leave a mirror out after an I/O error. Return -1 if no mirror is left. */
+static int mirror_fail(int member)
+{
+	int i;
+
+	if (disk.member_state[member] != MEMBER_FAILED) {
+		block_error("image %d failed, volume is degraded", member);
+		disk.member_state[member] = MEMBER_FAILED;
+	}
+	for (i = 0; i < disk.numOf_members; i++)
+		if (disk.member_state[i] == MEMBER_OK)
+			return 0;
+	return -1;
+}
+
+/*
+ * Mirror to read @block from. Reads alternate between the up-to-date mirrors
+ * every MIRROR_CHUNK blocks, so that sequential reads are spread over all of
+ * them while each mirror still sees sequential runs.
+ */
+static int read_mirror(size_t block)
+{
+	int candidates[MAX_MEMBERS];
+	int n = 0, i;
+
+	for (i = 0; i < disk.numOf_members; i++)
+		if (in_sync(i, block))
+			candidates[n++] = i;
+	if (n == 0)
+		return -1;
+	return candidates[block / MIRROR_CHUNK % n];
+}
+
+/* Read @block from a mirror, falling back to the others on errors */
+static int mirror_read(size_t block, void *buf)
+{
+	int member;
+
+	while ((member = read_mirror(block)) != -1) {
+		if (pread(disk.member_fd[member], buf, BLOCK_SIZE, block * BLOCK_SIZE) == BLOCK_SIZE)
+			return 0;
+		perror("pread");
+		mirror_fail(member);
+	}
+
+	block_error("no image holds block %zu", block);
+	return -1;
+}
+
+/* Write @block to every mirror, or at least to one */
+static int mirror_write(size_t block, const void *buf)
+{
+	int written = 0, i;
+
+	for (i = 0; i < disk.numOf_members; i++) {
+		/* Blocks past the resync position are copied over by the resync */
+		if (!in_sync(i, block))
+			continue;
+		if (pwrite(disk.member_fd[i], buf, BLOCK_SIZE, block * BLOCK_SIZE) == BLOCK_SIZE) {
+			written++;
+		} else {
+			perror("pwrite");
+			mirror_fail(i);
+		}
+	}
+
+	if (!written) {
+		block_error("no image took block %zu", block);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Resync thread: copy every block from an up-to-date mirror to the new ones,
+ * then give them their real name. Until then, a new image only exists under a
+ * temporary name, so that an image left half copied is never taken for a
+ * complete one.
+ */
+static void *resync(void *arg)
+{
+	char *buf = malloc(RESYNC_CHUNK * BLOCK_SIZE);
+	char tmp[PATH_MAX];
+	int i, src;
+
+	(void)arg;
+	pthread_mutex_lock(&disk.lock);
+	while (buf && !disk.resync_stop && disk.resync_pos < disk.bcount) {
+		size_t n = disk.bcount - disk.resync_pos < RESYNC_CHUNK
+			? disk.bcount - disk.resync_pos : RESYNC_CHUNK;
+		off_t offset = disk.resync_pos * BLOCK_SIZE;
+
+		for (src = 0; src < disk.numOf_members; src++)
+			if (disk.member_state[src] == MEMBER_OK)
+				break;
+		if (src == disk.numOf_members)
+			break;
+		if (pread(disk.member_fd[src], buf, n * BLOCK_SIZE, offset) != (ssize_t)(n * BLOCK_SIZE)) {
+			mirror_fail(src);
+			continue;
+		}
+		for (i = 0; i < disk.numOf_members; i++)
+			if (disk.member_state[i] == MEMBER_RESYNC
+			    && pwrite(disk.member_fd[i], buf, n * BLOCK_SIZE, offset) != (ssize_t)(n * BLOCK_SIZE))
+				mirror_fail(i);
+		disk.resync_pos += n;
+
+		/* Let block I/O in between chunks */
+		pthread_mutex_unlock(&disk.lock);
+		pthread_mutex_lock(&disk.lock);
+	}
+	if (disk.resync_pos >= disk.bcount) {
+		for (i = 0; i < disk.numOf_members; i++) {
+			if (disk.member_state[i] != MEMBER_RESYNC)
+				continue;
+			resync_tmp_name(tmp, disk.resync_name[i]);
+			if (fdatasync(disk.member_fd[i]) || rename(tmp, disk.resync_name[i])) {
+				perror(disk.resync_name[i]);
+				mirror_fail(i);
+				continue;
+			}
+			free(disk.resync_name[i]);
+			disk.resync_name[i] = NULL;
+			disk.member_state[i] = MEMBER_OK;
+		}
+	}
+	pthread_mutex_unlock(&disk.lock);
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Open a volume described as "raid1:<image>,<image>...". An image that cannot
+ * be opened leaves the volume degraded; an image that does not exist yet is
+ * created under a temporary name, and filled in the background from the others.
+ * If an earlier resync left the image under that name, it goes on from there.
+ */
+static int mirror_open(const char *desc)
+{
+	char names[PATH_MAX], tmp[PATH_MAX];
+	char *name, *save;
+	struct stat st;
+	int numOf_new = 0, numOf_ok = 0, i;
+
+	if (strlen(desc) >= sizeof(names)) {
+		block_error("volume description too long");
+		return -1;
+	}
+	strcpy(names, desc);
+
+	disk.numOf_members = 0;
+	disk.mirrored = 1;
+	disk.bcount = 0;
+	for (name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		int m = disk.numOf_members;
+
+		if (m == MAX_MEMBERS) {
+			block_error("more than %d images", MAX_MEMBERS);
+			volume_close();
+			return -1;
+		}
+		disk.numOf_members++;
+		disk.member_state[m] = MEMBER_OK;
+
+		if ((disk.member_fd[m] = open(name, O_RDWR)) < 0) {
+			resync_tmp_name(tmp, name);
+			if (errno == ENOENT
+			    && (disk.member_fd[m] = open(tmp, O_RDWR | O_CREAT, 0644)) >= 0) {
+				disk.member_state[m] = MEMBER_RESYNC;
+				disk.resync_name[m] = strdup(name);
+				if (!disk.resync_name[m]) {
+					block_error("cannot allocate image name");
+					volume_close();
+					return -1;
+				}
+				numOf_new++;
+				continue;
+			}
+			perror(name);
+			disk.member_state[m] = MEMBER_FAILED;
+			continue;
+		}
+		if (fstat(disk.member_fd[m], &st) || st.st_size % BLOCK_SIZE != 0
+		    || (disk.bcount && (size_t)st.st_size != disk.bcount * BLOCK_SIZE)) {
+			block_error("image '%s' does not match the other images", name);
+			volume_close();
+			return -1;
+		}
+		disk.bcount = st.st_size / BLOCK_SIZE;
+		numOf_ok++;
+	}
+
+	if (disk.numOf_members < 2 || numOf_ok == 0) {
+		block_error("a volume needs at least two images, one of them readable");
+		volume_close();
+		return -1;
+	}
+
+	/*
+	 * New images get the blocks of the others, from the first block none of
+	 * them holds yet: what a resync copies before it is cut short is kept
+	 */
+	disk.resync_pos = disk.bcount;
+	if (numOf_new) {
+		for (i = 0; i < disk.numOf_members; i++)
+			if (disk.member_state[i] == MEMBER_RESYNC
+			    && !fstat(disk.member_fd[i], &st)
+			    && (size_t)st.st_size / BLOCK_SIZE < disk.resync_pos)
+				disk.resync_pos = st.st_size / BLOCK_SIZE;
+		for (i = 0; i < disk.numOf_members; i++) {
+			if (disk.member_state[i] == MEMBER_RESYNC
+			    && ftruncate(disk.member_fd[i], disk.resync_pos * BLOCK_SIZE)) {
+				perror("ftruncate");
+				disk.member_state[i] = MEMBER_FAILED;
+			}
+		}
+		disk.resync_stop = 0;
+		disk.resync_running = !pthread_create(&disk.resync_thread, NULL, resync, NULL);
+		if (!disk.resync_running) {
+			block_error("cannot start resync");
+			for (i = 0; i < disk.numOf_members; i++)
+				if (disk.member_state[i] == MEMBER_RESYNC)
+					disk.member_state[i] = MEMBER_FAILED;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Split "<unit>:<image>,<image>..." into its unit and its images, the names of
+ * which are left in @names. Return the number of images, or -1.
+ */
+static int parse_volume(const char *desc, int tiered, size_t *unit,
+			char names[PATH_MAX], char *members[MAX_MEMBERS])
+{
+	char *name, *save;
+	int n = 0;
+
+	*unit = strtoul(desc, &name, 10);
+	if (*unit == 0 || *name != ':') {
+		block_error("invalid %s in '%s'", tiered ? "fast tier size" : "stripe unit", desc);
+		return -1;
+	}
+	if (strlen(name + 1) >= PATH_MAX) {
+		block_error("volume description too long");
+		return -1;
+	}
+	strcpy(names, name + 1);
+
+	for (name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_MEMBERS) {
+			block_error("more than %d images", MAX_MEMBERS);
+			return -1;
+		}
+		members[n++] = name;
+	}
+	if (n < 2 || (tiered && n != 2)) {
+		block_error("%s", tiered ? "a tiered volume needs a fast and a slow image"
+			    : "a volume needs at least two images");
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * Open a volume described as "<stripe unit>:<image>,<image>...", or as
+ * "<fast blocks>:<fast image>,<slow image>" if @tiered. Every image must carry
+ * the header of this volume at its place in the list, so that images of
+ * another volume, or swapped images, are caught even if their sizes match.
+ */
+static int volume_open(const char *desc, int tiered)
+{
+	struct volumeHeader header[MAX_MEMBERS];
+	char *members[MAX_MEMBERS];
+	size_t sizes[MAX_MEMBERS];
+	char names[PATH_MAX];
+	struct stat st;
+	size_t total = 0, unit;
+	int n, i;
+
+	n = parse_volume(desc, tiered, &unit, names, members);
+	if (n < 0)
+		return -1;
+	disk.stripe = tiered ? 0 : unit;
+	disk.fast_blocks = tiered ? unit : 0;
+
+	disk.numOf_members = 0;
+	for (i = 0; i < n; i++) {
+		int fd;
+
+		if ((fd = open(members[i], O_RDWR, 0644)) < 0 || fstat(fd, &st)) {
+			perror(members[i]);
+			if (fd >= 0)
+				close(fd);
+			volume_close();
+			return -1;
+		}
+		disk.member_fd[disk.numOf_members++] = fd;
+
+		if (st.st_size % BLOCK_SIZE != 0 || st.st_size < BLOCK_SIZE
+		    || pread(fd, &header[i], sizeof(header[i]), st.st_size - BLOCK_SIZE)
+		       != sizeof(header[i])
+		    || memcmp(header[i].magic, VOLUME_MAGIC, sizeof(header[i].magic))) {
+			block_error("'%s' is not an image of a volume", members[i]);
+			volume_close();
+			return -1;
+		}
+		if (header[i].volume_id != header[0].volume_id || header[i].member != (uint32_t)i
+		    || header[i].numOf_members != (uint32_t)n || header[i].unit != unit
+		    || header[i].tiered != (uint32_t)tiered) {
+			block_error("image %d ('%s') does not belong at this place of this volume",
+				    i, members[i]);
+			volume_close();
+			return -1;
+		}
+		sizes[i] = st.st_size / BLOCK_SIZE - 1;
+		total += sizes[i];
+	}
+
+	if (tiered) {
+		if (sizes[0] != disk.fast_blocks) {
+			block_error("images do not form a tiered volume with %zu fast blocks",
+				    disk.fast_blocks);
+			volume_close();
+			return -1;
+		}
+		disk.bcount = total;
+		return 0;
+	}
+
+	for (i = 0; i < disk.numOf_members; i++) {
+		if (sizes[i] != member_blocks(i, total, disk.numOf_members, disk.stripe)) {
+			block_error("image %d does not belong to a volume of %zu blocks",
+				    i, total);
+			volume_close();
+			return -1;
+		}
+	}
+
+	disk.bcount = total;
+	return 0;
+}
+
+int block_volume_create(const char *diskname, size_t bcount)
+{
+	struct volumeHeader header;
+	struct timespec ts;
+	char *members[MAX_MEMBERS];
+	char names[PATH_MAX];
+	size_t unit, blocks;
+	int tiered, mirrored, n, i;
+	perf_scope(BLOCK_VOLUME_CREATE);
+
+	if (!diskname || !bcount) {
+		block_error("invalid volume");
+		return -1;
+	}
+
+	mirrored = !strncmp(diskname, RAID1_PREFIX, strlen(RAID1_PREFIX));
+	tiered = !strncmp(diskname, TIER_PREFIX, strlen(TIER_PREFIX));
+	if (mirrored) {
+		char *name, *save;
+
+		if (strlen(diskname + strlen(RAID1_PREFIX)) >= sizeof(names)) {
+			block_error("volume description too long");
+			return -1;
+		}
+		strcpy(names, diskname + strlen(RAID1_PREFIX));
+		n = 0;
+		for (name = strtok_r(names, ",", &save); name && n < MAX_MEMBERS;
+		     name = strtok_r(NULL, ",", &save))
+			members[n++] = name;
+		unit = 0;
+	} else if (tiered) {
+		n = parse_volume(diskname + strlen(TIER_PREFIX), 1, &unit, names, members);
+		if (n > 0 && unit >= bcount) {
+			block_error("the fast tier must be smaller than the volume");
+			return -1;
+		}
+	} else if (!strncmp(diskname, RAID0_PREFIX, strlen(RAID0_PREFIX))) {
+		n = parse_volume(diskname + strlen(RAID0_PREFIX), 0, &unit, names, members);
+	} else {
+		block_error("'%s' is not a volume", diskname);
+		return -1;
+	}
+	if (n < 0)
+		return -1;
+
+	/* Images of the same volume share an identifier no other volume has */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VOLUME_MAGIC, sizeof(header.magic));
+	header.volume_id = ((uint64_t)ts.tv_sec << 32 ^ ts.tv_nsec) * 2654435761u ^ getpid();
+	header.numOf_members = n;
+	header.unit = unit;
+	header.tiered = tiered;
+
+	for (i = 0; i < n; i++) {
+		int fd = open(members[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+		if (mirrored)
+			blocks = bcount;
+		else if (tiered)
+			blocks = i == 0 ? unit : bcount - unit;
+		else
+			blocks = member_blocks(i, bcount, n, unit);
+
+		/* Mirrors are plain copies of the disk, other images end with a header */
+		header.member = i;
+		if (fd < 0 || ftruncate(fd, (blocks + !mirrored) * BLOCK_SIZE)
+		    || (!mirrored && pwrite(fd, &header, sizeof(header), blocks * BLOCK_SIZE)
+				     != sizeof(header))) {
+			perror(members[i]);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+
+	return 0;
+}
 
 int block_disk_open(const char *diskname)
 {
-	int fd;
+	int fd, i;
 	struct stat st;
+	perf_scope(BLOCK_DISK_OPEN);
 
 	if (!diskname) {
 		block_error("invalid file diskname");
@@ -43,13 +637,42 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	disk.mem = NULL;
+	disk.numOf_members = 0;
+	memset(disk.head, 0, sizeof(disk.head));
+
+	if (!strncmp(diskname, RAID0_PREFIX, strlen(RAID0_PREFIX))
+	    || !strncmp(diskname, RAID1_PREFIX, strlen(RAID1_PREFIX))
+	    || !strncmp(diskname, TIER_PREFIX, strlen(TIER_PREFIX))) {
+		int ret;
+
+		if (!strncmp(diskname, RAID1_PREFIX, strlen(RAID1_PREFIX)))
+			ret = mirror_open(diskname + strlen(RAID1_PREFIX));
+		else if (!strncmp(diskname, TIER_PREFIX, strlen(TIER_PREFIX)))
+			ret = volume_open(diskname + strlen(TIER_PREFIX), 1);
+		else
+			ret = volume_open(diskname + strlen(RAID0_PREFIX), 0);
+		if (ret)
+			return -1;
+		for (i = 0; disk.member_fd[i] == INVALID_FD; i++)
+			;
+		disk.fd = disk.member_fd[i];
+		return 0;
+	}
+
+	/* A RAM disk starts as a copy of the image named after the prefix */
+	int ram = !strncmp(diskname, RAM_PREFIX, strlen(RAM_PREFIX));
+	if (ram)
+		diskname += strlen(RAM_PREFIX);
+
+	if ((fd = open(diskname, ram ? O_RDONLY : O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
@@ -57,31 +680,196 @@ int block_disk_open(const char *diskname)
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
 		return -1;
 	}
 
-	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
 
+	if (ram) {
+		if (disk.bcount == 0) {
+			block_error("empty disk image");
+			close(fd);
+			return -1;
+		}
+		disk.mem = mmap(NULL, disk.bcount * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (disk.mem == MAP_FAILED) {
+			perror("mmap");
+			disk.mem = NULL;
+			close(fd);
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		/* Fewer TLB misses on large disks, where the kernel allows it */
+		madvise(disk.mem, disk.bcount * BLOCK_SIZE, MADV_HUGEPAGE);
+#endif
+		disk.fd = fd;
+		if (block_disk_load(diskname)) {
+			munmap(disk.mem, disk.bcount * BLOCK_SIZE);
+			disk.mem = NULL;
+			disk.fd = INVALID_FD;
+			close(fd);
+			return -1;
+		}
+	}
+
+	disk.fd = fd;
+
 	return 0;
 }
 
 int block_disk_close(void)
 {
+	perf_scope(BLOCK_DISK_CLOSE);
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk.numOf_members)
+		volume_close();
+	else
+		close(disk.fd);
+	if (disk.mem) {
+		munmap(disk.mem, disk.bcount * BLOCK_SIZE);
+		disk.mem = NULL;
+	}
 
 	disk.fd = INVALID_FD;
 
 	return 0;
 }
 
+int block_disk_sync(void)
+{
+	int i;
+	perf_scope(BLOCK_DISK_SYNC);
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Blocks of a RAM disk are never stored anywhere else */
+	if (disk.mem)
+		return 0;
+
+	if (!disk.numOf_members) {
+		if (fdatasync(disk.fd)) {
+			perror("fdatasync");
+			return -1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < disk.numOf_members; i++) {
+		if (disk.mirrored && disk.member_state[i] == MEMBER_FAILED)
+			continue;
+		if (fdatasync(disk.member_fd[i])) {
+			perror("fdatasync");
+			if (!disk.mirrored || mirror_fail(i))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Copy a whole RAM disk from or to the image file @fd */
+static int ram_transfer(int fd, int save)
+{
+	size_t size = disk.bcount * BLOCK_SIZE;
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t ret = save ? pwrite(fd, disk.mem + done, size - done, done)
+			: pread(fd, disk.mem + done, size - done, done);
+
+		if (ret <= 0) {
+			perror(save ? "pwrite" : "pread");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+int block_disk_load(const char *imagename)
+{
+	int fd, ret;
+	struct stat st;
+	perf_scope(BLOCK_DISK_LOAD);
+
+	if (disk.fd == INVALID_FD || !disk.mem) {
+		block_error("no RAM disk currently open");
+		return -1;
+	}
+
+	if (!imagename) {
+		block_error("invalid image name");
+		return -1;
+	}
+
+	if ((fd = open(imagename, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size != disk.bcount * BLOCK_SIZE) {
+		block_error("image size '%zu' does not match disk size '%zu'",
+			    st.st_size, disk.bcount * BLOCK_SIZE);
+		close(fd);
+		return -1;
+	}
+
+	ret = ram_transfer(fd, 0);
+	close(fd);
+
+	return ret;
+}
+
+int block_disk_save(const char *imagename)
+{
+	int fd, ret;
+	perf_scope(BLOCK_DISK_SAVE);
+
+	if (disk.fd == INVALID_FD || !disk.mem) {
+		block_error("no RAM disk currently open");
+		return -1;
+	}
+
+	if (!imagename) {
+		block_error("invalid image name");
+		return -1;
+	}
+
+	if ((fd = open(imagename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	ret = ram_transfer(fd, 1);
+	if (close(fd)) {
+		perror("close");
+		ret = -1;
+	}
+
+	return ret;
+}
+
 int block_disk_count(void)
 {
+	perf_scope(BLOCK_DISK_COUNT);
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
@@ -90,8 +878,22 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+int block_disk_fast_count(void)
+{
+	perf_scope(BLOCK_DISK_FAST_COUNT);
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return disk.fast_blocks;
+}
+
 int block_write(size_t block, const void *buf)
 {
+	perf_scope(BLOCK_WRITE);
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
@@ -103,6 +905,44 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
+	trace_point(BLOCK_WRITE, block, 0, 0);
+
+	if (disk.mem) {
+		memcpy(disk.mem + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+		perf_bytes(PERF_BLOCK_WRITE, BLOCK_SIZE);
+		return 0;
+	}
+
+	if (disk.mirrored) {
+		int ret;
+
+		pthread_mutex_lock(&disk.lock);
+		ret = mirror_write(block, buf);
+		pthread_mutex_unlock(&disk.lock);
+		if (ret)
+			return -1;
+		perf_bytes(PERF_BLOCK_WRITE, BLOCK_SIZE);
+		return 0;
+	}
+
+	if (disk.numOf_members) {
+		size_t mblock;
+		int member = locate(block, &mblock);
+		ssize_t ret = pwrite(disk.member_fd[member], buf, BLOCK_SIZE, mblock * BLOCK_SIZE);
+
+		if (ret < 0) {
+			perror("pwrite");
+			return -1;
+		}
+		/* A short transfer means a truncated or full member image */
+		if (ret != BLOCK_SIZE) {
+			block_error("short write to member %d", member);
+			return -1;
+		}
+		perf_bytes(PERF_BLOCK_WRITE, BLOCK_SIZE);
+		return 0;
+	}
+
 	/* Move to the specified block number */
 	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
 		perror("lseek");
@@ -114,12 +954,15 @@ int block_write(size_t block, const void *buf)
 		perror("write");
 		return -1;
 	}
+	perf_bytes(PERF_BLOCK_WRITE, BLOCK_SIZE);
 
 	return 0;
 }
 
 int block_read(size_t block, void *buf)
 {
+	perf_scope(BLOCK_READ);
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
@@ -131,6 +974,44 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
+	trace_point(BLOCK_READ, block, 0, 0);
+
+	if (disk.mem) {
+		memcpy(buf, disk.mem + block * BLOCK_SIZE, BLOCK_SIZE);
+		perf_bytes(PERF_BLOCK_READ, BLOCK_SIZE);
+		return 0;
+	}
+
+	if (disk.mirrored) {
+		int ret;
+
+		pthread_mutex_lock(&disk.lock);
+		ret = mirror_read(block, buf);
+		pthread_mutex_unlock(&disk.lock);
+		if (ret)
+			return -1;
+		perf_bytes(PERF_BLOCK_READ, BLOCK_SIZE);
+		return 0;
+	}
+
+	if (disk.numOf_members) {
+		size_t mblock;
+		int member = locate(block, &mblock);
+		ssize_t ret = pread(disk.member_fd[member], buf, BLOCK_SIZE, mblock * BLOCK_SIZE);
+
+		if (ret < 0) {
+			perror("pread");
+			return -1;
+		}
+		/* A short transfer means a truncated member image */
+		if (ret != BLOCK_SIZE) {
+			block_error("short read from member %d", member);
+			return -1;
+		}
+		perf_bytes(PERF_BLOCK_READ, BLOCK_SIZE);
+		return 0;
+	}
+
 	/* Move to the specified block number */
 	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
 		perror("lseek");
@@ -142,7 +1023,329 @@ int block_read(size_t block, void *buf)
 		perror("read");
 		return -1;
 	}
+	perf_bytes(PERF_BLOCK_READ, BLOCK_SIZE);
+
+	return 0;
+}
+
+/* A request of block_submit(), with what is needed to schedule it */
+struct pending {
+	size_t block;
+	size_t mblock;	/* index of the block in its image */
+	size_t seq;		/* index in the submitted array */
+	size_t round;	/* dispatch round */
+	size_t key;		/* image, then distance from its head in the direction it sweeps */
+	int member;		/* image holding the block */
+	int owner;
+	int write;
+};
+
+/* Adjacent requests of a round, moved by a single transfer */
+struct run {
+	size_t block;
+	size_t mblock;
+	struct iovec *iov;
+	int count;
+	int member;
+	int write;
+	int ret;		/* -1 if the transfer failed or was not attempted */
+};
+
+/* Runs of a round that go to one image, performed by one thread */
+struct runQueue {
+	struct run *runs;
+	size_t numOf_runs;
+	int member;
+	int ret;
+};
+
+static int compare_owner(const void *a, const void *b)
+{
+	const struct pending *pa = a, *pb = b;
+
+	if (pa->owner != pb->owner)
+		return pa->owner < pb->owner ? -1 : 1;
+	return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
+}
+
+static int compare_round(const void *a, const void *b)
+{
+	const struct pending *pa = a, *pb = b;
+
+	if (pa->round != pb->round)
+		return pa->round < pb->round ? -1 : 1;
+	return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
+}
+
+static int compare_key(const void *a, const void *b)
+{
+	const struct pending *pa = a, *pb = b;
+
+	if (pa->member != pb->member)
+		return pa->member < pb->member ? -1 : 1;
+	if (pa->key != pb->key)
+		return pa->key < pb->key ? -1 : 1;
+	return pa->seq < pb->seq ? -1 : pa->seq > pb->seq;
+}
+
+/* Move the adjacent blocks of @run in a single transfer */
+static int transfer_run(struct run *run)
+{
+	off_t offset = run->mblock * BLOCK_SIZE;
+	struct iovec *iov = run->iov;
+	int count = run->count;
+	int fd = disk.numOf_members ? disk.member_fd[run->member] : disk.fd;
+	int i;
+
+	trace_point(BLOCK_SUBMIT, run->block, run->count, run->write);
+
+	if (disk.mem) {
+		for (i = 0; i < count; i++, offset += BLOCK_SIZE) {
+			if (run->write)
+				memcpy(disk.mem + offset, iov[i].iov_base, BLOCK_SIZE);
+			else
+				memcpy(iov[i].iov_base, disk.mem + offset, BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	/* Short transfers resume where they stopped */
+	while (count > 0) {
+		ssize_t ret = run->write ? pwritev(fd, iov, count, offset)
+			: preadv(fd, iov, count, offset);
+
+		if (ret <= 0) {
+			perror(run->write ? "pwritev" : "preadv");
+			return -1;
+		}
+		offset += ret;
+		while (count > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static void *run_queue(void *arg)
+{
+	struct runQueue *queue = arg;
+	size_t i;
+
+	for (i = 0; i < queue->numOf_runs; i++)
+		queue->runs[i].ret = queue->ret ? -1 : transfer_run(&queue->runs[i]);
+	for (i = 0; i < queue->numOf_runs; i++)
+		if (queue->runs[i].ret)
+			queue->ret = -1;
+
+	return NULL;
+}
+
+/* Perform the runs of a round, those of different images in parallel */
+static int dispatch(struct run *runs, size_t numOf_runs)
+{
+	struct runQueue queues[MAX_MEMBERS];
+	pthread_t threads[MAX_MEMBERS];
+	int started[MAX_MEMBERS] = { 0 };
+	int numOf_queues = 0, ret = 0, i;
+	size_t r;
+
+	/* Runs are sorted by image, each queue takes a stretch of them */
+	for (r = 0; r < numOf_runs; r++) {
+		if (r == 0 || runs[r].member != runs[r - 1].member) {
+			queues[numOf_queues].runs = &runs[r];
+			queues[numOf_queues].numOf_runs = 0;
+			queues[numOf_queues].member = runs[r].member;
+			queues[numOf_queues].ret = 0;
+			numOf_queues++;
+		}
+		queues[numOf_queues - 1].numOf_runs++;
+	}
+
+	for (i = 1; i < numOf_queues; i++)
+		started[i] = !pthread_create(&threads[i], NULL, run_queue, &queues[i]);
+	run_queue(&queues[0]);
+	for (i = 1; i < numOf_queues; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			run_queue(&queues[i]);
+	}
+
+	for (i = 0; i < numOf_queues; i++)
+		if (queues[i].ret)
+			ret = -1;
+	return ret;
+}
+
+/*
+ * Redo the failed runs of a round on a mirrored volume, block by block on the
+ * mirrors that are left
+ */
+static int redo_runs(struct run *runs, size_t numOf_runs, struct iovec *iov,
+		     struct pending *pend, struct blockRequest *reqs)
+{
+	size_t r;
+	int i;
+
+	for (r = 0; r < numOf_runs; r++) {
+		struct pending *p = &pend[runs[r].iov - iov];
+
+		if (!runs[r].ret)
+			continue;
+		mirror_fail(runs[r].member);
+		for (i = 0; i < runs[r].count; i++) {
+			void *buf = reqs[p[i].seq].buf;
+
+			if (runs[r].write ? mirror_write(p[i].block, buf) : mirror_read(p[i].block, buf))
+				return -1;
+		}
+	}
 
 	return 0;
 }
 
+/* Fill @pend with the @total transfers that serve @reqs */
+static int expand_requests(struct blockRequest *reqs, size_t count,
+			   struct pending *pend, size_t *total)
+{
+	size_t i, n = 0;
+	int m;
+
+	for (i = 0; i < count; i++) {
+		struct pending p = {
+			.block = reqs[i].block,
+			.seq = i,
+			.owner = reqs[i].owner,
+			.write = reqs[i].write,
+		};
+
+		if (!disk.mirrored) {
+			p.member = locate(reqs[i].block, &p.mblock);
+			pend[n++] = p;
+			continue;
+		}
+
+		/* Reads go to one mirror, writes to all of those in sync */
+		p.mblock = p.block;
+		for (m = 0; m < disk.numOf_members; m++) {
+			if (reqs[i].write ? !in_sync(m, p.block) : m != read_mirror(p.block))
+				continue;
+			p.member = m;
+			pend[n++] = p;
+		}
+		if (n == 0 || pend[n - 1].seq != i) {
+			block_error("no image holds block %zu", p.block);
+			return -1;
+		}
+	}
+
+	*total = n;
+	return 0;
+}
+
+int block_submit(struct blockRequest *reqs, size_t count)
+{
+	struct pending *pend;
+	struct iovec *iov;
+	struct run *runs;
+	size_t i, j, start, total;
+	int ret = 0;
+	perf_scope(BLOCK_SUBMIT);
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (reqs[i].block >= disk.bcount) {
+			block_error("block index out of bounds (%zu/%zu)",
+				    reqs[i].block, disk.bcount);
+			return -1;
+		}
+	}
+	if (count == 0)
+		return 0;
+
+	/* A write to a mirrored volume becomes one transfer per mirror */
+	total = disk.mirrored ? count * disk.numOf_members : count;
+	pend = malloc(total * sizeof(*pend));
+	iov = malloc(total * sizeof(*iov));
+	runs = malloc(total * sizeof(*runs));
+	if (!pend || !iov || !runs) {
+		perror("malloc");
+		free(pend);
+		free(iov);
+		free(runs);
+		return -1;
+	}
+
+	if (disk.mirrored)
+		pthread_mutex_lock(&disk.lock);
+	ret = expand_requests(reqs, count, pend, &total);
+
+	/* The n-th request of an owner goes in round n / BLOCK_QUEUE_DEPTH */
+	qsort(pend, total, sizeof(*pend), compare_owner);
+	for (i = 0; i < total; i++) {
+		size_t rank = (i > 0 && pend[i].owner == pend[i - 1].owner)
+			? pend[i - 1].round + 1 : 0;
+		pend[i].round = rank;
+	}
+	for (i = 0; i < total; i++)
+		pend[i].round /= BLOCK_QUEUE_DEPTH;
+	qsort(pend, total, sizeof(*pend), compare_round);
+
+	for (start = 0; start < total && !ret; start = j) {
+		size_t numOf_runs = 0;
+
+		/* One sweep of the head of each image over the requests of the round */
+		for (j = start; j < total && pend[j].round == pend[start].round; j++)
+			pend[j].key = (pend[j].mblock + disk.bcount - disk.head[pend[j].member]) % disk.bcount;
+		qsort(pend + start, j - start, sizeof(*pend), compare_key);
+
+		for (i = start; i < j; ) {
+			struct run *run = &runs[numOf_runs++];
+			size_t k = i;
+
+			run->block = pend[i].block;
+			run->mblock = pend[i].mblock;
+			run->iov = &iov[i];
+			run->count = 0;
+			run->member = pend[i].member;
+			run->write = pend[i].write;
+			do {
+				iov[k].iov_base = reqs[pend[k].seq].buf;
+				iov[k].iov_len = BLOCK_SIZE;
+				run->count++;
+				k++;
+			} while (k < j && run->count < MAX_MERGE && pend[k].write == run->write
+				 && pend[k].member == run->member
+				 && pend[k].mblock == pend[k - 1].mblock + 1);
+
+			disk.head[run->member] = pend[k - 1].mblock + 1;
+			i = k;
+		}
+
+		ret = dispatch(runs, numOf_runs);
+		if (ret && disk.mirrored)
+			ret = redo_runs(runs, numOf_runs, iov, pend, reqs);
+	}
+
+	if (disk.mirrored)
+		pthread_mutex_unlock(&disk.lock);
+	free(pend);
+	free(iov);
+	free(runs);
+	if (ret)
+		return -1;
+	perf_bytes(PERF_BLOCK_SUBMIT, count * BLOCK_SIZE);
+
+	return 0;
+}
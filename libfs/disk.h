@@ -18,6 +18,27 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * If @diskname starts with "ram:", the rest of the name is a disk image that is
+ * copied into memory: blocks are then read from and written to memory only, and
+ * the image file is left untouched. Such a RAM disk is lost when it is closed,
+ * unless it was saved with block_disk_save().
+ *
+ * If @diskname starts with "raid0:<stripe unit>:", the rest of the name is a
+ * comma-separated list of images that blocks are striped over. If it starts
+ * with "raid1:", every block is written to each image of the list and read from
+ * any of them. Images of such a mirrored volume that cannot be opened are left
+ * out; images that do not exist are created and filled in the background. Such
+ * an image is built under its name followed by ".resync", and only gets its
+ * name once it holds every block: a resync cut short goes on at the next
+ * open.
+ *
+ * If @diskname starts with "tier:<fast blocks>:", the rest of the name is a
+ * fast image of <fast blocks> blocks followed by a slow image. The disk is made
+ * of the blocks of the fast image, then of those of the slow image.
+ *
+ * The images of a striped or tiered volume must have been created together by
+ * block_volume_create(), and be listed in the same order.
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
@@ -30,6 +51,43 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Flush virtual disk file
+ *
+ * Wait until every block written so far is stored on the device that holds the
+ * virtual disk file. This does nothing for a RAM disk.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the flush fails.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
+/**
+ * block_disk_load - Restore a RAM disk from an image
+ * @imagename: Name of the image file
+ *
+ * Overwrite all the blocks of the currently open RAM disk with the contents of
+ * image file @imagename, which must have the same size as the disk. No file
+ * system should be mounted on the disk when its contents are replaced.
+ *
+ * Return: -1 if there is no RAM disk opened, or if @imagename cannot be read
+ * or has a different size. 0 otherwise.
+ */
+int block_disk_load(const char *imagename);
+
+/**
+ * block_disk_save - Save a RAM disk to an image
+ * @imagename: Name of the image file
+ *
+ * Write all the blocks of the currently open RAM disk into image file
+ * @imagename, which is created or truncated. The image can be opened later as
+ * a disk file, or as a RAM disk again.
+ *
+ * Return: -1 if there is no RAM disk opened, or if @imagename cannot be
+ * written. 0 otherwise.
+ */
+int block_disk_save(const char *imagename);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -38,6 +96,32 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_fast_count - Get the size of the fast tier of the disk
+ *
+ * The first blocks of a tiered disk are stored on a faster image than the rest.
+ *
+ * Return: -1 if there was no virtual disk file opened, otherwise the number of
+ * blocks on the fast tier of the currently open disk (0 if it is not tiered).
+ */
+int block_disk_fast_count(void);
+
+/**
+ * block_volume_create - Create the images of a volume
+ * @diskname: Name of the volume, as given to block_disk_open()
+ * @bcount: Number of blocks of the volume
+ *
+ * Create (or truncate) the images of volume @diskname, sized to hold a disk of
+ * @bcount blocks. Each image of a striped or tiered volume ends with a header
+ * block that names the volume and the place of the image in it, which
+ * block_disk_open() checks. The images of a mirrored volume are plain copies of
+ * the disk.
+ *
+ * Return: -1 if @diskname does not describe a volume, or if an image cannot be
+ * created. 0 otherwise.
+ */
+int block_volume_create(const char *diskname, size_t bcount);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -64,5 +148,42 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/** Most requests of a single owner dispatched before other owners get a turn */
+#define BLOCK_QUEUE_DEPTH 32
+
+/**
+ * struct blockRequest - Block I/O request
+ * @block: Index of the block to read or write
+ * @buf: Data buffer of %BLOCK_SIZE bytes
+ * @write: 1 to write @buf into the block, 0 to read the block into @buf
+ * @owner: Stream the request belongs to (e.g., a file descriptor)
+ */
+struct blockRequest {
+	size_t block;
+	void *buf;
+	int write;
+	int owner;
+};
+
+/**
+ * block_submit - Perform a batch of block requests
+ * @reqs: Array of requests
+ * @count: Number of requests in @reqs
+ *
+ * Perform all the requests of @reqs, in an order that favors sequential disk
+ * access: requests are dispatched in rounds, each round taking at most
+ * %BLOCK_QUEUE_DEPTH requests of each owner, so that a long stream of one owner
+ * does not delay the requests of the others. Within a round, requests are
+ * sorted by block index, starting from where the previous round left off, and
+ * requests in the same direction on adjacent blocks are merged into a single
+ * transfer. Requests of an owner on the same block are performed in the order
+ * they appear in @reqs; requests of different owners should not target the
+ * same block.
+ *
+ * Return: -1 if a request is out of bounds, in which case no request is
+ * performed, or if a transfer fails. 0 otherwise.
+ */
+int block_submit(struct blockRequest *reqs, size_t count);
+
 #endif /* _DISK_H */
 
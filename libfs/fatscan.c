@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fatscan.h"
+
+/*
+ * The kernels come in pairs: find the first entry that is free (0), or the
+ * first one that is in use (not 0). A run of free entries is then found by
+ * jumping from the start of a free range to its end, so long runs of used or
+ * free entries are skipped 8 or 16 entries per instruction.
+ */
+
+struct fatKernels {
+	int (*find)(const uint16_t *fat, int start, int count, int free);
+	int (*count)(const uint16_t *fat, int count);
+};
+
+static struct fatKernels kernels;
+static pthread_once_t pickOnce = PTHREAD_ONCE_INIT;	// picks the kernels before any thread uses them
+
+// Function to find the first entry at or after @start that is free (or in use if !@free)
+static int find_scalar(const uint16_t *fat, int start, int count, int free)
+{
+	for (int i = start; i < count; i++) {
+		if ((fat[i] == 0) == (free != 0)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Function to count free entries one at a time
+static int count_scalar(const uint16_t *fat, int count)
+{
+	int freeCount = 0;
+	for (int i = 0; i < count; i++) {
+		freeCount += (fat[i] == 0);
+	}
+	return freeCount;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+// Function to find an entry 8 at a time. The comparison mask has two bits per entry,
+// inverted when looking for entries in use, so its lowest set bit gives the index.
+__attribute__((target("sse2")))
+static int find_sse2(const uint16_t *fat, int start, int count, int free)
+{
+	const __m128i zero = _mm_setzero_si128();
+	unsigned flip = free ? 0 : 0xFFFF;
+	int i = start;
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)) ^ flip;
+		if (mask) {
+			return i + __builtin_ctz(mask) / 2;
+		}
+	}
+	return find_scalar(fat, i, count, free);
+}
+
+// Function to count free entries 8 at a time: each match adds -1 to a 16-bit lane, and
+// lanes are drained into the total before they can overflow
+__attribute__((target("sse2")))
+static int count_sse2(const uint16_t *fat, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int freeCount = 0;
+	int i = 0;
+	while (i + 8 <= count) {
+		__m128i acc = _mm_setzero_si128();
+		for (int n = 0; n < 0x7FFF && i + 8 <= count; n++, i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+			acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(v, zero));
+		}
+		// Sum the eight 16-bit lanes
+		__m128i sum = _mm_madd_epi16(acc, _mm_set1_epi16(1));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		freeCount += _mm_cvtsi128_si32(sum);
+	}
+	return freeCount + count_scalar(fat + i, count - i);
+}
+
+// Function to find an entry 16 at a time. Blocks of 64 entries are first checked with a
+// single combined mask, so long runs are skipped with few branches.
+__attribute__((target("avx2")))
+static int find_avx2(const uint16_t *fat, int start, int count, int free)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned flip = free ? 0 : 0xFFFFFFFF;
+	int i = start;
+	for (; i + 64 <= count; i += 64) {
+		__m256i e0 = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(fat + i)), zero);
+		__m256i e1 = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(fat + i + 16)), zero);
+		__m256i e2 = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(fat + i + 32)), zero);
+		__m256i e3 = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(fat + i + 48)), zero);
+		// Any free entry shows in the OR of the masks, any used one in their AND
+		__m256i any = free ? _mm256_or_si256(_mm256_or_si256(e0, e1), _mm256_or_si256(e2, e3))
+		                   : _mm256_and_si256(_mm256_and_si256(e0, e1), _mm256_and_si256(e2, e3));
+		if (((unsigned)_mm256_movemask_epi8(any) ^ flip) != 0) {
+			break;
+		}
+	}
+	for (; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero)) ^ flip;
+		if (mask) {
+			return i + __builtin_ctz(mask) / 2;
+		}
+	}
+	return find_scalar(fat, i, count, free);
+}
+
+// Function to count free entries 64 at a time, same scheme as count_sse2() with four
+// accumulators so that the additions do not wait on each other
+__attribute__((target("avx2")))
+static int count_avx2(const uint16_t *fat, int count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int freeCount = 0;
+	int i = 0;
+	while (i + 64 <= count) {
+		__m256i acc0 = _mm256_setzero_si256(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+		for (int n = 0; n < 0x7FFF && i + 64 <= count; n++, i += 64) {
+			acc0 = _mm256_sub_epi16(acc0, _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(fat + i)), zero));
+			acc1 = _mm256_sub_epi16(acc1, _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(fat + i + 16)), zero));
+			acc2 = _mm256_sub_epi16(acc2, _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(fat + i + 32)), zero));
+			acc3 = _mm256_sub_epi16(acc3, _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(fat + i + 48)), zero));
+		}
+		// Sum the 16-bit lanes of the four accumulators
+		const __m256i ones = _mm256_set1_epi16(1);
+		__m256i sum32 = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(acc0, ones), _mm256_madd_epi16(acc1, ones)),
+		                                 _mm256_add_epi32(_mm256_madd_epi16(acc2, ones), _mm256_madd_epi16(acc3, ones)));
+		__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum32), _mm256_extracti128_si256(sum32, 1));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		freeCount += _mm_cvtsi128_si32(sum);
+	}
+	return freeCount + count_scalar(fat + i, count - i);
+}
+#endif
+
+// Function to pick the kernels for this processor
+static void pick_kernels(void)
+{
+	kernels.find = find_scalar;
+	kernels.count = count_scalar;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.find = find_avx2;
+		kernels.count = count_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernels.find = find_sse2;
+		kernels.count = count_sse2;
+	}
+#endif
+}
+
+int fat_find_free(const void *fat, int start, int count)
+{
+	pthread_once(&pickOnce, pick_kernels);
+	return kernels.find(fat, start, count, 1);
+}
+
+int fat_find_free_run(const void *fat, int count, int length)
+{
+	pthread_once(&pickOnce, pick_kernels);
+
+	int runStart = kernels.find(fat, 0, count, 1);
+	while (runStart != -1 && runStart + length <= count) {
+		// Only the entries up to the wanted length matter
+		int runEnd = kernels.find(fat, runStart, runStart + length, 0);
+		if (runEnd == -1) {
+			return runStart;
+		}
+		runStart = kernels.find(fat, runEnd, count, 1);
+	}
+	return -1;
+}
+
+int fat_count_free(const void *fat, int count)
+{
+	pthread_once(&pickOnce, pick_kernels);
+	return kernels.count(fat, count);
+}
@@ -0,0 +1,44 @@
+#ifndef _FATSCAN_H
+#define _FATSCAN_H
+
+#include <stdint.h>
+
+/*
+ * Scanning kernels for the FAT, which is an array of 16-bit entries where 0
+ * marks a free data block. Each kernel has an AVX2, an SSE2 and a scalar
+ * version; the fastest one supported by the processor is picked at runtime the
+ * first time one of them is called.
+ */
+
+/**
+ * fat_find_free - Find the first free FAT entry
+ * @fat: FAT entries (16-bit, aligned on 2 bytes)
+ * @start: Index of the first entry to look at
+ * @count: Total number of entries in @fat
+ *
+ * Return: The index of the first entry equal to 0 at or after @start, or -1 if
+ * there is none.
+ */
+int fat_find_free(const void *fat, int start, int count);
+
+/**
+ * fat_find_free_run - Find the first run of consecutive free FAT entries
+ * @fat: FAT entries (16-bit, aligned on 2 bytes)
+ * @count: Total number of entries in @fat
+ * @length: Number of consecutive free entries wanted (at least 1)
+ *
+ * Return: The index of the first entry of the first run of @length entries
+ * equal to 0, or -1 if there is none.
+ */
+int fat_find_free_run(const void *fat, int count, int length);
+
+/**
+ * fat_count_free - Count free FAT entries
+ * @fat: FAT entries (16-bit, aligned on 2 bytes)
+ * @count: Total number of entries in @fat
+ *
+ * Return: The number of entries equal to 0.
+ */
+int fat_count_free(const void *fat, int count);
+
+#endif /* _FATSCAN_H */
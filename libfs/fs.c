@@ -1,17 +1,28 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
-
+#include "capture.h"
+#include "crc32c.h"
+#include "fatscan.h"
+#include "lz.h"
+#include "perf.h"
+#include "trace.h"
+
+// Errors are logged as trace events that point back at the line that reported them
 #if 0
 #define fs_print(fmt, ...) \
     fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 #else
-#define fs_print(...) do { } while(0)
+#define fs_print(...) trace_point(ERROR, __LINE__, 0, 0)
 #endif
 
 
@@ -19,7 +30,38 @@
 #define FAT_BLOCK_INDEX 1
 #define FAT_EOC 0xFFFF
 #define FAT_FREE 0
+#define MAP_HOLE 0											// map entry of a block that was never written
+#define MAP_ENTRIES (BLOCK_SIZE / sizeof(uint16_t))		// entries in one index or map block
+#define READ_BATCH 64										// whole blocks a read hands to block_submit() at once
+#define WRITE_BATCH 64										// whole blocks a write hands to block_submit() at once
+#define FILE_MAPPED 0x01									// file data is reached through a block map
+#define FILE_COMPRESSED 0x02								// file data is stored as compressed clusters
+#define FILE_DIRECTORY 0x04									// the entry is a subdirectory: a FAT chain of buckets
+#define CLUSTER_BLOCKS 8									// logical blocks compressed together
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define FEATURE_COMPRESS 0x01								// new files are created compressed
+#define FEATURE_LOG 0x02									// data is written out of place at the head of a log
+#define SEGMENT_BLOCKS 64									// data blocks in a segment of the log
+#define CLEAN_RESERVE 8										// free segments the cleaner tries to keep
+#define CLEAN_SEGMENTS 4									// segments the cleaner empties in one pass
+#define CLEAN_INTERVAL 1000									// milliseconds between passes of the cleaner
+#define CHECK_THREADS 8										// most threads fs_check() walks chains with
+#define CHECK_OK 0											// the FAT chain ends properly
+#define CHECK_CYCLE 1										// the FAT chain loops back onto itself
+#define CHECK_CROSSLINK 2									// the FAT chain runs into another chain
+#define CHECK_BAD_POINTER 3									// the FAT chain points outside of the data blocks
+#define TIER_PERIOD 4096									// data block reads between automatic tiering passes
+#define TIER_BUDGET 256										// data blocks an automatic tiering pass may move
+#define TIER_HOT 4											// reads since the last pass that make a slow block hot
+#define SB_CLEAN 0xC1										// the superblock holds a summary saved at unmount
+#define FD_CHUNK 256										// file descriptors added at once as the table grows
+#define FD_CHUNKS (FS_OPEN_MAX_COUNT / FD_CHUNK)			// chunks the file descriptor table can grow to
+#define DIR_ENTRIES FS_FILE_MAX_COUNT						// entries in one block of a directory
+#define DIR_MAX_BUCKETS 1024								// blocks a subdirectory can grow to
+#define PATH_CACHE_SLOTS 1024								// resolved paths remembered by path_lookup()
+#define PATH_CACHE_LEN 128									// longest path the cache remembers
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
 
 // Superblock data structure which contains information about filesystem
@@ -30,7 +72,15 @@ struct superblock{
 	uint16_t dataBlock_startIndex;	// Data block start index
 	uint16_t numOf_dataBlocks;		// Amount of data blocks
 	uint8_t numOf_fatBlocks; 		// Number of blocks for FAT
-	uint8_t unused[4079];			// Unused or Padding
+	uint16_t refcnt_blockIndex;		// First data block of the reference count table (0 if none)
+	uint16_t fprint_blockIndex;		// First data block of the fingerprint table (0 if dedup is off)
+	uint8_t feature_flags;			// FEATURE_* options of the file system
+	uint16_t csum_blockIndex;		// First data block of the checksum table (0 if checksums are off)
+	uint8_t clean;					// SB_CLEAN if the summary below was left by a clean unmount
+	uint16_t free_blocks;			// Free data blocks at the last clean unmount
+	uint8_t free_entries;			// Free root directory entries at the last clean unmount
+	uint32_t rdir_csum;				// Checksum of the root directory at the last clean unmount
+	uint8_t unused[4064];			// Unused or Padding
 }__attribute__((packed));		
 
 // FAT entry data structure
@@ -42,8 +92,9 @@ struct fatEntry {			// 2 bytes per entry
 struct rootDirEntry{					// 32 bytes per entry
 	char file_name[FS_FILENAME_LEN];	// Filename (including NULL char) 16bytes 
 	uint32_t file_size;					// Size of the file
-	uint16_t firstDataBlock_index;		// Index of the first data block
-	uint8_t unused[10];					// Unused or Padding
+	uint16_t firstDataBlock_index;		// Index of the first data block (index block if mapped)
+	uint8_t file_flags;					// FILE_MAPPED if the file may contain holes, FILE_COMPRESSED
+	uint8_t unused[9];					// Unused or Padding
 }__attribute__((packed));
 
 // File descriptor data structure
@@ -52,54 +103,168 @@ struct fileDescriptor {
 	int fdIndex;		// -1 for closed or unused fd
     int rIndex;			// index of the file in root directory
 }__attribute__((packed));
+
+// A chunk of the file descriptor table. Chunks are added as more files are open at once, and
+// never move or go away while the file system is mounted, so a descriptor stays where it is.
+struct fdChunk {
+	struct fileDescriptor fds[FD_CHUNK];
+	int nextFree[FD_CHUNK];				// next descriptor on the free list (-1 if last)
+};
+
+// A page of the directory table: the entries of one block of a directory. Page 0 is the root
+// directory, the others are buckets of subdirectories.
+struct dirPage {
+	int dir;				// directory the page belongs to (-1 if the page is free)
+	int block;				// data block the page is stored in (-1 for the root directory)
+	int written;			// the block holds the page as last written (0 for a new page)
+};
+
+// In-memory view of a directory. The entries of a subdirectory are hashed on their name into
+// buckets of one block each, so that a name is only ever looked for in one block. When the
+// bucket of a new name is full, the directory doubles its buckets. The root directory keeps
+// the layout of the reference implementation: a single bucket, which cannot grow.
+struct dirInfo {
+	int rIndex;				// entry of the directory in its parent (-1 for the root directory)
+	int numOf_buckets;		// blocks of the directory (0 if this slot is free)
+	int *pages;				// page of the directory table holding each bucket
+};
+
+// A path resolved by path_lookup(), remembered until directory entries move or go away
+struct pathCacheEntry {
+	unsigned int gen;		// pathCacheGen when the path was resolved
+	int rIndex;				// entry the path leads to
+	char path[PATH_CACHE_LEN];
+};
+
+// In-memory view of the block map of a mapped file. The map has two levels: an index
+// block whose entries point to map blocks, and map blocks whose entries point to the
+// data blocks of the file. MAP_HOLE at either level means nothing was ever written there,
+// so a hole of any size costs no data block and reads back as zeros without any disk I/O.
+struct blockMap {
+	int rIndex;						// index of the file in root directory
+	uint16_t index[MAP_ENTRIES];	// content of the index block
+	int indexDirty;					// index block must be written back
+	int mapSlot;					// index entry of the map block loaded in @entries (-1 if none)
+	uint16_t entries[MAP_ENTRIES];	// content of the currently loaded map block
+	int entriesDirty;				// currently loaded map block must be written back
+};
+
+// Decompressed copy of one cluster of a compressed file. The map of a compressed file has
+// two entries per cluster: the first block of the FAT chain storing the cluster, and the
+// number of bytes of compressed data in it (0 if the cluster is stored uncompressed).
+// Writes land in the cache, and the cluster is only compressed and stored when flushed.
+struct clusterCache {
+	size_t cluster;				// index of the cluster held in @data
+	size_t length;				// number of valid bytes in @data, the rest is zeros
+	size_t reserved;			// free blocks set aside to store the cluster once flushed
+	int dirty;					// @data was modified since it was last stored
+	char data[CLUSTER_SIZE];
+};
     
 // Global instances and variables
 struct superblock sblock;
 struct fatEntry *fat;
-struct rootDirEntry rdir[FS_FILE_MAX_COUNT];		// Total of 128 entries 
-struct fileDescriptor fds[FS_OPEN_MAX_COUNT];		// Total of 32 open file descriptors
+struct rootDirEntry *rdir = NULL;					// Directory table: the root directory, then pages of subdirectories
+struct fdChunk *fdChunks[FD_CHUNKS];				// File descriptor table, grown one chunk at a time
+int numOf_fdChunks = 0;								// Chunks allocated in the file descriptor table
+int fdFreeHead = -1;								// First descriptor of the free list (-1 if empty)
+int numOf_openFds = 0;								// File descriptors currently open
+int *openCount = NULL;								// File descriptors open on each directory entry
 const char myVirtualDisk[8] = "ECS150FS";			// Declare a constant char array
 int isMounted = 0;									// Flag to track if filesystem is currently mounted
+uint8_t *refcnt = NULL;								// Extra references to each data block (NULL until a file is cloned)
+uint32_t *fprint = NULL;							// Fingerprint of each data block, 0 if unknown (NULL unless dedup is on)
+uint16_t *fprintIndex = NULL;						// Last data block seen with each fingerprint bucket (0 if none)
+uint32_t fprintMask = 0;							// Number of buckets in the fingerprint index minus one
+struct clusterCache **ccache = NULL;				// Cluster cache of each compressed file (NULL if none)
+size_t reservedBlocks = 0;							// Free blocks set aside by the dirty cluster caches
+uint32_t *csum = NULL;								// Checksum of each data block, 0 if unknown (NULL unless checksums are on)
+struct fatEntry *fatShadow = NULL;					// FAT as last written to disk
+void *fprintShadow = NULL;							// Fingerprint table as last written to disk (NULL if unknown)
+void *refcntShadow = NULL;							// Reference count table as last written to disk (NULL if unknown)
+void *csumShadow = NULL;							// Checksum table as last written to disk (NULL if unknown)
+struct rootDirEntry *rdirShadow = NULL;				// Directory table as last written to disk
+int *entryDir = NULL;								// Directory each subdirectory entry leads to (0 if none)
+struct dirPage *pages = NULL;						// Page of the directory table each block of entries is
+int numOf_pages = 0;								// Pages in the directory table
+int numOf_entries = 0;								// Entries in the directory table, DIR_ENTRIES per page
+struct dirInfo *dirs = NULL;						// Directories, the root directory first
+int numOf_dirs = 0;									// Slots in @dirs
+struct pathCacheEntry pathCache[PATH_CACHE_SLOTS];	// Paths resolved lately
+unsigned int pathCacheGen = 1;						// Bumped to forget every path in the cache
+int metaDirty = 0;									// In-memory structures may differ from the disk
+int syncError = 0;									// A background write-back failed since the last fs_sync()
+int syncPolicy = FS_SYNC_ALWAYS;					// When in-memory structures are written back
+unsigned int syncInterval = 1000;					// Milliseconds between write-backs of the flusher thread
+unsigned int flusherGen = 0;						// Bumped to tell the flusher thread of a mount to exit
+pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;	// Serializes calls to the API with the flusher thread
+pthread_cond_t flusherCond = PTHREAD_COND_INITIALIZER;	// Wakes the flusher thread up early
+uint16_t *heat = NULL;								// Reads of each data block, halved at each tiering pass (NULL unless tiered)
+int fastBlocks = 0;									// Data blocks below this index are on the fast tier of the disk
+size_t tierReads = 0;								// Data block reads since the last tiering pass
+int logHead = 0;									// Data block the log continues from, in log mode
+int cleanerStarted = 0;								// The segment cleaner thread runs for this mount
+int diskFreeBlocks = 0;								// Free data blocks in the FAT as last written to disk
+int diskFreeEntries = 0;							// Free root directory entries as last written to disk
 
 
 // Helper function prototypes
 //int count_free_fat_entries(void);					// Function to count free FAT entries
 //int count_free_root_dir_entries(void);				// Function to count free root directory entries
-int find_empty_rIndex(struct rootDirEntry *rDir);	// Function to find an empty entry index in root directory
-int count_open_fds(void);							// Function to keep track of opened file descriptors
+struct fileDescriptor *fd_lookup(int fd);			// Function to find the open file descriptor @fd
+int fd_alloc(void);									// Function to take a descriptor off the free list
+void fd_free(int fd);								// Function to put a descriptor back on the free list
+void fd_reset(void);								// Function to drop the whole file descriptor table
+int dir_table_init(void);							// Function to set up the directory table for a mount
+void dir_table_free(void);							// Function to drop the directory table
+void load_directories(void);						// Function to load every subdirectory into the directory table
+int page_alloc(int dir, int block);					// Function to take a page of the directory table for a directory block
+int dir_alloc(int rIndex, int *bucketPages, int numOf_buckets);	// Function to take a slot for a subdirectory
+void dir_free(int dir);								// Function to drop a subdirectory from memory
+int dir_lookup(int dir, const char *name);			// Function to find a name in a directory
+int dir_insert(int dir, const char *name);			// Function to find a free entry for a name in a directory
+int path_lookup(const char *path);					// Function to find the entry a path leads to
+int path_parent(const char *path, const char **name);	// Function to find the directory a path names a file in
+int path_dir(const char *path);						// Function to find the directory a path leads to
 int get_data_block_index();							// Function to get the index of the data block corresponding to the offset
 int allocate_new_data_block();						// Function to find free block index using first-fit strategy
+int write_fat_blocks(void);							// Function to write the in-memory FAT back to disk
+int read_metadata(void);							// Function to read the superblock, FAT and root directory
+int table_chain_valid(int first, size_t entrySize);	// Function to check the FAT chain of a table
+void free_metadata(void);							// Function to free the metadata of a mount
+int write_rdir(void);								// Function to write the root directory back to disk
+int write_metadata(void);							// Function to write every in-memory structure back to disk
+int write_through(void);							// Function to write the changed metadata back to disk
+int write_back(void);								// Function to write everything back and flush the disk
+int find_free_run(int length);						// Function to find a run of contiguous free data blocks
+int map_open(struct blockMap *map, int rIndex);		// Function to load the block map of a mapped file
+int map_lookup(struct blockMap *map, size_t lblock);	// Function to find the data block of a logical block
+int map_set(struct blockMap *map, size_t lblock, int dataIndex);	// Function to point a logical block at a data block
+int map_close(struct blockMap *map);				// Function to write back a modified block map
+int convert_to_mapped(int rIndex);					// Function to turn a FAT chain file into a mapped file
+void free_file_blocks(int rIndex);					// Function to release every block used by a file
+int block_is_shared(int dataIndex);					// Function to tell if a data block belongs to several files
+void release_data_block(int dataIndex);				// Function to drop one reference to a data block
+int next_or_new_data_block(int dataIndex);			// Function to follow or extend a FAT chain
+void fprint_forget(int dataIndex);					// Function to drop the fingerprint of a data block
+int count_free_blocks(void);						// Function to count free data blocks
+int count_free_entries(const struct rootDirEntry *rDir);	// Function to count free root directory entries
+void release_cluster(int first);					// Function to drop one reference to a stored cluster
+int flush_file_cluster(int rIndex);					// Function to store the cached cluster of a compressed file
+int data_block_read(int dataIndex, void *buf);		// Function to read a data block and verify its checksum
+int data_block_write(int dataIndex, const void *buf);	// Function to write a data block and record its checksum
+int data_blocks_read(struct blockRequest *reqs, int numOf_reqs);	// Function to read a batch of data blocks
+int tier_rebalance(size_t io_budget);				// Function to move hot data blocks to the fast tier
+int data_blocks_write(struct blockRequest *reqs, int numOf_reqs);	// Function to write a batch of data blocks
+int start_cleaner(void);							// Function to start the segment cleaner of log mode
+size_t count_file_blocks(int rIndex, uint16_t *index, uint16_t *entries);	// Function to count the data blocks of a file
 
 
 /* Helper function definitions */
 
 
-// Function to find the position of an empty entry to create a file in the root directory.
-int find_empty_rIndex(struct rootDirEntry *rDir) {		// Use in fs_create()
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {	
-        if (rDir[i].file_name[0] == '\0') {
-			// Returns the index of the empty entry
-            return i;									
-        }
-    }
-	// or -1 if no empty entry was found.
-    return -1;											
-}
-
-// Function to count open file descriptors
-int count_open_fds(void){				// Use in fs_open()
-	int open_fds = 0;
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(fds[i].fdIndex != -1){		// -1 means fd is closed or unused.
-			open_fds++;					// Increment the count
-		}
-	}
-	// return the numbers of currently opened fds
-	return open_fds;					
-}
-
 int get_data_block_index(int fd){							// use in fs_read() and fs_write()
-    int rootIndex = fds[fd].rIndex;							// Get root directory index correspond to input @fd 
+    int rootIndex = fd_lookup(fd)->rIndex;					// Get root directory index correspond to input @fd 
     int dataIndex = rdir[rootIndex].firstDataBlock_index;	// first data block index correspond to @fd
 
     // Calculate the actual index of the data blocks on the disk
@@ -109,717 +274,4361 @@ int get_data_block_index(int fd){							// use in fs_read() and fs_write()
 }
 
 int allocate_new_data_block(){								// use in fs_write() 
-	// Loop through each block in the FAT
-    for (int i = 0; i < sblock.numOf_dataBlocks; i++) {
-        // If the FAT entry is 0, this block is free
-        if (fat[i].content == FAT_FREE) {
-            // Return the index of the free block
-            return i;
+	// Scan the FAT for the first entry that is 0, i.e. a free block (the FAT is malloc'd,
+	// so it is suitably aligned to be scanned as an array of 16-bit entries). In log mode
+	// the scan starts at the head of the log, so that new data is laid out sequentially.
+    int start = (sblock.feature_flags & FEATURE_LOG) ? logHead : 0;
+    int i = fat_find_free(fat, start, sblock.numOf_dataBlocks);
+    if (i == -1 && start != 0) {
+        i = fat_find_free(fat, 0, sblock.numOf_dataBlocks);	// the log wraps around
+    }
+    if (i != -1) {
+        logHead = i + 1;
+        trace_point(ALLOC, i, 0, 0);
+        // Whatever the block held before is gone, and so are its fingerprint and checksum
+        fprint_forget(i);
+        if (csum != NULL) {
+            csum[i] = 0;
+        }
+        if (heat != NULL) {
+            heat[i] = 0;
         }
     }
-    // If no free block is found, return -1
-    return -1; 
+    // Return the index of the free block, or -1 if no free block is found
+    return i; 
 }
 
+// Function to count free data blocks, i.e. free FAT entries
+int count_free_blocks(void){								// use in fs_info() and fs_write()
+	return fat_count_free(fat, sblock.numOf_dataBlocks);
+}
 
-int fs_mount(const char *diskname)
-{
-	// Check if a disk is already open
-    if(block_disk_count() != -1){
-        fs_print("A disk is already mounted.\n");
-        return -1;
-    }
-	
-	// Open the virtual disk file
-    if(block_disk_open(diskname) == -1){				// checking the condition
-		fs_print("Cannot open the disk.\n" );
-        return -1;
-    }
-    
-    // Load meta-data from the disk into memory
+// Function to count free entries in a root directory
+int count_free_entries(const struct rootDirEntry *rDir){	// use in fs_info() and write_rdir()
+	int count = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rDir[i].file_name[0] == '\0') {
+			count++;
+		}
+	}
+	return count;
+}
+
+// Function to compute the checksum of a data block. 0 means "unknown" in the checksum
+// table, so a block whose CRC happens to be 0 is recorded as 1 instead.
+uint32_t block_checksum(const void *buf){
+	uint32_t crc = crc32c(buf, BLOCK_SIZE);
+	return crc ? crc : 1;
+}
 
-	// Read the superblock from the first block of the disk
-	block_read(SUPERBLOCK_INDEX, &sblock);
+// Function to count a read of data block @dataIndex towards its heat, on a tiered disk
+void heat_touch(int dataIndex){
+	if (heat != NULL) {
+		if (heat[dataIndex] != UINT16_MAX) {
+			heat[dataIndex]++;
+		}
+		tierReads++;
+	}
+}
 
-	// Error handling: check the signature of the file system
-	if(strncmp(sblock.signature, myVirtualDisk, 8) != 0){
-		fs_print("Signature specification does not match.\n" );
+// Function to read data block @dataIndex into @buf, and check it against its checksum
+// when checksums are on. The table lives in memory, so this costs no extra I/O.
+int data_block_read(int dataIndex, void *buf){
+	if (block_read(sblock.dataBlock_startIndex + dataIndex, buf) == -1) {
 		return -1;
 	}
-
-	// Error handling: check if the data block counts is correct
-	if(sblock.total_disk_blocks != block_disk_count()){
-		fs_print("block count does not match.\n" );
+	heat_touch(dataIndex);
+	if (csum != NULL && csum[dataIndex] != 0 && csum[dataIndex] != block_checksum(buf)) {
+		fs_print("Checksum mismatch in data block %d.\n", dataIndex);
 		return -1;
 	}
+	return 0;
+}
 
-	// Allocate memory for the FAT data structure 
-	/* 
-	Calculation:
-	Total FAT memory to allocate = total number of blocks occupied by the FAT in the disk * size of one FAT block 
-	*/
-	fat = malloc(sblock.numOf_fatBlocks * BLOCK_SIZE / sizeof(struct fatEntry));
-	if(fat == NULL){		// Check if FAT memory allocation is successful
+// Function to write @buf to data block @dataIndex, and record its checksum when checksums are on
+int data_block_write(int dataIndex, const void *buf){
+	if (block_write(sblock.dataBlock_startIndex + dataIndex, buf) == -1) {
 		return -1;
 	}
-
-	// Read each block of the FAT from the disk and store it in the allocated memory.
-	for(uint8_t i = 0; i < sblock.numOf_fatBlocks; i++){
-		if(block_read(FAT_BLOCK_INDEX + i,fat + i * BLOCK_SIZE / sizeof(struct fatEntry)) == -1){
-			fs_print("Failed to read FAT block.\n");
-			free(fat);
+	if (csum != NULL) {
+		csum[dataIndex] = block_checksum(buf);
+	}
+	return 0;
+}
+// Function to read a batch of data blocks, whose data block indices are in @reqs, with a single
+// call to block_submit() so that they can be merged and spread over the images of a volume
+int data_blocks_read(struct blockRequest *reqs, int numOf_reqs){
+	for (int i = 0; i < numOf_reqs; i++) {
+		reqs[i].block += sblock.dataBlock_startIndex;
+	}
+	if (block_submit(reqs, numOf_reqs) == -1) {
+		return -1;
+	}
+	for (int i = 0; i < numOf_reqs && heat != NULL; i++) {
+		heat_touch(reqs[i].block - sblock.dataBlock_startIndex);
+	}
+	for (int i = 0; i < numOf_reqs && csum != NULL; i++) {
+		int dataIndex = reqs[i].block - sblock.dataBlock_startIndex;
+		if (csum[dataIndex] != 0 && csum[dataIndex] != block_checksum(reqs[i].buf)) {
+			fs_print("Checksum mismatch in data block %d.\n", dataIndex);
 			return -1;
 		}
 	}
+	return 0;
+}
 
-	// Read the root directory from disk 
-	if (block_read(sblock.rootDir_blockIndex, &rdir) == -1) {
-		fs_print("Failed to read root directory.\n");
+// Function to write a batch of data blocks, whose data block indices are in @reqs, with a
+// single call to block_submit() so that adjacent blocks go out as one large write
+int data_blocks_write(struct blockRequest *reqs, int numOf_reqs){
+	for (int i = 0; i < numOf_reqs; i++) {
+		reqs[i].block += sblock.dataBlock_startIndex;
+	}
+	if (block_submit(reqs, numOf_reqs) == -1) {
 		return -1;
 	}
-
-	// Initialize the file descriptors
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		fds[i].fdIndex = -1;		// Mark all file descriptors as unused
-		fds[i].rIndex = -1;			// Initialize rIndex to invalid value
-		fds[i].fdOffset = 0;		// Initialize offset to zero
+	for (int i = 0; i < numOf_reqs && csum != NULL; i++) {
+		csum[reqs[i].block - sblock.dataBlock_startIndex] = block_checksum(reqs[i].buf);
 	}
-
-	isMounted = 1;	// Mark as mounted
-
-	return 0; // success
+	return 0;
 }
 
+// Function to write every block of the FAT from memory back to the disk
+// Only the blocks that changed since the FAT was last written go out, in a single batch.
+// The count of free blocks on disk follows from what changed in those blocks.
+int write_fat_blocks(void){									// use in fs_umount() and fs_defrag()
+	struct blockRequest reqs[UINT8_MAX];
+	int numOf_reqs = 0;
+	int freeDelta = 0;
+	for (uint8_t i = 0; i < sblock.numOf_fatBlocks; i++) {
+		int first = i * BLOCK_SIZE/sizeof(struct fatEntry);
+		struct fatEntry *fatBlock = fat + first;
+		if (memcmp(fatBlock, fatShadow + first, BLOCK_SIZE) == 0) {
+			continue;
+		}
+		int entries = min((int)(BLOCK_SIZE/sizeof(struct fatEntry)), sblock.numOf_dataBlocks - first);
+		freeDelta += fat_count_free(fatBlock, entries) - fat_count_free(fatShadow + first, entries);
+		reqs[numOf_reqs].block = FAT_BLOCK_INDEX + i;
+		reqs[numOf_reqs].buf = fatBlock;
+		reqs[numOf_reqs].write = 1;
+		reqs[numOf_reqs].owner = -1;
+		numOf_reqs++;
+	}
+	if (block_submit(reqs, numOf_reqs) == -1) {
+		return -1;
+	}
+	memcpy(fatShadow, fat, sblock.numOf_fatBlocks * BLOCK_SIZE);
+	diskFreeBlocks += freeDelta;
+	return 0;
+}
 
-int fs_umount(void)
-{
-/**
- * fs_umount - Unmount file system
- *
- * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
- *
- * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
- */
-
-	// Check if no FS is currently mounted  // ??? block_disk_count? or block_disk_close?
-    if(block_disk_count() == -1) {
-        fs_print("No file system is currently mounted.\n");
-        return -1;
-    }
-
-	// Check if there are still open file descriptors
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (fds[i].fdIndex != -1) {
-            fs_print("There are still open file descriptors.\n");
-            return -1;
-        }
-    }
+// Function to queue a read of @count blocks from @block into @buf, for read_metadata()
+int queue_read(struct blockRequest *reqs, int numOf_reqs, int block, void *buf, int count){
+	for (int i = 0; i < count; i++) {
+		reqs[numOf_reqs].block = block + i;
+		reqs[numOf_reqs].buf = (char*)buf + i * BLOCK_SIZE;
+		reqs[numOf_reqs].write = 0;
+		reqs[numOf_reqs].owner = -1;
+		numOf_reqs++;
+	}
+	return numOf_reqs;
+}
 
-	// Write root directory information back to disk
-	if(block_write(sblock.rootDir_blockIndex, &rdir) == -1){
-		fs_print("Failed to write root directory to disk.\n");
+// Function to read the superblock, the FAT and the root directory into memory. Their layout is
+// guessed from the size of the disk, the way fs_make.x lays it out, so that all of them come
+// in a single batch merged into one transfer. Should the superblock place the FAT or the root
+// directory elsewhere, they are read again from there. The FAT is allocated here.
+int read_metadata(void){									// use in fs_mount()
+	struct blockRequest reqs[UINT8_MAX + 2];
+	int total = block_disk_count();
+	int fatBlocks = 1;
+	while (fatBlocks < UINT8_MAX && (total - 2 - fatBlocks) * (int)sizeof(struct fatEntry) > fatBlocks * BLOCK_SIZE) {
+		fatBlocks++;
+	}
+	fat = malloc(fatBlocks * BLOCK_SIZE);
+	if (fat == NULL) {
 		return -1;
 	}
+	int numOf_reqs = queue_read(reqs, 0, SUPERBLOCK_INDEX, &sblock, 1);
+	numOf_reqs = queue_read(reqs, numOf_reqs, FAT_BLOCK_INDEX, fat, fatBlocks);
+	numOf_reqs = queue_read(reqs, numOf_reqs, FAT_BLOCK_INDEX + fatBlocks, rdir, 1);
+	if (block_submit(reqs, numOf_reqs) == -1) {
+		goto fail;
+	}
 
-    // Write FAT information back to disk
-    for (uint8_t i = 0; i < sblock.numOf_fatBlocks; i++) {
-        if (block_write(FAT_BLOCK_INDEX + i, fat + i * BLOCK_SIZE/sizeof(struct fatEntry)) == -1) {
-            fs_print("Failed to write FAT to disk.\n");
-            return -1;
-        }
-    }
-
-    // Free FAT from memory
-	if(fat != NULL){
-		 free(fat);
-		 fat = NULL;
+	// Error handling: check the signature of the file system
+	if (strncmp(sblock.signature, myVirtualDisk, 8) != 0) {
+		fs_print("Signature specification does not match.\n" );
+		goto fail;
 	}
 
-	// Close the underlying virtual disk
-	block_disk_close();
+	// Error handling: check if the data block counts is correct
+	if (sblock.total_disk_blocks != total) {
+		fs_print("block count does not match.\n" );
+		goto fail;
+	}
 
-	isMounted = 0;	// Mark as unmounted
+	if (sblock.numOf_fatBlocks != fatBlocks || sblock.rootDir_blockIndex != FAT_BLOCK_INDEX + fatBlocks) {
+		free(fat);
+		fat = malloc(sblock.numOf_fatBlocks * BLOCK_SIZE);
+		if (fat == NULL) {
+			goto fail;
+		}
+		numOf_reqs = queue_read(reqs, 0, FAT_BLOCK_INDEX, fat, sblock.numOf_fatBlocks);
+		numOf_reqs = queue_read(reqs, numOf_reqs, sblock.rootDir_blockIndex, rdir, 1);
+		if (block_submit(reqs, numOf_reqs) == -1) {
+			goto fail;
+		}
+	}
+	return 0;
 
-	return 0; // unmounted successful
+fail:
+	free(fat);
+	fat = NULL;
+	return -1;
 }
 
+// Function to free the FAT, the directories and the tables loaded by fs_mount()
+void free_metadata(void){
+	free(fprint);
+	free(fprintIndex);
+	free(refcnt);
+	free(csum);
+	free(fprintShadow);
+	free(refcntShadow);
+	free(csumShadow);
+	free(heat);
+	free(fat);
+	free(fatShadow);
+	fprint = NULL;
+	fprintIndex = NULL;
+	refcnt = NULL;
+	csum = NULL;
+	fprintShadow = NULL;
+	refcntShadow = NULL;
+	csumShadow = NULL;
+	heat = NULL;
+	fastBlocks = 0;
+	fat = NULL;
+	fatShadow = NULL;
+	dir_table_free();
+}
 
-int fs_info(void)
-{
-/* 
- * Reference program output: 
- * tkzin@COE-CS-pc1:~/p3/apps$ fs_ref.x info disk.fs
- * FS Info:
- * total_blk_count=4100
- * fat_blk_count=2
- * rdir_blk=3
- * data_blk=4
- * data_blk_count=4096
- * fat_free_ratio=4095/4096
- * rdir_free_ratio=128/128
- */
-	// Check if no FS is currently mounted
-    if(isMounted == 0){
-        fs_print("No file system is currently mounted.\n");
-        return -1;
-    }
-
-
-    int free_fat_count = 0;								// Initialize a variable to store fat free count
-    for(int i = 0; i < sblock.numOf_dataBlocks; i++) {	// since there are as many entries as data blocks in the disk
-        if(fat[i].content == FAT_FREE) {				// Assuming 0: corresponds to fat free entry
-            free_fat_count++;							// Increment the count
-        }
-    }
+// Function to write the directories back to disk: the root directory if it changed since it
+// was last written, then the changed blocks of subdirectories in a single batch
+int write_rdir(void){
+	if (memcmp(rdir, rdirShadow, BLOCK_SIZE) != 0) {
+		if (block_write(sblock.rootDir_blockIndex, rdir) == -1) {
+			return -1;
+		}
+		memcpy(rdirShadow, rdir, BLOCK_SIZE);
+		diskFreeEntries = count_free_entries(rdir);
+	}
 
-    int free_root_dir_count = 0;					// Initialize a variable to store free root directory count
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {	// Iterate over 128 entries of the root directory 
-        if(rdir[i].file_name[0] == '\0') {			// Assumimg empty file as free entry
-            free_root_dir_count++;					// Increment the count
-        }
-    }
+	struct blockRequest *reqs = malloc(numOf_pages * sizeof(struct blockRequest));
+	if (reqs == NULL) {
+		return -1;
+	}
+	int numOf_reqs = 0;
+	for (int p = 1; p < numOf_pages; p++) {
+		struct rootDirEntry *page = &rdir[p * DIR_ENTRIES];
+		if (pages[p].dir == -1 ||
+		    (pages[p].written && memcmp(page, &rdirShadow[p * DIR_ENTRIES], BLOCK_SIZE) == 0)) {
+			continue;
+		}
+		reqs[numOf_reqs].block = pages[p].block;
+		reqs[numOf_reqs].buf = page;
+		reqs[numOf_reqs].write = 1;
+		reqs[numOf_reqs].owner = -1;
+		numOf_reqs++;
+	}
+	int ret = numOf_reqs == 0 ? 0 : data_blocks_write(reqs, numOf_reqs);
+	for (int i = 0; ret == 0 && i < numOf_reqs; i++) {
+		int p = ((struct rootDirEntry *)reqs[i].buf - rdir) / DIR_ENTRIES;
+		memcpy(&rdirShadow[p * DIR_ENTRIES], reqs[i].buf, BLOCK_SIZE);
+		pages[p].written = 1;
+	}
+	free(reqs);
+	return ret;
+}
 
-	// Print out the FS info: 
-    printf("FS Info:\n");
-    printf("total_blk_count=%d\n", sblock.total_disk_blocks);
-    printf("fat_blk_count=%d\n", sblock.numOf_fatBlocks);
-    printf("rdir_blk=%d\n", sblock.rootDir_blockIndex);
-    printf("data_blk=%d\n", sblock.dataBlock_startIndex);
-    printf("data_blk_count=%d\n", sblock.numOf_dataBlocks);
-    printf("fat_free_ratio=%d/%d\n", free_fat_count, sblock.numOf_dataBlocks);
-    printf("rdir_free_ratio=%d/%d\n", free_root_dir_count, FS_FILE_MAX_COUNT);
+// Function to allocate a data block that is not part of any FAT chain (map or mapped data block)
+int allocate_standalone_block(){
+	int newBlock = allocate_new_data_block();
+	if (newBlock != -1) {
+		fat[newBlock].content = FAT_EOC;
+	}
+	return newBlock;
+}
 
-	return 0; // success
+// Function to tell if a data block is referenced by more than one file (cloned files)
+int block_is_shared(int dataIndex){
+	return refcnt != NULL && refcnt[dataIndex] > 0;
 }
 
-/* TODO: Phase 2 */
-int fs_create(const char *filename)
-{
-/**
- * fs_create - Create a new file
- * @filename: File name
- *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
- * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
- */
-	// Check if no FS is currently mounted
-    if(isMounted == 0){
-        fs_print("No FS currently mounted.\n");
-        return -1;
-    }
+// Function to drop one reference to a data block, freeing it when the last reference goes away
+void release_data_block(int dataIndex){
+	if (block_is_shared(dataIndex)) {
+		refcnt[dataIndex]--;
+	} else {
+		fprint_forget(dataIndex);
+		fat[dataIndex].content = FAT_FREE;
+	}
+}
 
-	// Check if the filename valid or too long
-	if(filename == NULL || strlen(filename) > FS_FILENAME_LEN){	
-		return -1;
+// Function to tell if the FAT chain of a table starting at @first is made of valid data blocks,
+// and holds exactly the blocks a table of @entrySize bytes per data block needs
+int table_chain_valid(int first, size_t entrySize){
+	int expected = (sblock.numOf_dataBlocks * entrySize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int current = first;
+	for (int i = 0; i < expected; i++) {
+		if (current <= 0 || current >= sblock.numOf_dataBlocks) {
+			return 0;
+		}
+		current = fat[current].content;
 	}
+	return current == FAT_EOC;
+}
 
-	// Check if a file with the same name already exists
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if(strcmp(rdir[i].file_name, filename) == 0) {
-            fs_print("File with the same name already exists.\n");
-            return -1;
-        }
+// Function to read or write a metadata table (reference counts, fingerprints, checksums)
+// that is stored on disk as a FAT chain of data blocks starting at @first. Tables change
+// in memory all the time, so their blocks are not checksummed.
+int transfer_table(int first, void *table, int write){
+	if (write && csum != NULL) {
+		for (int current = first; current != FAT_EOC; current = fat[current].content) {
+			csum[current] = 0;
+		}
 	}
 
-	// Check if the root directory exceeded FS_FILE_MAX_COUNT files
-	int remptyIndex = find_empty_rIndex(rdir);
-	if(remptyIndex == -1){	// -1 means no empty entry, root directory is full.
+	// The chain goes out as one batch, so that its contiguous stretches become single transfers
+	int numOf_blocks = 0;
+	for (int current = first; current != FAT_EOC; current = fat[current].content) {
+		numOf_blocks++;
+	}
+	struct blockRequest *reqs = malloc(numOf_blocks * sizeof(struct blockRequest));
+	if (reqs == NULL) {
 		return -1;
 	}
 
-	// Now, create a new empty file with a given parameter @filename 
-	// at the free index we just found in the root directory
-	strncpy(rdir[remptyIndex].file_name, filename, FS_FILENAME_LEN);	// get the filename
-	rdir[remptyIndex].file_size = 0; 									// set the file size to zero
-	rdir[remptyIndex].firstDataBlock_index = FAT_EOC;					// set first data block to end of chain
+	int current = first;
+	for (int i = 0; current != FAT_EOC; i++) {
+		reqs[i].block = sblock.dataBlock_startIndex + current;
+		reqs[i].buf = (char*)table + i * BLOCK_SIZE;
+		reqs[i].write = write;
+		reqs[i].owner = -1;
+		current = fat[current].content;
+	}
+	int ret = block_submit(reqs, numOf_blocks);
+	free(reqs);
+	return ret;
+}
 
+// Function to write the blocks of a table that changed since it was last written, comparing
+// the table with @shadow. The first time, the whole table goes out and @shadow is made.
+int write_table(int first, void *table, void **shadow){
+	int numOf_blocks = 0;
+	for (int current = first; current != FAT_EOC; current = fat[current].content) {
+		numOf_blocks++;
+	}
+	if (*shadow == NULL) {
+		if (transfer_table(first, table, 1) == -1) {
+			return -1;
+		}
+		*shadow = malloc(numOf_blocks * BLOCK_SIZE);
+		if (*shadow != NULL) {
+			memcpy(*shadow, table, numOf_blocks * BLOCK_SIZE);
+		}
+		return 0;
+	}
 
-	// Update the root directory information back in the disk
-	if(block_write(sblock.rootDir_blockIndex, &rdir) == -1){
+	struct blockRequest *reqs = malloc(numOf_blocks * sizeof(struct blockRequest));
+	if (reqs == NULL) {
 		return -1;
 	}
+	int numOf_reqs = 0;
+	int current = first;
+	for (int i = 0; current != FAT_EOC; i++) {
+		char *block = (char*)table + i * BLOCK_SIZE;
+		if (csum != NULL) {
+			csum[current] = 0;		// tables are not checksummed, see transfer_table()
+		}
+		if (memcmp(block, (char*)*shadow + i * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+			reqs[numOf_reqs].block = sblock.dataBlock_startIndex + current;
+			reqs[numOf_reqs].buf = block;
+			reqs[numOf_reqs].write = 1;
+			reqs[numOf_reqs].owner = -1;
+			numOf_reqs++;
+		}
+		current = fat[current].content;
+	}
+	int ret = numOf_reqs == 0 ? 0 : block_submit(reqs, numOf_reqs);
+	for (int i = 0; ret == 0 && i < numOf_reqs; i++) {
+		size_t offset = (char*)reqs[i].buf - (char*)table;
+		memcpy((char*)*shadow + offset, reqs[i].buf, BLOCK_SIZE);
+	}
+	free(reqs);
+	return ret;
+}
 
-	return 0; // fs_create success
-
+// Function to release every block of a FAT chain
+void free_chain(int first){
+	int current = first;
+	while (current != FAT_EOC) {
+		int next = fat[current].content;
+		fat[current].content = FAT_FREE;
+		current = next;
+	}
 }
 
-int fs_delete(const char *filename)
-{
-/**
- * fs_delete - Delete a file
- * @filename: File name
- *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
- */
+// Function to allocate a FAT chain of @numOf_blocks data blocks (metadata tables, clusters
+// of compressed files). Returns the first block of the chain, or -1 if the disk is full.
+int allocate_chain(int numOf_blocks){
+	int first = allocate_standalone_block();
+	if (first == -1) {
+		return -1;
+	}
+	int current = first;
+	for (int i = 1; i < numOf_blocks; i++) {
+		current = next_or_new_data_block(current);
+		if (current == -1) {
+			free_chain(first);
+			return -1;
+		}
+	}
+	return first;
+}
 
-	// Check if no FS is currently mounted
-    if(isMounted == 0){
-        fs_print("No FS currently mounted.\n");
-        return -1;
-    }
+// Function to create an empty reference count table the first time a file is cloned.
+// The table holds one byte per data block: the number of extra references to the block.
+int create_refcnt_table(void){
+	int numOf_blocks = (sblock.numOf_dataBlocks + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-	// Check if the filename is valid or too long
-	if(filename == NULL || strlen(filename) > FS_FILENAME_LEN){	
-		fs_print("Invalid filename.\n");
+	refcnt = calloc(numOf_blocks, BLOCK_SIZE);
+	if (refcnt == NULL) {
 		return -1;
 	}
 
-	// Check if the given parameter @filename exists in root directory to delete?
-	int found = -1;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(strcmp(rdir[i].file_name, filename) == 0){	// Iterate over 128 files and compare their filenames
-			found = i;	// if found the index with the same name, store it in 'found' var
-			break;
-		}
+	int first = allocate_chain(numOf_blocks);
+	if (first == -1) {
+		free(refcnt);
+		refcnt = NULL;
+		return -1;
 	}
-	// if the filename is not found, return -1.
-	if(found == -1){	
-		fs_print("Filename does not exist.\n");
-		return -1;	
+
+	// Persist the table, then make the superblock point to it
+	sblock.refcnt_blockIndex = first;
+	if (transfer_table(first, refcnt, 1) == -1 || block_write(SUPERBLOCK_INDEX, &sblock) == -1) {
+		return -1;
 	}
+	return 0;
+}
 
-	// Check if the file is already open
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(fds[i].rIndex == found){
-			fs_print("File is currently open.\n");
-			return -1;
+// Function to compute the fingerprint of a block with a fast non-cryptographic hash: four
+// independent multiply-rotate lanes walk the block 8 bytes at a time and are folded into
+// 32 bits at the end. 0 is reserved to mean "no fingerprint".
+uint32_t fingerprint_block(const void *block){
+	const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+	uint64_t lanes[4] = { prime1, prime2, ~prime1, ~prime2 };
+	const unsigned char *bytes = block;
+
+	for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(lanes)) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t word;
+			memcpy(&word, bytes + i + l * sizeof(word), sizeof(word));
+			lanes[l] += word * prime2;
+			lanes[l] = ((lanes[l] << 31) | (lanes[l] >> 33)) * prime1;
 		}
 	}
 
-	// Once the file is found, empty the file's entry in the root directory
-	memset(&rdir[found], 0, sizeof(struct rootDirEntry));
+	uint64_t h = lanes[0] ^ ((lanes[1] << 7) | (lanes[1] >> 57)) ^
+	             ((lanes[2] << 12) | (lanes[2] >> 52)) ^ ((lanes[3] << 18) | (lanes[3] >> 46));
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
 
+	uint32_t f = (uint32_t)(h ^ (h >> 32));
+	return f ? f : 1;
+}
 
-	// Delete the file's data blocks used by the file
-	// First we need to find the first index of the data block stored in the FAT
-	// and move to the next block until the fat entry is not equal to FAT_EOC.
-	int currentFatEntry = rdir[found].firstDataBlock_index;
-	while(currentFatEntry != FAT_EOC){
-		int nextFatEntry = fat[currentFatEntry].content;
-		fat[currentFatEntry].content = FAT_FREE;
-		currentFatEntry = nextFatEntry;
+// Function to forget the fingerprint of a data block whose content changes or goes away
+void fprint_forget(int dataIndex){
+	if (fprint == NULL || fprint[dataIndex] == 0) {
+		return;
 	}
+	if (fprintIndex[fprint[dataIndex] & fprintMask] == dataIndex) {
+		fprintIndex[fprint[dataIndex] & fprintMask] = 0;
+	}
+	fprint[dataIndex] = 0;
+}
 
-	// Write the root directory back to the disk
-	if(block_write(sblock.rootDir_blockIndex, &rdir) == -1){
-		return -1;
+// Function to remember the fingerprint of a data block that was just written in full
+void fprint_record(int dataIndex, uint32_t f){
+	fprint_forget(dataIndex);
+	fprint[dataIndex] = f;
+	fprintIndex[f & fprintMask] = dataIndex;
 }
 
-	return 0;
+// Function to find a data block that already holds exactly the content of @block. The
+// candidate from the fingerprint index is compared byte by byte since the hash is not
+// collision-free. Returns the data block, or -1 if there is none that can be shared.
+int fprint_find(uint32_t f, const void *block, void *bBuf){
+	int candidate = fprintIndex[f & fprintMask];
+	if (candidate == 0 || fprint[candidate] != f || refcnt[candidate] == UINT8_MAX) {
+		return -1;
+	}
+	if (data_block_read(candidate, bBuf) == -1 ||
+	    memcmp(bBuf, block, BLOCK_SIZE) != 0) {
+		return -1;
+	}
+	return candidate;
 }
 
-int fs_ls(void)
-{
+// Function to build the in-memory fingerprint index out of the per-block fingerprints.
+// The index is direct-mapped: each bucket remembers the last block seen with that hash.
+int build_fprint_index(void){
+	uint32_t numOf_buckets = 1;
+	while (numOf_buckets < 2u * sblock.numOf_dataBlocks) {
+		numOf_buckets <<= 1;
+	}
+	fprintIndex = calloc(numOf_buckets, sizeof(uint16_t));
+	if (fprintIndex == NULL) {
+		return -1;
+	}
+	fprintMask = numOf_buckets - 1;
+
+	for (int i = 0; i < sblock.numOf_dataBlocks; i++) {
+		if (fprint[i] != 0) {
+			fprintIndex[fprint[i] & fprintMask] = i;
+		}
+	}
+	return 0;
+}
+
+// Function to load the fingerprint table at mount time, when dedup is enabled on the disk
+int load_fprint_table(void){
+	int numOf_blocks = (sblock.numOf_dataBlocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	fprint = malloc(numOf_blocks * BLOCK_SIZE);
+	if (fprint == NULL || transfer_table(sblock.fprint_blockIndex, fprint, 0) == -1 ||
+	    build_fprint_index() == -1) {
+		free(fprint);
+		fprint = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+// Function to load the index block of a mapped file. A file without an index block yet
+// gets an empty one, which is only written to disk by map_close() if something is mapped.
+int map_open(struct blockMap *map, int rIndex){
+	map->rIndex = rIndex;
+	map->indexDirty = 0;
+	map->mapSlot = -1;
+	map->entriesDirty = 0;
+
+	int indexBlock = rdir[rIndex].firstDataBlock_index;
+	if (indexBlock == FAT_EOC) {
+		memset(map->index, 0, BLOCK_SIZE);
+		return 0;
+	}
+	return data_block_read(indexBlock, map->index);
+}
+
+// Function to write the loaded map block back to disk if it was modified
+int map_flush_entries(struct blockMap *map){
+	if (!map->entriesDirty) {
+		return 0;
+	}
+	if (data_block_write(map->index[map->mapSlot], map->entries) == -1) {
+		return -1;
+	}
+	map->entriesDirty = 0;
+	return 0;
+}
+
+// Function to make the map block covering @lblock the loaded one.
+// A map block that was never allocated is loaded as all holes without reading the disk.
+int map_load_slot(struct blockMap *map, size_t lblock){
+	int slot = lblock / MAP_ENTRIES;
+	if (slot >= (int)MAP_ENTRIES) {
+		return -1;	// beyond the largest file size a block map can describe
+	}
+	if (slot == map->mapSlot) {
+		return 0;
+	}
+	if (map_flush_entries(map) == -1) {
+		return -1;
+	}
+	if (map->index[slot] == MAP_HOLE) {
+		memset(map->entries, 0, BLOCK_SIZE);
+	} else if (data_block_read(map->index[slot], map->entries) == -1) {
+		return -1;
+	}
+	map->mapSlot = slot;
+	return 0;
+}
+
+// Function to find the data block holding logical block @lblock of a mapped file.
+// Returns MAP_HOLE if nothing was ever written there, or -1 on error.
+int map_lookup(struct blockMap *map, size_t lblock){
+	if (map_load_slot(map, lblock) == -1) {
+		return -1;
+	}
+	return map->entries[lblock % MAP_ENTRIES];
+}
+
+// Function to point logical block @lblock of a mapped file at data block @dataIndex,
+// allocating the index block and the map block on the way if they do not exist yet.
+int map_set(struct blockMap *map, size_t lblock, int dataIndex){
+	if (map_load_slot(map, lblock) == -1) {
+		return -1;
+	}
+
+	if (rdir[map->rIndex].firstDataBlock_index == FAT_EOC) {
+		int indexBlock = allocate_standalone_block();
+		if (indexBlock == -1) {
+			return -1;
+		}
+		rdir[map->rIndex].firstDataBlock_index = indexBlock;
+		map->indexDirty = 1;
+	}
+
+	if (map->index[map->mapSlot] == MAP_HOLE) {
+		int mapBlock = allocate_standalone_block();
+		if (mapBlock == -1) {
+			return -1;
+		}
+		map->index[map->mapSlot] = mapBlock;
+		map->indexDirty = 1;
+	}
+
+	map->entries[lblock % MAP_ENTRIES] = dataIndex;
+	map->entriesDirty = 1;
+	return 0;
+}
+
+// Function to write back whatever part of the block map was modified
+int map_close(struct blockMap *map){
+	if (map_flush_entries(map) == -1) {
+		return -1;
+	}
+	if (map->indexDirty) {
+		int indexBlock = rdir[map->rIndex].firstDataBlock_index;
+		if (data_block_write(indexBlock, map->index) == -1) {
+			return -1;
+		}
+		map->indexDirty = 0;
+	}
+	return 0;
+}
+
+// Function to turn a file stored as a FAT chain into a mapped file, so that holes can be
+// left in it. Each data block of the chain becomes a standalone block referenced by the map.
+int convert_to_mapped(int rIndex){
+	struct blockMap *map = malloc(sizeof(struct blockMap));
+	if (map == NULL) {
+		return -1;
+	}
+
+	int chainStart = rdir[rIndex].firstDataBlock_index;
+	rdir[rIndex].firstDataBlock_index = FAT_EOC;
+	rdir[rIndex].file_flags |= FILE_MAPPED;
+	map_open(map, rIndex);
+
+	// Map every block of the chain, keeping the chain itself intact in case we run out of space
+	size_t lblock = 0;
+	for (int current = chainStart; current != FAT_EOC; current = fat[current].content) {
+		if (map_set(map, lblock++, current) == -1) {
+			// Give back the map blocks allocated so far, the chain itself was not touched
+			for (size_t i = 0; i < MAP_ENTRIES; i++) {
+				if (map->index[i] != MAP_HOLE) {
+					fat[map->index[i]].content = FAT_FREE;
+				}
+			}
+			if (rdir[rIndex].firstDataBlock_index != FAT_EOC) {
+				fat[rdir[rIndex].firstDataBlock_index].content = FAT_FREE;
+			}
+			rdir[rIndex].firstDataBlock_index = chainStart;
+			rdir[rIndex].file_flags &= ~FILE_MAPPED;
+			free(map);
+			return -1;
+		}
+	}
+	if (map_close(map) == -1) {
+		free(map);
+		return -1;
+	}
+	free(map);
+
+	// Unlink the chain: every data block now stands on its own
+	int current = chainStart;
+	while (current != FAT_EOC) {
+		int next = fat[current].content;
+		fat[current].content = FAT_EOC;
+		current = next;
+	}
+	return 0;
+}
+
+// Function to release every block used by a file, data and map blocks alike
+void free_file_blocks(int rIndex){
+	int current = rdir[rIndex].firstDataBlock_index;
+
+	if (!(rdir[rIndex].file_flags & FILE_MAPPED)) {
+		free_chain(current);
+		return;
+	}
+
+	if (current == FAT_EOC) {
+		return;
+	}
+
+	uint16_t *index = malloc(BLOCK_SIZE);
+	uint16_t *entries = malloc(BLOCK_SIZE);
+	if (index != NULL && entries != NULL &&
+	    data_block_read(current, index) == 0) {
+		for (size_t i = 0; i < MAP_ENTRIES; i++) {
+			if (index[i] == MAP_HOLE) {
+				continue;
+			}
+			if (data_block_read(index[i], entries) == 0) {
+				for (size_t j = 0; j < MAP_ENTRIES; j++) {
+					if (rdir[rIndex].file_flags & FILE_COMPRESSED) {
+						// Entries go by pairs: stored cluster, then its compressed length
+						if (j % 2 == 0 && entries[j] != MAP_HOLE) {
+							release_cluster(entries[j]);
+						}
+					} else if (entries[j] != MAP_HOLE) {
+						release_data_block(entries[j]);
+					}
+				}
+			}
+			fat[index[i]].content = FAT_FREE;
+		}
+	}
+	fat[current].content = FAT_FREE;
+	free(index);
+	free(entries);
+}
+
+// Function to count the data blocks a file occupies, its index and map blocks included. A
+// FAT chain is followed in memory; the block map of a mapped or compressed file is read into
+// @index and @entries. Blocks shared with clones count for every file that has them.
+size_t count_file_blocks(int rIndex, uint16_t *index, uint16_t *entries){
+	int numOf_blocks = sblock.numOf_dataBlocks;
+	int current = rdir[rIndex].firstDataBlock_index;
+	size_t count = 0;
+
+	if (!(rdir[rIndex].file_flags & FILE_MAPPED)) {
+		for (; current != FAT_EOC && current < numOf_blocks && (int)count < numOf_blocks; count++) {
+			current = fat[current].content;
+		}
+		return count;
+	}
+
+	if (current == FAT_EOC || data_block_read(current, index) == -1) {
+		return 0;
+	}
+	count = 1;
+	for (size_t i = 0; i < MAP_ENTRIES; i++) {
+		if (index[i] == MAP_HOLE) {
+			continue;
+		}
+		count++;
+		if (data_block_read(index[i], entries) == -1) {
+			continue;
+		}
+		for (size_t j = 0; j < MAP_ENTRIES; j++) {
+			if (entries[j] == MAP_HOLE) {
+				continue;
+			}
+			if (!(rdir[rIndex].file_flags & FILE_COMPRESSED)) {
+				count++;
+			} else if (j % 2 == 0) {
+				// Entries go by pairs: stored cluster, then its compressed length
+				int block = entries[j];
+				for (int n = 0; block != FAT_EOC && block < numOf_blocks && n < CLUSTER_BLOCKS; n++) {
+					count++;
+					block = fat[block].content;
+				}
+			}
+		}
+	}
+	return count;
+}
+
+// Function to get the data block following @dataIndex in its FAT chain, extending the
+// chain with a newly allocated block if @dataIndex is the last one. Returns -1 if full.
+int next_or_new_data_block(int dataIndex){
+	if (fat[dataIndex].content != FAT_EOC) {
+		return fat[dataIndex].content;
+	}
+	int newBlock = allocate_standalone_block();
+	if (newBlock != -1) {
+		fat[dataIndex].content = newBlock;
+	}
+	return newBlock;
+}
+
+// Function to fill the bounce buffer with the current content of a block before part of it
+// is overwritten. Blocks that were never written start out as zeros, and bytes past the end
+// of the file are cleared since they may still hold stale data from a deleted file.
+int load_block_for_update(int dataIndex, size_t blockStart, size_t fileSize, int fresh, void *bBuf){
+	if (fresh || blockStart >= fileSize) {
+		memset(bBuf, 0, BLOCK_SIZE);
+		return 0;
+	}
+	if (data_block_read(dataIndex, bBuf) == -1) {
+		return -1;
+	}
+	if (fileSize - blockStart < BLOCK_SIZE) {
+		memset((char*)bBuf + (fileSize - blockStart), 0, BLOCK_SIZE - (fileSize - blockStart));
+	}
+	return 0;
+}
+
+// Function to write @count bytes at @offset of a file stored as a FAT chain. The offset is
+// at most one block past the last block of the chain (fs_write() maps the file otherwise).
+// Whole blocks are handed to block_submit() in batches. In log mode, blocks that already
+// hold data are not overwritten: the new data goes to a block at the head of the log, which
+// takes the place of the old block in the chain.
+// Returns the number of bytes written, which is smaller than @count if the disk is full.
+int write_chain(int rIndex, size_t offset, const char *buf, size_t count, void *bBuf){
+	size_t fileSize = rdir[rIndex].file_size;
+	size_t bytesWritten = 0;
+	int fresh = 0;	// the current block was just allocated and holds nothing yet
+	int previous = -1;	// block before the current one in the chain (-1 for the first one)
+	struct blockRequest reqs[WRITE_BATCH];
+	int numOf_reqs = 0;
+
+	// An empty file gets its first data block
+	int dataIndex = rdir[rIndex].firstDataBlock_index;
+	if (dataIndex == FAT_EOC) {
+		dataIndex = allocate_standalone_block();
+		if (dataIndex == -1) {
+			return 0;
+		}
+		rdir[rIndex].firstDataBlock_index = dataIndex;
+		fresh = 1;
+	}
+
+	// Walk the chain up to the block containing @offset
+	for (size_t i = 0; i < offset / BLOCK_SIZE; i++) {
+		fresh = (fat[dataIndex].content == FAT_EOC);
+		previous = dataIndex;
+		dataIndex = next_or_new_data_block(dataIndex);
+		if (dataIndex == -1) {
+			return 0;
+		}
+	}
+
+	while (bytesWritten < count) {
+		size_t blockOffset = offset % BLOCK_SIZE;
+		size_t bytesToWrite = min(BLOCK_SIZE - blockOffset, count - bytesWritten);
+		const void *src = buf + bytesWritten;
+
+		// Partial block writes keep what the block already contains
+		if (bytesToWrite < BLOCK_SIZE) {
+			if (load_block_for_update(dataIndex, offset - blockOffset, fileSize, fresh, bBuf) == -1) {
+				return -1;
+			}
+			memcpy((char*)bBuf + blockOffset, src, bytesToWrite);
+			src = bBuf;
+		}
+
+		// In log mode, the block moves to the head of the log rather than being overwritten
+		if ((sblock.feature_flags & FEATURE_LOG) && !fresh && offset - blockOffset < fileSize) {
+			int newIndex = allocate_new_data_block();
+			if (newIndex == -1) {
+				break;	// disk is full
+			}
+			fat[newIndex].content = fat[dataIndex].content;
+			if (previous == -1) {
+				rdir[rIndex].firstDataBlock_index = newIndex;
+			} else {
+				fat[previous].content = newIndex;
+			}
+			fprint_forget(dataIndex);
+			fat[dataIndex].content = FAT_FREE;
+			dataIndex = newIndex;
+		}
+
+		// Whole blocks are written in batches, partial ones (in the bounce buffer) right away
+		if (src == bBuf) {
+			if (data_block_write(dataIndex, src) == -1) {
+				return -1;
+			}
+		} else {
+			reqs[numOf_reqs].block = dataIndex;
+			reqs[numOf_reqs].buf = (void*)src;
+			reqs[numOf_reqs].write = 1;
+			reqs[numOf_reqs].owner = rIndex;
+			if (++numOf_reqs == WRITE_BATCH) {
+				if (data_blocks_write(reqs, numOf_reqs) == -1) {
+					return -1;
+				}
+				numOf_reqs = 0;
+			}
+		}
+
+		bytesWritten += bytesToWrite;
+		offset += bytesToWrite;
+
+		// Move to the next block of the chain, growing it if needed
+		if (bytesWritten < count) {
+			fresh = (fat[dataIndex].content == FAT_EOC);
+			previous = dataIndex;
+			dataIndex = next_or_new_data_block(dataIndex);
+			if (dataIndex == -1) {
+				break;	// disk is full
+			}
+		}
+	}
+
+	if (numOf_reqs > 0 && data_blocks_write(reqs, numOf_reqs) == -1) {
+		return -1;
+	}
+	return bytesWritten;
+}
+
+// Function to write @count bytes at @offset of a mapped file. Only the blocks actually
+// touched by the write are allocated, anything skipped over stays a hole.
+// Returns the number of bytes written, which is smaller than @count if the disk is full.
+int write_mapped(int rIndex, size_t offset, const char *buf, size_t count, void *bBuf){
+	size_t fileSize = rdir[rIndex].file_size;
+	size_t bytesWritten = 0;
+
+	struct blockMap *map = malloc(sizeof(struct blockMap));
+	if (map == NULL || map_open(map, rIndex) == -1) {
+		free(map);
+		return -1;
+	}
+
+	while (bytesWritten < count) {
+		size_t blockOffset = offset % BLOCK_SIZE;
+		size_t bytesToWrite = min(BLOCK_SIZE - blockOffset, count - bytesWritten);
+		const void *src = buf + bytesWritten;
+
+		int dataIndex = map_lookup(map, offset / BLOCK_SIZE);
+		if (dataIndex == -1) {
+			break;
+		}
+
+		// In dedup mode, a full block whose content is already on disk is shared, not written
+		uint32_t f = 0;
+		if (fprint != NULL && bytesToWrite == BLOCK_SIZE) {
+			f = fingerprint_block(src);
+			int match = fprint_find(f, src, bBuf);
+			if (match != -1 && (match == dataIndex || map_set(map, offset / BLOCK_SIZE, match) == 0)) {
+				if (match != dataIndex) {
+					refcnt[match]++;
+					if (dataIndex != MAP_HOLE) {
+						release_data_block(dataIndex);
+					}
+				}
+				bytesWritten += bytesToWrite;
+				offset += bytesToWrite;
+				continue;
+			}
+		}
+
+		// Writing into a hole allocates its block, and writing into a block shared with
+		// a clone gives this file its own copy (the old content still comes from @sourceIndex).
+		// In log mode, every write goes to a new block at the head of the log.
+		int sourceIndex = dataIndex;
+		if (dataIndex == MAP_HOLE || block_is_shared(dataIndex) ||
+		    (sblock.feature_flags & FEATURE_LOG)) {
+			dataIndex = allocate_standalone_block();
+			if (dataIndex == -1) {
+				break;	// disk is full
+			}
+			if (map_set(map, offset / BLOCK_SIZE, dataIndex) == -1) {
+				fat[dataIndex].content = FAT_FREE;
+				break;	// no room left for the map block
+			}
+			if (sourceIndex != MAP_HOLE) {
+				release_data_block(sourceIndex);
+			}
+		}
+
+		// Partial block writes keep what the block already contains
+		if (bytesToWrite < BLOCK_SIZE) {
+			if (load_block_for_update(sourceIndex, offset - blockOffset, fileSize,
+			                          sourceIndex == MAP_HOLE, bBuf) == -1) {
+				break;
+			}
+			memcpy((char*)bBuf + blockOffset, src, bytesToWrite);
+			src = bBuf;
+		}
+		if (data_block_write(dataIndex, src) == -1) {
+			break;
+		}
+
+		// Keep the fingerprint index in line with the new content of the block
+		if (fprint != NULL) {
+			if (bytesToWrite == BLOCK_SIZE) {
+				fprint_record(dataIndex, f);
+			} else {
+				fprint_forget(dataIndex);
+			}
+		}
+
+		bytesWritten += bytesToWrite;
+		offset += bytesToWrite;
+	}
+
+	int ret = map_close(map);
+	free(map);
+	if (ret == -1) {
+		return -1;
+	}
+	return bytesWritten;
+}
+
+// Function to read @count bytes at @offset of a file stored as a FAT chain.
+// The caller makes sure the range lies within the file.
+int read_chain(int rIndex, size_t offset, char *buf, size_t count, void *bBuf){
+	size_t bytesRead = 0;
+	struct blockRequest batch[READ_BATCH];
+	int numOf_batched = 0;
+
+	// Walk the chain up to the block containing @offset
+	int dataIndex = rdir[rIndex].firstDataBlock_index;
+	for (size_t i = 0; i < offset / BLOCK_SIZE && dataIndex != FAT_EOC; i++) {
+		dataIndex = fat[dataIndex].content;
+	}
+
+	while (bytesRead < count && dataIndex != FAT_EOC) {
+		size_t blockOffset = offset % BLOCK_SIZE;
+		size_t bytesToRead = min(BLOCK_SIZE - blockOffset, count - bytesRead);
+
+		// Whole blocks go straight into the user buffer, in batches, partial ones through the bounce buffer
+		if (bytesToRead == BLOCK_SIZE) {
+			batch[numOf_batched++] = (struct blockRequest){ dataIndex, buf + bytesRead, 0, rIndex };
+			if (numOf_batched == READ_BATCH) {
+				if (data_blocks_read(batch, numOf_batched) == -1) {
+					return -1;
+				}
+				numOf_batched = 0;
+			}
+		} else {
+			if (data_block_read(dataIndex, bBuf) == -1) {
+				return -1;
+			}
+			memcpy(buf + bytesRead, (char*)bBuf + blockOffset, bytesToRead);
+		}
+
+		bytesRead += bytesToRead;
+		offset += bytesToRead;
+
+		// Proceed to next data block if there are still remaining bytes to read
+		if (bytesRead < count) {
+			dataIndex = fat[dataIndex].content;
+			trace_point(NEXT_BLOCK, rIndex, dataIndex, 0);
+		}
+	}
+	if (numOf_batched > 0 && data_blocks_read(batch, numOf_batched) == -1) {
+		return -1;
+	}
+	return bytesRead;
+}
+
+// Function to read @count bytes at @offset of a mapped file. Holes are filled with zeros
+// without touching the disk. The caller makes sure the range lies within the file.
+int read_mapped(int rIndex, size_t offset, char *buf, size_t count, void *bBuf){
+	size_t bytesRead = 0;
+	struct blockRequest batch[READ_BATCH];
+	int numOf_batched = 0;
+
+	struct blockMap *map = malloc(sizeof(struct blockMap));
+	if (map == NULL || map_open(map, rIndex) == -1) {
+		free(map);
+		return -1;
+	}
+
+	while (bytesRead < count) {
+		size_t blockOffset = offset % BLOCK_SIZE;
+		size_t bytesToRead = min(BLOCK_SIZE - blockOffset, count - bytesRead);
+
+		int dataIndex = map_lookup(map, offset / BLOCK_SIZE);
+		if (dataIndex == -1) {
+			free(map);
+			return -1;
+		}
+
+		if (dataIndex == MAP_HOLE) {
+			memset(buf + bytesRead, 0, bytesToRead);
+		} else if (bytesToRead == BLOCK_SIZE) {
+			batch[numOf_batched++] = (struct blockRequest){ dataIndex, buf + bytesRead, 0, rIndex };
+			if (numOf_batched == READ_BATCH) {
+				if (data_blocks_read(batch, numOf_batched) == -1) {
+					free(map);
+					return -1;
+				}
+				numOf_batched = 0;
+			}
+		} else {
+			if (data_block_read(dataIndex, bBuf) == -1) {
+				free(map);
+				return -1;
+			}
+			memcpy(buf + bytesRead, (char*)bBuf + blockOffset, bytesToRead);
+		}
+
+		bytesRead += bytesToRead;
+		offset += bytesToRead;
+	}
+
+	free(map);
+	if (numOf_batched > 0 && data_blocks_read(batch, numOf_batched) == -1) {
+		return -1;
+	}
+	return bytesRead;
+}
+
+
+// Function to release one reference to every block of the FAT chain storing a cluster.
+// All blocks of a stored cluster are shared together, so the links stay valid for whoever
+// still references the chain.
+void release_cluster(int first){
+	int current = first;
+	while (current != FAT_EOC) {
+		int next = fat[current].content;
+		release_data_block(current);
+		current = next;
+	}
+}
+
+// Function to compress the cached cluster of a file and store it, if it was modified. The
+// cluster is kept compressed only if that saves at least one block. It goes to a new chain
+// of blocks, and the chain that stored it before is released afterwards.
+int flush_cluster(struct blockMap *map, struct clusterCache *cache){
+	if (!cache->dirty) {
+		return 0;
+	}
+
+	char *stored = malloc(CLUSTER_SIZE);
+	if (stored == NULL) {
+		return -1;
+	}
+
+	size_t rawBlocks = (cache->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t storedLength = 0;
+	if (rawBlocks > 1) {
+		storedLength = lz_compress(cache->data, cache->length, stored, (rawBlocks - 1) * BLOCK_SIZE);
+	}
+	size_t numOf_blocks = rawBlocks;
+	const char *payload = cache->data;
+	if (storedLength != 0) {
+		numOf_blocks = (storedLength + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		memset(stored + storedLength, 0, numOf_blocks * BLOCK_SIZE - storedLength);
+		payload = stored;
+	}
+
+	// Write the cluster to a new chain
+	int first = MAP_HOLE;
+	if (numOf_blocks > 0) {
+		first = allocate_chain(numOf_blocks);
+		if (first == -1) {
+			free(stored);
+			return -1;
+		}
+		int current = first;
+		for (size_t i = 0; i < numOf_blocks; i++) {
+			if (data_block_write(current, payload + i * BLOCK_SIZE) == -1) {
+				free_chain(first);
+				free(stored);
+				return -1;
+			}
+			current = fat[current].content;
+		}
+	}
+	free(stored);
+
+	// Switch the map over to the new chain (both entries live in the same map block)
+	int oldFirst = map_lookup(map, 2 * cache->cluster);
+	if (oldFirst == -1 || map_set(map, 2 * cache->cluster, first) == -1 ||
+	    map_set(map, 2 * cache->cluster + 1, storedLength) == -1) {
+		if (first != MAP_HOLE) {
+			free_chain(first);
+		}
+		return -1;
+	}
+	if (oldFirst != MAP_HOLE) {
+		release_cluster(oldFirst);
+	}
+
+	reservedBlocks -= cache->reserved;
+	cache->reserved = 0;
+	cache->dirty = 0;
+	return 0;
+}
+
+// Function to make cluster @cluster of a compressed file the one held in the file's cache.
+// The cluster cached before is stored first if it was modified. Returns NULL on error.
+struct clusterCache *load_cluster(struct blockMap *map, size_t cluster){
+	struct clusterCache *cache = ccache[map->rIndex];
+	if (cache == NULL) {
+		cache = malloc(sizeof(struct clusterCache));
+		if (cache == NULL) {
+			return NULL;
+		}
+		cache->cluster = SIZE_MAX;
+		cache->reserved = 0;
+		cache->dirty = 0;
+		ccache[map->rIndex] = cache;
+	} else if (cache->cluster == cluster) {
+		return cache;
+	}
+
+	if (flush_cluster(map, cache) == -1) {
+		return NULL;
+	}
+
+	// Whatever is not stored in the cluster reads back as zeros
+	size_t clusterStart = cluster * CLUSTER_SIZE;
+	size_t fileSize = rdir[map->rIndex].file_size;
+	cache->cluster = SIZE_MAX;
+	cache->length = fileSize > clusterStart ? min(CLUSTER_SIZE, fileSize - clusterStart) : 0;
+	memset(cache->data, 0, CLUSTER_SIZE);
+
+	int first = map_lookup(map, 2 * cluster);
+	int storedLength = map_lookup(map, 2 * cluster + 1);
+	if (first == -1 || storedLength == -1) {
+		return NULL;
+	}
+
+	if (first != MAP_HOLE) {
+		// Uncompressed clusters are read straight into the cache
+		char *stored = storedLength ? malloc(CLUSTER_SIZE) : cache->data;
+		if (stored == NULL) {
+			return NULL;
+		}
+		int current = first;
+		for (size_t i = 0; i < CLUSTER_BLOCKS && current != FAT_EOC; i++) {
+			if (data_block_read(current, stored + i * BLOCK_SIZE) == -1) {
+				if (storedLength) {
+					free(stored);
+				}
+				return NULL;
+			}
+			current = fat[current].content;
+		}
+		if (storedLength) {
+			int ret = lz_decompress(stored, storedLength, cache->data, CLUSTER_SIZE);
+			free(stored);
+			if (ret == -1) {
+				fs_print("Corrupted compressed cluster.\n");
+				return NULL;
+			}
+		}
+	}
+
+	cache->cluster = cluster;
+	return cache;
+}
+
+// Function to store the cached cluster of a compressed file, if it has one
+int flush_file_cluster(int rIndex){
+	if (ccache[rIndex] == NULL || !ccache[rIndex]->dirty) {
+		return 0;
+	}
+
+	struct blockMap *map = malloc(sizeof(struct blockMap));
+	if (map == NULL || map_open(map, rIndex) == -1) {
+		free(map);
+		return -1;
+	}
+	int ret = flush_cluster(map, ccache[rIndex]);
+	if (map_close(map) == -1) {
+		ret = -1;
+	}
+	free(map);
+	return ret;
+}
+
+// Function to write @count bytes at @offset of a compressed file. Data is copied into the
+// cluster cache, and enough free blocks are set aside to store each modified cluster even
+// if it does not compress, so that running out of space is noticed here and not on flush.
+// Returns the number of bytes written, which is smaller than @count if the disk is full.
+int write_compressed(int rIndex, size_t offset, const char *buf, size_t count){
+	size_t bytesWritten = 0;
+
+	struct blockMap *map = malloc(sizeof(struct blockMap));
+	if (map == NULL || map_open(map, rIndex) == -1) {
+		free(map);
+		return -1;
+	}
+
+	while (bytesWritten < count) {
+		size_t clusterOffset = offset % CLUSTER_SIZE;
+		size_t bytesToWrite = min(CLUSTER_SIZE - clusterOffset, count - bytesWritten);
+
+		struct clusterCache *cache = load_cluster(map, offset / CLUSTER_SIZE);
+		if (cache == NULL) {
+			break;
+		}
+
+		// Make sure the cluster can be stored, keeping two blocks aside for the block map
+		size_t freeBlocks = count_free_blocks();
+		size_t available = freeBlocks > reservedBlocks + 2 ? freeBlocks - reservedBlocks - 2 : 0;
+		size_t maxLength = (cache->reserved + available) * BLOCK_SIZE;
+		if (clusterOffset >= maxLength) {
+			break;	// disk is full
+		}
+		bytesToWrite = min(bytesToWrite, maxLength - clusterOffset);
+
+		memcpy(cache->data + clusterOffset, buf + bytesWritten, bytesToWrite);
+		cache->length = max(cache->length, clusterOffset + bytesToWrite);
+		cache->dirty = 1;
+
+		size_t needed = (cache->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if (needed > cache->reserved) {
+			reservedBlocks += needed - cache->reserved;
+			cache->reserved = needed;
+		}
+
+		bytesWritten += bytesToWrite;
+		offset += bytesToWrite;
+	}
+
+	int ret = map_close(map);
+	free(map);
+	if (ret == -1) {
+		return -1;
+	}
+	return bytesWritten;
+}
+
+// Function to read @count bytes at @offset of a compressed file, one cluster at a time
+// through the cluster cache. The caller makes sure the range lies within the file.
+int read_compressed(int rIndex, size_t offset, char *buf, size_t count){
+	size_t bytesRead = 0;
+
+	struct blockMap *map = malloc(sizeof(struct blockMap));
+	if (map == NULL || map_open(map, rIndex) == -1) {
+		free(map);
+		return -1;
+	}
+
+	while (bytesRead < count) {
+		size_t clusterOffset = offset % CLUSTER_SIZE;
+		size_t bytesToRead = min(CLUSTER_SIZE - clusterOffset, count - bytesRead);
+
+		struct clusterCache *cache = load_cluster(map, offset / CLUSTER_SIZE);
+		if (cache == NULL) {
+			break;
+		}
+		memcpy(buf + bytesRead, cache->data + clusterOffset, bytesToRead);
+
+		bytesRead += bytesToRead;
+		offset += bytesToRead;
+	}
+
+	// Loading a cluster may have stored the one cached before
+	if (map_close(map) == -1 || (bytesRead == 0 && count > 0)) {
+		free(map);
+		return -1;
+	}
+	free(map);
+	return bytesRead;
+}
+
+
+// Function to write every in-memory structure back to disk: the clusters cached for compressed
+// files, the root directory, the FAT and the tables. The structures stay in memory.
+int write_metadata(void){
+	// Cached clusters go first, storing them updates the FAT and the directories
+	for(int i = 0; i < numOf_entries; i++){
+		if(flush_file_cluster(i) == -1){
+			fs_print("Failed to store the cached cluster of a file.\n");
+			return -1;
+		}
+	}
+	return write_through();
+}
+
+// Function to write the blocks of the directories, the FAT and the tables that changed since
+// they were last written. Clusters cached for compressed files are left in their cache.
+int write_through(void){
+	// Write root directory information back to disk
+	if(write_rdir() == -1){
+		fs_print("Failed to write root directory to disk.\n");
+		return -1;
+	}
+
+	// Write FAT information back to disk
+	if(write_fat_blocks() == -1){
+		fs_print("Failed to write FAT to disk.\n");
+		return -1;
+	}
+
+	// Write the fingerprint, reference count and checksum tables back to disk
+	if(fprint != NULL && write_table(sblock.fprint_blockIndex, fprint, &fprintShadow) == -1){
+		fs_print("Failed to write fingerprint table to disk.\n");
+		return -1;
+	}
+	if(refcnt != NULL && write_table(sblock.refcnt_blockIndex, refcnt, &refcntShadow) == -1){
+		fs_print("Failed to write reference count table to disk.\n");
+		return -1;
+	}
+	if(csum != NULL && write_table(sblock.csum_blockIndex, csum, &csumShadow) == -1){
+		fs_print("Failed to write checksum table to disk.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Function to write every in-memory structure back and wait for the disk to store it. A failure
+// is remembered until fs_sync() reports it, since write-backs can happen in the background.
+int write_back(void){
+	if(write_metadata() == -1 || block_disk_sync() == -1){
+		syncError = 1;
+		return -1;
+	}
+	metaDirty = 0;
+	return 0;
+}
+
+// Function to release the file system lock at the end of a public function. With the "always"
+// sync policy, the metadata the function changed is written through to the disk first. Cached
+// clusters of compressed files stay cached until the file is closed, synced or unmounted.
+void fs_unlock(int *locked){
+	if(*locked && syncPolicy == FS_SYNC_ALWAYS && metaDirty && isMounted){
+		if(write_through() == -1){
+			syncError = 1;
+		} else {
+			metaDirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&fsLock);
+}
+
+// Take the file system lock until the end of the calling function
+#define fs_lock_scope() \
+	pthread_mutex_lock(&fsLock); \
+	int fsLocked __attribute__((cleanup(fs_unlock))) = 1
+
+// Function to compute the time @ms milliseconds from now, for pthread_cond_timedwait()
+void deadline_after(struct timespec *deadline, unsigned int ms){
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (ms % 1000) * 1000000L;
+	if(deadline->tv_nsec >= 1000000000L){
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+// Function run by the flusher thread of the "interval" sync policy
+void *flusher(void *arg){
+	unsigned int gen = (uintptr_t)arg;
+
+	pthread_mutex_lock(&fsLock);
+	while(flusherGen == gen){
+		struct timespec deadline;
+		deadline_after(&deadline, syncInterval);
+		pthread_cond_timedwait(&flusherCond, &fsLock, &deadline);
+
+		// The file system this thread was started for may be gone
+		if(flusherGen == gen && metaDirty){
+			write_back();
+		}
+	}
+	pthread_mutex_unlock(&fsLock);
+	return NULL;
+}
+
+// Function to read the sync policy from the FS_SYNC environment variable, if it is set. An
+// invalid value leaves the policy as it was.
+int parse_sync_env(void){
+	const char *env = getenv("FS_SYNC");
+	if(env == NULL){
+		return 0;
+	}
+	int policy;
+	unsigned long interval = syncInterval;
+	if(strcmp(env, "none") == 0){
+		policy = FS_SYNC_NONE;
+	} else if(strcmp(env, "always") == 0){
+		policy = FS_SYNC_ALWAYS;
+	} else if(strncmp(env, "interval", 8) == 0 && (env[8] == '\0' || env[8] == ':')){
+		policy = FS_SYNC_INTERVAL;
+		if(env[8] == ':'){
+			char *end;
+			interval = strtoul(env + 9, &end, 10);
+			if(end == env + 9 || *end != '\0' || interval == 0 || interval > UINT_MAX){
+				return -1;
+			}
+		}
+	} else {
+		return -1;
+	}
+	syncPolicy = policy;
+	syncInterval = interval;
+	return 0;
+}
+
+
+int fs_mount(const char *diskname)
+{
+	perf_scope(FS_MOUNT);
+	fs_lock_scope();
+
+	// Tracing can be turned on from the environment, without changing the application
+	if(getenv("FS_TRACE") != NULL && !trace_enabled){
+		trace_start();
+	}
+	if(getenv("FS_CAPTURE") != NULL && !capture_enabled){
+		capture_start(getenv("FS_CAPTURE"));
+	}
+	capture_call(MOUNT, -1, 0, 0, NULL, NULL);
+
+	// Check if a disk is already open
+    if(block_disk_count() != -1){
+        fs_print("A disk is already mounted.\n");
+        return -1;
+    }
+	
+	// Open the virtual disk file
+    if(block_disk_open(diskname) == -1){				// checking the condition
+		fs_print("Cannot open the disk.\n" );
+        return -1;
+    }
+    
+    // Load meta-data from the disk into memory
+
+	// Read the superblock, the FAT and the root directory in one go
+	if(dir_table_init() == -1 || read_metadata() == -1){
+		fs_print("Failed to read the metadata.\n");
+		goto fail;
+	}
+
+	// Keep a copy of the FAT as it is on disk, to only write back the blocks that change
+	fatShadow = malloc(sblock.numOf_fatBlocks * BLOCK_SIZE);
+	if(fatShadow == NULL){
+		goto fail;
+	}
+	memcpy(fatShadow, fat, sblock.numOf_fatBlocks * BLOCK_SIZE);
+	memcpy(rdirShadow, rdir, BLOCK_SIZE);
+
+	// A clean unmount leaves the free counts in the superblock. The flag is cleared for as long
+	// as the disk is mounted, so that a crash leaves it clear. fs_ref.x does not know about the
+	// flag, but whatever it changes in the FAT also changes the root directory.
+	if(sblock.clean == SB_CLEAN && sblock.rdir_csum == crc32c(rdir, BLOCK_SIZE)){
+		diskFreeBlocks = sblock.free_blocks;
+		diskFreeEntries = sblock.free_entries;
+	} else {
+		diskFreeBlocks = count_free_blocks();
+		diskFreeEntries = count_free_entries(rdir);
+	}
+	if(sblock.clean != 0){
+		sblock.clean = 0;
+		if(block_write(SUPERBLOCK_INDEX, &sblock) == -1){
+			fs_print("Failed to write the superblock.\n");
+			goto fail;
+		}
+	}
+
+	// Read the reference count table if files were ever cloned on this disk. The tables are read
+	// into buffers of their size, so their chains are checked against it first.
+	if (sblock.refcnt_blockIndex != 0) {
+		refcnt = malloc((sblock.numOf_dataBlocks + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+		if (refcnt == NULL || !table_chain_valid(sblock.refcnt_blockIndex, sizeof(uint8_t)) ||
+		    transfer_table(sblock.refcnt_blockIndex, refcnt, 0) == -1) {
+			fs_print("Failed to read reference count table.\n");
+			goto fail;
+		}
+	}
+
+	// Read the fingerprint table if dedup is enabled on this disk
+	if (sblock.fprint_blockIndex != 0 &&
+	    (!table_chain_valid(sblock.fprint_blockIndex, sizeof(uint32_t)) || load_fprint_table() == -1)) {
+		fs_print("Failed to read fingerprint table.\n");
+		goto fail;
+	}
+
+	// Read the checksum table if checksums are enabled on this disk
+	if (sblock.csum_blockIndex != 0) {
+		csum = malloc((sblock.numOf_dataBlocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+		if (csum == NULL || !table_chain_valid(sblock.csum_blockIndex, sizeof(uint32_t)) ||
+		    transfer_table(sblock.csum_blockIndex, csum, 0) == -1) {
+			fs_print("Failed to read checksum table.\n");
+			goto fail;
+		}
+	}
+
+	// Track the heat of data blocks if part of them sits on a fast tier
+	int fastDisk = block_disk_fast_count() - sblock.dataBlock_startIndex;
+	if (fastDisk > 0 && fastDisk < sblock.numOf_dataBlocks) {
+		heat = calloc(sblock.numOf_dataBlocks, sizeof(uint16_t));
+		fastBlocks = heat != NULL ? fastDisk : 0;
+		tierReads = 0;
+	}
+
+	// Subdirectories are kept in memory, like the root directory
+	load_directories();
+
+	// Start with an empty file descriptor table, it grows as files are opened
+	fd_reset();
+
+	// Start writing back in the background if the sync policy asks for it
+	if(parse_sync_env() == -1){
+		fs_print("Invalid FS_SYNC policy.\n");
+	}
+	metaDirty = 0;
+	syncError = 0;
+	if(syncPolicy == FS_SYNC_INTERVAL){
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, flusher, (void*)(uintptr_t)flusherGen) != 0){
+			fs_print("Failed to start the flusher thread.\n");
+			syncPolicy = FS_SYNC_ALWAYS;		// writing through is the safe fallback
+		} else {
+			pthread_detach(thread);
+		}
+	}
+
+	// Volumes in log mode are cleaned in the background
+	logHead = 0;
+	cleanerStarted = 0;
+	if((sblock.feature_flags & FEATURE_LOG) && start_cleaner() == -1){
+		fs_print("Failed to start the segment cleaner.\n");
+	}
+
+	isMounted = 1;	// Mark as mounted
+	trace_point(MOUNT, sblock.total_disk_blocks, 0, 0);
+
+	return 0; // success
+
+fail:
+	// Leave nothing of the failed mount behind, so that the disk can be mounted again
+	free_metadata();
+	block_disk_close();
+	return -1;
+}
+
+
+int fs_umount(void)
+{
+/**
+ * fs_umount - Unmount file system
+ *
+ * Unmount the currently mounted file system and close the underlying virtual
+ * disk file.
+ *
+ * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
+ * closed, or if there are still open file descriptors. 0 otherwise.
+ */
+
+	perf_scope(FS_UMOUNT);
+	fs_lock_scope();
+
+	// Check if no FS is currently mounted  // ??? block_disk_count? or block_disk_close?
+    if(block_disk_count() == -1) {
+        fs_print("No file system is currently mounted.\n");
+        return -1;
+    }
+
+	// Check if there are still open file descriptors
+    if (numOf_openFds > 0) {
+        fs_print("There are still open file descriptors.\n");
+        return -1;
+    }
+
+	// The flusher thread of this mount exits once it gets the lock back
+	flusherGen++;
+	pthread_cond_broadcast(&flusherCond);
+
+	// Write the root directory, FAT and tables back to disk
+	if(write_metadata() == -1){
+		return -1;
+	}
+
+	// Leave the free counts for the next mount
+	sblock.clean = SB_CLEAN;
+	sblock.free_blocks = diskFreeBlocks;
+	sblock.free_entries = diskFreeEntries;
+	sblock.rdir_csum = crc32c(rdir, BLOCK_SIZE);
+	if(block_write(SUPERBLOCK_INDEX, &sblock) == -1){
+		return -1;
+	}
+	if(syncPolicy == FS_SYNC_INTERVAL && block_disk_sync() == -1){
+		return -1;
+	}
+
+	// Free the tables, the FAT and the directories
+	free_metadata();
+	fd_reset();
+
+	// Close the underlying virtual disk
+	block_disk_close();
+
+	isMounted = 0;	// Mark as unmounted
+	trace_point(UMOUNT, 0, 0, 0);
+	capture_call(UMOUNT, -1, 0, 0, NULL, NULL);
+
+	// Save the trace and the capture requested from the environment
+	if(getenv("FS_TRACE") != NULL && trace_stop(getenv("FS_TRACE")) == -1){
+		return -1;
+	}
+	if(getenv("FS_CAPTURE") != NULL && capture_stop() == -1){
+		return -1;
+	}
+
+	return 0; // unmounted successful
+}
+
+
+int fs_info(void)
+{
+	perf_scope(FS_INFO);
+	fs_lock_scope();
+
+/* 
+ * Reference program output: 
+ * tkzin@COE-CS-pc1:~/p3/apps$ fs_ref.x info disk.fs
+ * FS Info:
+ * total_blk_count=4100
+ * fat_blk_count=2
+ * rdir_blk=3
+ * data_blk=4
+ * data_blk_count=4096
+ * fat_free_ratio=4095/4096
+ * rdir_free_ratio=128/128
+ */
+	// Check if no FS is currently mounted
+    if(isMounted == 0){
+        fs_print("No file system is currently mounted.\n");
+        return -1;
+    }
+
+
+    // The counts kept for the disk hold as long as nothing changed since the last write-back
+    int free_fat_count = metaDirty ? count_free_blocks() : diskFreeBlocks;
+    int free_root_dir_count = metaDirty ? count_free_entries(rdir) : diskFreeEntries;
+
+	// Print out the FS info: 
+    printf("FS Info:\n");
+    printf("total_blk_count=%d\n", sblock.total_disk_blocks);
+    printf("fat_blk_count=%d\n", sblock.numOf_fatBlocks);
+    printf("rdir_blk=%d\n", sblock.rootDir_blockIndex);
+    printf("data_blk=%d\n", sblock.dataBlock_startIndex);
+    printf("data_blk_count=%d\n", sblock.numOf_dataBlocks);
+    printf("fat_free_ratio=%d/%d\n", free_fat_count, sblock.numOf_dataBlocks);
+    printf("rdir_free_ratio=%d/%d\n", free_root_dir_count, FS_FILE_MAX_COUNT);
+
+	return 0; // success
+}
+
+/* TODO: Phase 2 */
+int fs_create(const char *filename)
+{
+/**
+ * fs_create - Create a new file
+ * @filename: File name
+ *
+ * Create a new and empty file named @filename in the root directory of the
+ * mounted file system. String @filename must be NULL-terminated and its total
+ * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
+ * character).
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
+ * file named @filename already exists, or if string @filename is too long, or
+ * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ */
+
+	perf_scope(FS_CREATE);
+	fs_lock_scope();
+	metaDirty = 1;
+	capture_call(CREATE, -1, 0, 0, filename, NULL);
+
+	// Check if no FS is currently mounted
+    if(isMounted == 0){
+        fs_print("No FS currently mounted.\n");
+        return -1;
+    }
+
+	// Check if the filename valid, and find the directory it names a file in
+	const char *name;
+	int dir = filename == NULL ? -1 : path_parent(filename, &name);
+	if(dir == -1){
+		return -1;
+	}
+
+	// Check if a file with the same name already exists
+	if(dir_lookup(dir, name) != -1){
+		fs_print("File with the same name already exists.\n");
+		return -1;
+	}
+
+	// Check if the directory has room for the file. The root directory holds at most
+	// FS_FILE_MAX_COUNT files, subdirectories grow when the block of the name is full.
+	int remptyIndex = dir_insert(dir, name);
+	if(remptyIndex == -1){	// -1 means no empty entry, the directory is full.
+		return -1;
+	}
+
+	// Now, create a new empty file with a given parameter @filename 
+	// at the free index we just found in its directory
+	strncpy(rdir[remptyIndex].file_name, name, FS_FILENAME_LEN);		// get the filename
+	rdir[remptyIndex].file_size = 0; 									// set the file size to zero
+	rdir[remptyIndex].firstDataBlock_index = FAT_EOC;					// set first data block to end of chain
+	rdir[remptyIndex].file_flags = 0;									// new files start as a plain FAT chain
+	if(sblock.feature_flags & FEATURE_COMPRESS){						// unless they are to be compressed
+		rdir[remptyIndex].file_flags = FILE_MAPPED | FILE_COMPRESSED;
+	}
+
+	trace_point(CREATE, remptyIndex, 0, 0);
+	return 0; // fs_create success
+
+}
+
+int fs_delete(const char *filename)
+{
+/**
+ * fs_delete - Delete a file
+ * @filename: File name
+ *
+ * Delete the file named @filename from the root directory of the mounted file
+ * system.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * Return: -1 if @filename is invalid, if there is no file named @filename to
+ * delete, or if file @filename is currently open. 0 otherwise.
+ */
+
+	perf_scope(FS_DELETE);
+	fs_lock_scope();
+	metaDirty = 1;
+	capture_call(DELETE, -1, 0, 0, filename, NULL);
+
+	// Check if no FS is currently mounted
+    if(isMounted == 0){
+        fs_print("No FS currently mounted.\n");
+        return -1;
+    }
+
+	// Check if the filename is valid
+	if(filename == NULL){
+		fs_print("Invalid filename.\n");
+		return -1;
+	}
+
+	// Check if the given parameter @filename exists to delete?
+	int found = path_lookup(filename);
+	// if the filename is not found, return -1.
+	if(found == -1){	
+		fs_print("Filename does not exist.\n");
+		return -1;	
+	}
+
+	// Directories are removed with fs_rmdir()
+	if(rdir[found].file_flags & FILE_DIRECTORY){
+		fs_print("Is a directory.\n");
+		return -1;
+	}
+
+	// Check if the file is already open
+	if(openCount[found] > 0){
+		fs_print("File is currently open.\n");
+		return -1;
+	}
+
+	trace_point(DELETE, found, 0, 0);
+
+	// Delete the file's data blocks used by the file (and its block map if it is mapped).
+	// This has to happen before the entry is emptied, since the entry tells where they are.
+	free_file_blocks(found);
+
+	// Once the blocks are released, empty the file's entry in its directory
+	memset(&rdir[found], 0, sizeof(struct rootDirEntry));
+	pathCacheGen++;
+
+	return 0;
+}
+
+int fs_ls(void)
+{
+/**
+ * fs_ls - List files on file system
+ *
+ * List information about the files located in the root directory.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+
+	perf_scope(FS_LS);
+	fs_lock_scope();
+
+	// Check if no FS is currently mounted
+    if(isMounted == 0){
+        fprintf(stderr, "No FS currently mounted.\n");
+        return -1;
+    }
+
+	// Display the lists of all the files in the file system.
+	printf("FS Ls:\n");
+
+	// Iterate over the entries in the root directory
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		// If the filename is not empty, print out
+		if(rdir[i].file_name[0] != '\0'){
+			printf("file: %s, size: %d, data_blk: %d\n", 
+			rdir[i].file_name, rdir[i].file_size, rdir[i].firstDataBlock_index);
+
+		}
+	}
+	return 0;
+}
+
+int fs_readdir(const char *dirname, size_t *cookie, struct fsDirEntry *entries, size_t count)
+{
+	perf_scope(FS_READDIR);
+	fs_lock_scope();
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+	if(cookie == NULL || entries == NULL){
+		return -1;
+	}
+	int dir = path_dir(dirname == NULL ? "" : dirname);
+	if(dir == -1){
+		fs_print("Directory does not exist.\n");
+		return -1;
+	}
+
+	// Buffers for the block maps of mapped and compressed files
+	uint16_t *index = malloc(BLOCK_SIZE);
+	uint16_t *mapEntries = malloc(BLOCK_SIZE);
+	if(index == NULL || mapEntries == NULL){
+		free(index);
+		free(mapEntries);
+		return -1;
+	}
+
+	// The cookie is the entry of the directory to go on from, counting the entries of
+	// its blocks one after the other
+	size_t filled = 0;
+	size_t i = *cookie;
+	for(; i < (size_t)dirs[dir].numOf_buckets * DIR_ENTRIES && filled < count; i++){
+		int r = dirs[dir].pages[i / DIR_ENTRIES] * DIR_ENTRIES + i % DIR_ENTRIES;
+		if(rdir[r].file_name[0] == '\0'){
+			continue;
+		}
+		memcpy(entries[filled].name, rdir[r].file_name, FS_FILENAME_LEN);
+		entries[filled].name[FS_FILENAME_LEN - 1] = '\0';
+		entries[filled].size = rdir[r].file_size;
+		entries[filled].first_block = rdir[r].firstDataBlock_index;
+		entries[filled].blocks = count_file_blocks(r, index, mapEntries);
+		entries[filled].directory = (rdir[r].file_flags & FILE_DIRECTORY) != 0;
+		filled++;
+	}
+	*cookie = i;
+
+	free(index);
+	free(mapEntries);
+	return filled;
+}
+
+int fs_mkdir(const char *dirname)
+{
+	perf_scope(FS_MKDIR);
+	fs_lock_scope();
+	metaDirty = 1;
+	capture_call(MKDIR, -1, 0, 0, dirname, NULL);
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	// Check if the name is valid, and find the directory it names a directory in
+	const char *name;
+	int parent = dirname == NULL ? -1 : path_parent(dirname, &name);
+	if(parent == -1){
+		fs_print("Invalid filename.\n");
+		return -1;
+	}
+	if(dir_lookup(parent, name) != -1){
+		fs_print("File with the same name already exists.\n");
+		return -1;
+	}
+	int rIndex = dir_insert(parent, name);
+	if(rIndex == -1){
+		return -1;
+	}
+
+	// A new directory is a single block of empty entries
+	int *bucketPages = malloc(sizeof(int));
+	int first = bucketPages == NULL ? -1 : allocate_chain(1);
+	if(first == -1){
+		free(bucketPages);
+		return -1;
+	}
+	bucketPages[0] = -1;
+	int dir = dir_alloc(rIndex, bucketPages, 1);
+	if(dir == -1){
+		free(bucketPages);
+		free_chain(first);
+		return -1;
+	}
+	bucketPages[0] = page_alloc(dir, first);
+	if(bucketPages[0] == -1){
+		dir_free(dir);
+		free_chain(first);
+		return -1;
+	}
+
+	strncpy(rdir[rIndex].file_name, name, FS_FILENAME_LEN);
+	rdir[rIndex].file_size = BLOCK_SIZE;
+	rdir[rIndex].firstDataBlock_index = first;
+	rdir[rIndex].file_flags = FILE_DIRECTORY;
+	return 0;
+}
+
+int fs_rmdir(const char *dirname)
+{
+	perf_scope(FS_RMDIR);
+	fs_lock_scope();
+	metaDirty = 1;
+	capture_call(RMDIR, -1, 0, 0, dirname, NULL);
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	int rIndex = dirname == NULL ? -1 : path_lookup(dirname);
+	if(rIndex == -1 || !(rdir[rIndex].file_flags & FILE_DIRECTORY) || entryDir[rIndex] == 0){
+		fs_print("Directory does not exist.\n");
+		return -1;
+	}
+
+	// Only empty directories can be removed
+	int dir = entryDir[rIndex];
+	for(int b = 0; b < dirs[dir].numOf_buckets; b++){
+		if(count_free_entries(&rdir[dirs[dir].pages[b] * DIR_ENTRIES]) != DIR_ENTRIES){
+			fs_print("Directory is not empty.\n");
+			return -1;
+		}
+	}
+
+	dir_free(dir);
+	free_chain(rdir[rIndex].firstDataBlock_index);
+	memset(&rdir[rIndex], 0, sizeof(struct rootDirEntry));
+	pathCacheGen++;
+	return 0;
+}
+
+/* TODO: Phase 3 */
+int fs_open(const char *filename)
+{
 /**
- * fs_ls - List files on file system
+ * fs_open - Open a file
+ * @filename: File name
  *
- * List information about the files located in the root directory.
+ * Open file named @filename for reading and writing, and return the
+ * corresponding file descriptor. The file descriptor is a non-negative integer
+ * that is used subsequently to access the contents of the file. The file offset
+ * of the file descriptor is set to 0 initially (beginning of the file). If the
+ * same file is opened multiple files, fs_open() must return distinct file
+ * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
+ * simultaneously.
  *
- * Return: -1 if no FS is currently mounted. 0 otherwise.
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename to open, or if there are already
+ * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
+ * descriptor.
+ */	
+
+	perf_scope(FS_OPEN);
+	fs_lock_scope();
+
+	// Check if no FS is currently mounted
+    if(isMounted == 0){
+        fs_print("No FS currently mounted.\n");
+        return -1;
+    }
+
+	// Check if the filename is valid
+	if(filename == NULL){
+		fs_print("Invalid filename.\n");
+		return -1;
+	}
+
+	// Check if the given input @filename exists
+	int found = path_lookup(filename);
+	// If the filename is not found, return -1.
+	if(found == -1){	
+		fs_print("Filename does not exist.\n");
+		return -1;	
+	}
+
+	// Directories cannot be read or written as files
+	if(rdir[found].file_flags & FILE_DIRECTORY){
+		fs_print("Is a directory.\n");
+		return -1;
+	}
+
+	// Take a free descriptor, unless there are already FS_OPEN_MAX_COUNT files currently open
+	int loc = fd_alloc();
+	if(loc == -1){
+		fs_print("Maximum open file limit reached.\n");
+		return -1;
+	}
+
+	// Initialize the file descriptor's values at the available location
+	struct fileDescriptor *file = &fdChunks[loc / FD_CHUNK]->fds[loc % FD_CHUNK];
+	file->fdOffset = 0;
+	file->fdIndex = loc;		
+	file->rIndex = found;	// assign it to the file Index that matches with the input filename in rd.
+	openCount[found]++;
+	numOf_openFds++;
+	trace_point(OPEN, loc, found, 0);
+	capture_call(OPEN, loc, 0, 0, filename, NULL);
+
+
+	return file->fdIndex;	// return open fd 
+}
+
+/* TODO: Phase 3 */
+int fs_close(int fd)
+{
+/**
+ * fs_close - Close a file
+ * @fd: File descriptor
+ *
+ * Close file descriptor @fd.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open). 0 otherwise.
+ */
+
+	perf_scope(FS_CLOSE);
+	fs_lock_scope();
+	capture_call(CLOSE, fd, 0, 0, NULL, NULL);
+
+	// Check if no FS is currently mounted
+    if(isMounted == 0){
+        fs_print("No FS currently mounted.\n");
+        return -1;
+    }
+
+	// Check if @fd is valid (out of bounds or not currently open)
+	// if @fd is non-negative integer, invalid.
+	// if @fd exceeds maximum open count, invalid.
+	// if @fd is -1, it means unused or closed.
+	struct fileDescriptor *file = fd_lookup(fd);
+	if(file == NULL){
+		return -1;
+	}
+
+	trace_point(CLOSE, fd, 0, 0);
+
+	// Store the cluster a compressed file still holds in its cache. Closing a file changes
+	// nothing on disk otherwise.
+	int rootIndex = file->rIndex;
+	if(ccache[rootIndex] != NULL && ccache[rootIndex]->dirty){
+		metaDirty = 1;
+	}
+	int ret = flush_file_cluster(rootIndex);
+
+	// Close the file descriptor by setting to -1 and offset to 0
+	file->fdIndex = -1;
+	file->rIndex = -1;
+	file->fdOffset = 0;
+	fd_free(fd);
+	openCount[rootIndex]--;
+	numOf_openFds--;
+
+	// The cache goes away with the last file descriptor of the file
+	if(openCount[rootIndex] == 0 && ccache[rootIndex] != NULL){
+		reservedBlocks -= ccache[rootIndex]->reserved;	// only set if the cluster could not be stored
+		free(ccache[rootIndex]);
+		ccache[rootIndex] = NULL;
+	}
+			
+	return ret;	// success, unless buffered data could not be stored
+}
+
+/* TODO: Phase 3 */
+int fs_stat(int fd)
+{
+/**
+ * fs_stat - Get file status
+ * @fd: File descriptor
+ *
+ * Get the current size of the file pointed by file descriptor @fd.
+ *
+ * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
+ * invalid (out of bounds or not currently open). Otherwise return the current
+ * size of file.
+ */
+
+	perf_scope(FS_STAT);
+	fs_lock_scope();
+	capture_call(STAT, fd, 0, 0, NULL, NULL);
+
+	// Check if no FS is currently mounted
+    if(isMounted == 0){
+        fs_print("No FS currently mounted.\n");
+        return -1;
+    }
+
+	// Check if @fd is valid (out of bounds or not currently open)
+	// if @fd is non-negative integer, invalid.
+	// if @fd exceeds maximum open count, invalid.
+	// if @fd is -1, it means unused or closed.
+	struct fileDescriptor *file = fd_lookup(fd);
+	if(file == NULL){
+		return -1;
+	}
+
+	// Get the index in the root directory to access the file size
+	int rootIndex = file->rIndex;
+
+	// Return the file size from the corresponding root directory entry
+	return rdir[rootIndex].file_size;
+}
+
+/* TODO: Phase 3 */
+int fs_lseek(int fd, size_t offset)
+{
+/**
+ * fs_lseek - Set file offset
+ * @fd: File descriptor
+ * @offset: File offset
+ *
+ * Set the file offset (used for read and write operations) associated with file
+ * descriptor @fd to the argument @offset. To append to a file, one can call
+ * fs_lseek(fd, fs_stat(fd));
+ *
+ * Seeking past the end of the file is allowed: a following write leaves a
+ * hole between the old end of the file and @offset, which reads back as zeros.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (i.e., out of bounds, or not currently open), or if @offset is
+ * larger than the maximum file size. 0 otherwise.
+ */
+
+	perf_scope(FS_LSEEK);
+	fs_lock_scope();
+	capture_call(LSEEK, fd, offset, 0, NULL, NULL);
+
+	// Check if FS is currently mounted
+	if(isMounted == 0){
+        fs_print("No FS currently mounted.\n");
+        return -1;
+    }
+
+	// Check if @fd is valid (out of bounds, or not currently open)
+	struct fileDescriptor *file = fd_lookup(fd);
+	if(file == NULL){
+		return -1;
+	}
+
+	// Offsets past the end of the file are fine, they create a hole on the next write
+	if(offset > UINT32_MAX){
+		return -1;
+	}
+
+	// Update the offset in the file descriptor
+	file->fdOffset = offset;
+
+    return 0;
+}
+
+/* TODO: Phase 4 */
+int fs_write(int fd, void *buf, size_t count)
+{
+/**
+ * fs_write - Write to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Attempt to write @count bytes of data from buffer pointer by @buf into the
+ * file referenced by file descriptor @fd. It is assumed that @buf holds at
+ * least @count bytes.
+ *
+ * When the function attempts to write past the end of the file, the file is
+ * automatically extended to hold the additional bytes. If the underlying disk
+ * runs out of space while performing a write operation, fs_write() should write
+ * as many bytes as possible. The number of written bytes can therefore be
+ * smaller than @count (it can even be 0 if there is no more space on disk).
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually written.
  */
 
+	perf_scope(FS_WRITE);
+	fs_lock_scope();
+	metaDirty = 1;
+
+	// Check if FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return 0;
+	}
+
+	// Check if file descriptor is valid or out of bounds or not currently open
+	struct fileDescriptor *file = fd_lookup(fd);
+	if(file == NULL){
+		fs_print("Invalid file descriptor.\n");
+		return -1;
+	}
+	capture_call(WRITE, fd, count, file->fdOffset, NULL, NULL);
+
+	// Check if the buffer is NULL
+	if(buf == NULL){
+		fs_print("Buffer is NULL.\n");
+		return 0;
+	}
+
+	size_t current_offset = file->fdOffset;
+	int rootIndex = file->rIndex;
+	size_t fileSize = rdir[rootIndex].file_size;
+
+	trace_point(WRITE, fd, current_offset, count);
+
+	// Files cannot grow past what their size field can hold
+	count = min(count, UINT32_MAX - current_offset);
+	if (count == 0) {
+		return 0;	// nothing to write, and nothing to allocate
+	}
+
+	// Writing past the last block of a FAT chain file would need zero-filled blocks in
+	// between: turn the file into a mapped file instead, so the skipped range stays a hole.
+	// In dedup mode, files are always mapped so that their blocks can be shared.
+	size_t numOf_blocks = (fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (!(rdir[rootIndex].file_flags & FILE_MAPPED) &&
+	    (current_offset / BLOCK_SIZE > numOf_blocks || fprint != NULL)) {
+		if (rdir[rootIndex].firstDataBlock_index == FAT_EOC) {
+			rdir[rootIndex].file_flags |= FILE_MAPPED;
+		} else if (convert_to_mapped(rootIndex) == -1) {
+			return 0;	// no space left for the block map
+		}
+	}
+
+	void *bBuf = malloc(BLOCK_SIZE);
+	if (bBuf == NULL) {
+		return -1;
+	}
+
+	int bytesWritten;
+	if (rdir[rootIndex].file_flags & FILE_COMPRESSED) {
+		bytesWritten = write_compressed(rootIndex, current_offset, buf, count);
+	} else if (rdir[rootIndex].file_flags & FILE_MAPPED) {
+		bytesWritten = write_mapped(rootIndex, current_offset, buf, count, bBuf);
+	} else {
+		bytesWritten = write_chain(rootIndex, current_offset, buf, count, bBuf);
+	}
+	free(bBuf);
+
+	if (bytesWritten == -1) {
+		return -1;
+	}
+
+	// Advance the offset and extend the file if the write went past its end
+	file->fdOffset = current_offset + bytesWritten;
+	if (file->fdOffset > fileSize) {
+		rdir[rootIndex].file_size = file->fdOffset;
+	}
+
+	trace_point(WRITE_DONE, fd, bytesWritten, 0);
+	perf_bytes(PERF_FS_WRITE, bytesWritten);
+	return bytesWritten;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	perf_scope(FS_READ);
+	fs_lock_scope();
+
+    // Check if FS is currently mounted
+    if(isMounted == 0){
+        fs_print("No FS currently mounted.\n");
+        return 0;
+    }
+
+    // Check if file descriptor is valid or out of bounds or not currently open
+    struct fileDescriptor *file = fd_lookup(fd);
+    if(file == NULL){
+        fs_print("Invalid file descriptor.\n");
+        return -1;
+    }
+    capture_call(READ, fd, count, file->fdOffset, NULL, NULL);
+
+    // Check if the buffer is NULL
+    if(buf == NULL){
+        fs_print("Buffer is NULL.\n");
+        return 0;
+    }
+
+    // Retrieve the file descriptor's current offset
+    size_t current_offset = file->fdOffset;
+    int rootIndex = file->rIndex;
+    size_t fileSize = rdir[rootIndex].file_size;
+
+    trace_point(READ, fd, current_offset, count);
+
+    // Never read past the end of the file
+    if (current_offset >= fileSize) {
+        return 0;
+    }
+    count = min(count, fileSize - current_offset);
+
+    // Allocate the bounce buffer
+    void *bBuf = malloc(BLOCK_SIZE);
+    if (bBuf == NULL) {
+        return -1; // Failed to allocate memory
+    }
+
+    int bytesRead;
+    if (rdir[rootIndex].file_flags & FILE_COMPRESSED) {
+        bytesRead = read_compressed(rootIndex, current_offset, buf, count);
+    } else if (rdir[rootIndex].file_flags & FILE_MAPPED) {
+        bytesRead = read_mapped(rootIndex, current_offset, buf, count, bBuf);
+    } else {
+        bytesRead = read_chain(rootIndex, current_offset, buf, count, bBuf);
+    }
+
+    // Cleanup: Free the bounce buffer
+    free(bBuf);
+
+    if (bytesRead == -1) {
+        return -1; // Error reading block from disk
+    }
+
+    // The offset moves past what was read
+    file->fdOffset = current_offset + bytesRead;
+
+    // Every so often, what became hot moves to the fast tier
+    if (heat != NULL && tierReads >= TIER_PERIOD) {
+        metaDirty = 1;
+        if (tier_rebalance(TIER_BUDGET) == -1) {
+            fs_print("Tiering pass failed.\n");
+        }
+    }
+
+    trace_point(READ_DONE, fd, bytesRead, 0);
+    perf_bytes(PERF_FS_READ, bytesRead);
+    // Return the total number of bytes read into the buffer
+    return bytesRead;
+}
+
+/* Online defragmentation */
+
+// Per-file fragmentation summary, used to rank the files to relocate
+struct fragInfo {
+	int rIndex;				// index of the file in root directory
+	int numOf_blocks;		// number of data blocks in the file's FAT chain
+	int numOf_extents;		// number of contiguous runs of data blocks in the chain
+};
+
+// Function to walk the FAT chain of a file and count its blocks and contiguous runs.
+// Returns -1 if the chain is longer than the data region (a broken or looping chain).
+int measure_fragmentation(int rIndex, struct fragInfo *info){
+	info->rIndex = rIndex;
+	info->numOf_blocks = 0;
+	info->numOf_extents = 0;
+
+	int current = rdir[rIndex].firstDataBlock_index;
+	int previous = -1;
+	while (current != FAT_EOC) {
+		if (current >= sblock.numOf_dataBlocks || info->numOf_blocks >= sblock.numOf_dataBlocks) {
+			return -1;
+		}
+		// A new run starts whenever the next block is not physically adjacent
+		if (current != previous + 1) {
+			info->numOf_extents++;
+		}
+		info->numOf_blocks++;
+		previous = current;
+		current = fat[current].content;
+	}
+	return 0;
+}
+
+// Function to find the first run of @length consecutive free data blocks (first-fit).
+// Returns the index of the first block of the run, or -1 if there is no such run.
+int find_free_run(int length){
+	return fat_find_free_run(fat, sblock.numOf_dataBlocks, length);
+}
+
+// Function to count the blocks relocate_file() writes to move a file into the free run starting
+// at @newStart: its data blocks, the FAT blocks of the new run and then of the old chain, and
+// the directory block of the file
+int relocation_cost(const struct fragInfo *info, int newStart){
+	const int perBlock = BLOCK_SIZE / sizeof(struct fatEntry);
+	uint8_t touched[UINT8_MAX] = {0};
+	int numOf_fatBlocks = (newStart + info->numOf_blocks - 1) / perBlock - newStart / perBlock + 1;
+	int current = rdir[info->rIndex].firstDataBlock_index;
+	for (int i = 0; i < info->numOf_blocks; i++) {
+		if (!touched[current / perBlock]) {
+			touched[current / perBlock] = 1;
+			numOf_fatBlocks++;
+		}
+		current = fat[current].content;
+	}
+	return info->numOf_blocks + numOf_fatBlocks + 1;
+}
+
+// Function to move the data blocks of a file into the free run starting at @newStart.
+// The data is copied first, then the new chain is written to the FAT, then the directory
+// entry is switched over with a single block write, and only then the old chain is freed.
+// A crash at any point leaves either the old or the new chain referenced, never both.
+int relocate_file(struct fragInfo *info, int newStart, void *bBuf){
+	int numOf_blocks = info->numOf_blocks;
+	uint16_t *oldChain = malloc(numOf_blocks * sizeof(uint16_t));
+	if (oldChain == NULL) {
+		return -1;
+	}
+
+	// Copy every block of the file into the new contiguous run
+	int current = rdir[info->rIndex].firstDataBlock_index;
+	for (int i = 0; i < numOf_blocks; i++) {
+		oldChain[i] = current;
+		if (data_block_read(current, bBuf) == -1 ||
+		    data_block_write(newStart + i, bBuf) == -1) {
+			free(oldChain);
+			return -1;
+		}
+		current = fat[current].content;
+	}
+
+	// Link the new run together and persist it while the old chain is still in use
+	for (int i = 0; i < numOf_blocks; i++) {
+		fat[newStart + i].content = (i == numOf_blocks - 1) ? FAT_EOC : newStart + i + 1;
+	}
+	if (write_fat_blocks() == -1) {
+		for (int i = 0; i < numOf_blocks; i++) {
+			fat[newStart + i].content = FAT_FREE;
+		}
+		free(oldChain);
+		return -1;
+	}
+
+	// Commit: point the directory entry at the new chain
+	rdir[info->rIndex].firstDataBlock_index = newStart;
+	if (write_rdir() == -1) {
+		rdir[info->rIndex].firstDataBlock_index = oldChain[0];
+		for (int i = 0; i < numOf_blocks; i++) {
+			fat[newStart + i].content = FAT_FREE;
+		}
+		free(oldChain);
+		return -1;
+	}
+
+	// Release the old chain
+	for (int i = 0; i < numOf_blocks; i++) {
+		fat[oldChain[i]].content = FAT_FREE;
+	}
+	free(oldChain);
+
+	return write_fat_blocks();
+}
+
+// Comparison function for qsort(): most fragmented files first
+int compare_fragmentation(const void *a, const void *b){
+	const struct fragInfo *fa = a;
+	const struct fragInfo *fb = b;
+	if (fa->numOf_extents != fb->numOf_extents) {
+		return fb->numOf_extents - fa->numOf_extents;
+	}
+	return fa->numOf_blocks - fb->numOf_blocks;
+}
+
+int fs_defrag_info(void)
+{
+	perf_scope(FS_DEFRAG_INFO);
+	fs_lock_scope();
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	int numOf_files = 0;
+	int numOf_fragmented = 0;
+
+	printf("FS Defrag:\n");
+	for (int i = 0; i < numOf_entries; i++) {
+		if (rdir[i].file_name[0] == '\0' || (rdir[i].file_flags & FILE_DIRECTORY)) {
+			continue;
+		}
+
+		// Mapped files are not made of a FAT chain and are left alone by fs_defrag()
+		if (rdir[i].file_flags & FILE_MAPPED) {
+			printf("file: %s, mapped\n", rdir[i].file_name);
+			continue;
+		}
+
+		struct fragInfo info;
+		if (measure_fragmentation(i, &info) == -1) {
+			printf("file: %s, broken FAT chain\n", rdir[i].file_name);
+			continue;
+		}
+		printf("file: %s, blocks: %d, extents: %d\n",
+		       rdir[i].file_name, info.numOf_blocks, info.numOf_extents);
+
+		numOf_files++;
+		if (info.numOf_extents > 1) {
+			numOf_fragmented++;
+		}
+	}
+	printf("fragmented_ratio=%d/%d\n", numOf_fragmented, numOf_files);
+
+	return 0;
+}
+
+int fs_defrag(size_t io_budget)
+{
+	perf_scope(FS_DEFRAG);
+	fs_lock_scope();
+	metaDirty = 1;
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	// Collect every fragmented file along with its fragmentation. Directory blocks stay
+	// where they are, the directory table points at them.
+	struct fragInfo *candidates = malloc(numOf_entries * sizeof(struct fragInfo));
+	if (candidates == NULL) {
+		return -1;
+	}
+	int numOf_candidates = 0;
+	for (int i = 0; i < numOf_entries; i++) {
+		if (rdir[i].file_name[0] == '\0' || (rdir[i].file_flags & (FILE_MAPPED | FILE_DIRECTORY))) {
+			continue;
+		}
+		struct fragInfo info;
+		if (measure_fragmentation(i, &info) == 0 && info.numOf_extents > 1) {
+			candidates[numOf_candidates++] = info;
+		}
+	}
+	qsort(candidates, numOf_candidates, sizeof(struct fragInfo), compare_fragmentation);
+
+	void *bBuf = malloc(BLOCK_SIZE);
+	if (bBuf == NULL) {
+		free(candidates);
+		return -1;
+	}
+
+	// Relocate the most fragmented files first, as long as the budget allows
+	size_t relocated = 0;
+	size_t written = 0;
+	for (int i = 0; i < numOf_candidates; i++) {
+		size_t numOf_blocks = candidates[i].numOf_blocks;
+		int newStart = find_free_run(numOf_blocks);
+		if (newStart == -1) {
+			continue;	// no contiguous free run large enough for this file
+		}
+
+		size_t cost = relocation_cost(&candidates[i], newStart);
+		if (io_budget != 0 && written + cost > io_budget) {
+			continue;	// does not fit in what is left of the budget, try a smaller file
+		}
+
+		if (relocate_file(&candidates[i], newStart, bBuf) == -1) {
+			fs_print("Failed to relocate file.\n");
+			free(bBuf);
+			free(candidates);
+			return -1;
+		}
+		relocated += numOf_blocks;
+		written += cost;
+	}
+
+	free(bBuf);
+	free(candidates);
+
+	return relocated;
+}
+
+/* File descriptor table */
+
+// Function to find the open file descriptor @fd. Returns NULL if @fd is out of bounds or not open.
+struct fileDescriptor *fd_lookup(int fd){
+	if (fd < 0 || fd >= numOf_fdChunks * FD_CHUNK) {
+		return NULL;
+	}
+	struct fileDescriptor *file = &fdChunks[fd / FD_CHUNK]->fds[fd % FD_CHUNK];
+	return file->fdIndex == -1 ? NULL : file;
+}
+
+// Function to add a chunk of descriptors to the table, all of them on the free list.
+// Returns -1 if the table cannot grow any further.
+int fd_grow(void){
+	struct fdChunk *chunk = numOf_fdChunks < FD_CHUNKS ? malloc(sizeof(struct fdChunk)) : NULL;
+	if (chunk == NULL) {
+		return -1;
+	}
+	int first = numOf_fdChunks * FD_CHUNK;
+	for (int i = 0; i < FD_CHUNK; i++) {
+		chunk->fds[i].fdIndex = -1;		// Mark all file descriptors as unused
+		chunk->fds[i].rIndex = -1;
+		chunk->fds[i].fdOffset = 0;
+		chunk->nextFree[i] = i + 1 < FD_CHUNK ? first + i + 1 : fdFreeHead;
+	}
+	fdChunks[numOf_fdChunks++] = chunk;
+	fdFreeHead = first;
+	return 0;
+}
+
+// Function to take a descriptor off the free list, growing the table if the list is empty.
+// Like everything else, the table is protected by the file system lock: threads opening and
+// closing files take turns, but neither a scan nor a memory allocation happens in the common
+// case. Returns -1 if %FS_OPEN_MAX_COUNT files are already open.
+int fd_alloc(void){
+	if (fdFreeHead == -1 && fd_grow() == -1) {
+		return -1;
+	}
+	int fd = fdFreeHead;
+	fdFreeHead = fdChunks[fd / FD_CHUNK]->nextFree[fd % FD_CHUNK];
+	return fd;
+}
+
+// Function to put descriptor @fd back on the free list
+void fd_free(int fd){
+	fdChunks[fd / FD_CHUNK]->nextFree[fd % FD_CHUNK] = fdFreeHead;
+	fdFreeHead = fd;
+}
+
+// Function to drop the whole file descriptor table, once no file is open
+void fd_reset(void){
+	for (int i = 0; i < numOf_fdChunks; i++) {
+		free(fdChunks[i]);
+		fdChunks[i] = NULL;
+	}
+	numOf_fdChunks = 0;
+	fdFreeHead = -1;
+	numOf_openFds = 0;
+}
+
+
+/* Directories */
+
+// Function to hash at most @maxLen characters of string @s (FNV-1a)
+uint32_t string_hash(const char *s, size_t maxLen){
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < maxLen && s[i] != '\0'; i++) {
+		h = (h ^ (uint8_t)s[i]) * 16777619u;
+	}
+	return h;
+}
+
+// Function to find the block of entries of directory @dir that name @name belongs in
+struct rootDirEntry *dir_bucket(int dir, const char *name){
+	struct dirInfo *d = &dirs[dir];
+	return &rdir[d->pages[string_hash(name, FS_FILENAME_LEN) % d->numOf_buckets] * DIR_ENTRIES];
+}
+
+// Function to resize a table with one element per page or entry of the directory table,
+// zeroing the elements that are added
+int resize_table(void **table, size_t elemSize, size_t oldCount, size_t newCount){
+	void *grown = realloc(*table, newCount * elemSize);
+	if (grown == NULL) {
+		return -1;
+	}
+	memset((char*)grown + oldCount * elemSize, 0, (newCount - oldCount) * elemSize);
+	*table = grown;
+	return 0;
+}
+
+// Function to take a free page of the directory table for the block @block of directory @dir,
+// doubling the table if every page is used. The entries of the page start out empty.
+// Returns the page, or -1 if out of memory.
+int page_alloc(int dir, int block){
+	int p = 1;
+	while (p < numOf_pages && pages[p].dir != -1) {
+		p++;
+	}
+	if (p == numOf_pages) {
+		int newPages = numOf_pages * 2;
+		size_t oldEntries = (size_t)numOf_pages * DIR_ENTRIES;
+		size_t newEntries = (size_t)newPages * DIR_ENTRIES;
+		if (resize_table((void**)&rdir, sizeof(struct rootDirEntry), oldEntries, newEntries) == -1 ||
+		    resize_table((void**)&rdirShadow, sizeof(struct rootDirEntry), oldEntries, newEntries) == -1 ||
+		    resize_table((void**)&openCount, sizeof(int), oldEntries, newEntries) == -1 ||
+		    resize_table((void**)&ccache, sizeof(struct clusterCache *), oldEntries, newEntries) == -1 ||
+		    resize_table((void**)&entryDir, sizeof(int), oldEntries, newEntries) == -1 ||
+		    resize_table((void**)&pages, sizeof(struct dirPage), numOf_pages, newPages) == -1) {
+			return -1;
+		}
+		for (int i = numOf_pages; i < newPages; i++) {
+			pages[i].dir = -1;
+		}
+		numOf_pages = newPages;
+		numOf_entries = newEntries;
+	}
+	pages[p].dir = dir;
+	pages[p].block = block;
+	pages[p].written = 0;
+	memset(&rdir[p * DIR_ENTRIES], 0, BLOCK_SIZE);
+	memset(&rdirShadow[p * DIR_ENTRIES], 0, BLOCK_SIZE);
+	return p;
+}
+
+// Function to give page @p of the directory table back
+void page_free(int p){
+	pages[p].dir = -1;
+	memset(&rdir[p * DIR_ENTRIES], 0, BLOCK_SIZE);
+}
+
+// Function to take a free slot of @dirs for the subdirectory of entry @rIndex, whose buckets
+// are held by the pages in @bucketPages (-1 for a page not taken yet). Returns the slot.
+int dir_alloc(int rIndex, int *bucketPages, int numOf_buckets){
+	int d = 1;
+	while (d < numOf_dirs && dirs[d].numOf_buckets != 0) {
+		d++;
+	}
+	if (d == numOf_dirs) {
+		if (resize_table((void**)&dirs, sizeof(struct dirInfo), numOf_dirs, numOf_dirs * 2) == -1) {
+			return -1;
+		}
+		numOf_dirs *= 2;
+	}
+	dirs[d].rIndex = rIndex;
+	dirs[d].numOf_buckets = numOf_buckets;
+	dirs[d].pages = bucketPages;
+	entryDir[rIndex] = d;
+	return d;
+}
+
+// Function to drop subdirectory @dir from memory, along with its pages
+void dir_free(int dir){
+	for (int b = 0; b < dirs[dir].numOf_buckets; b++) {
+		if (dirs[dir].pages[b] != -1) {
+			page_free(dirs[dir].pages[b]);
+		}
+	}
+	entryDir[dirs[dir].rIndex] = 0;
+	free(dirs[dir].pages);
+	dirs[dir].pages = NULL;
+	dirs[dir].numOf_buckets = 0;
+}
+
+// Function to drop the directory table
+void dir_table_free(void){
+	for (int d = 0; d < numOf_dirs; d++) {
+		free(dirs[d].pages);
+	}
+	free(dirs);
+	free(pages);
+	free(rdir);
+	free(rdirShadow);
+	free(openCount);
+	free(ccache);
+	free(entryDir);
+	dirs = NULL;
+	pages = NULL;
+	rdir = NULL;
+	rdirShadow = NULL;
+	openCount = NULL;
+	ccache = NULL;
+	entryDir = NULL;
+	numOf_dirs = 0;
+	numOf_pages = 0;
+	numOf_entries = 0;
+}
+
+// Function to set up the directory table of a mount, with the root directory as its only page
+int dir_table_init(void){
+	dir_table_free();
+	rdir = calloc(DIR_ENTRIES, sizeof(struct rootDirEntry));
+	rdirShadow = calloc(DIR_ENTRIES, sizeof(struct rootDirEntry));
+	openCount = calloc(DIR_ENTRIES, sizeof(int));
+	ccache = calloc(DIR_ENTRIES, sizeof(struct clusterCache *));
+	entryDir = calloc(DIR_ENTRIES, sizeof(int));
+	pages = calloc(1, sizeof(struct dirPage));
+	dirs = calloc(1, sizeof(struct dirInfo));
+	int *rootPages = calloc(1, sizeof(int));
+	if (rdir == NULL || rdirShadow == NULL || openCount == NULL || ccache == NULL ||
+	    entryDir == NULL || pages == NULL || dirs == NULL || rootPages == NULL) {
+		free(rootPages);
+		dir_table_free();
+		return -1;
+	}
+	numOf_pages = 1;
+	numOf_entries = DIR_ENTRIES;
+	pages[0].dir = 0;
+	pages[0].block = -1;
+	pages[0].written = 1;
+	numOf_dirs = 1;
+	dirs[0].rIndex = -1;
+	dirs[0].numOf_buckets = 1;
+	dirs[0].pages = rootPages;
+	pathCacheGen++;
+	return 0;
+}
+
+// Function to load subdirectory @rIndex into the directory table: every block of its FAT
+// chain gets a page, and all of them are read in a single batch
+int dir_load(int rIndex){
+	int numOf_buckets = rdir[rIndex].file_size / BLOCK_SIZE;
+	if (numOf_buckets < 1 || numOf_buckets > DIR_MAX_BUCKETS) {
+		return -1;
+	}
+	int *bucketPages = malloc(numOf_buckets * sizeof(int));
+	struct blockRequest *reqs = malloc(numOf_buckets * sizeof(struct blockRequest));
+	int dir = (bucketPages == NULL || reqs == NULL) ? -1 : dir_alloc(rIndex, bucketPages, numOf_buckets);
+	if (dir == -1) {
+		free(bucketPages);
+		free(reqs);
+		return -1;
+	}
+	for (int b = 0; b < numOf_buckets; b++) {
+		bucketPages[b] = -1;
+	}
+
+	int current = rdir[rIndex].firstDataBlock_index;
+	for (int b = 0; b < numOf_buckets; b++) {
+		if (current == FAT_EOC || current >= sblock.numOf_dataBlocks ||
+		    (bucketPages[b] = page_alloc(dir, current)) == -1) {
+			dir_free(dir);
+			free(reqs);
+			return -1;
+		}
+		current = fat[current].content;
+	}
+
+	// Pages are only placed once they are all taken, the table may have moved meanwhile
+	for (int b = 0; b < numOf_buckets; b++) {
+		reqs[b].block = pages[bucketPages[b]].block;
+		reqs[b].buf = &rdir[bucketPages[b] * DIR_ENTRIES];
+		reqs[b].write = 0;
+		reqs[b].owner = -1;
+	}
+	if (data_blocks_read(reqs, numOf_buckets) == -1) {
+		dir_free(dir);
+		free(reqs);
+		return -1;
+	}
+	for (int b = 0; b < numOf_buckets; b++) {
+		memcpy(&rdirShadow[bucketPages[b] * DIR_ENTRIES], &rdir[bucketPages[b] * DIR_ENTRIES], BLOCK_SIZE);
+		pages[bucketPages[b]].written = 1;
+	}
+	free(reqs);
+	return 0;
+}
+
+// Function to load every subdirectory into the directory table. The table grows as directories
+// are loaded, so that the walk goes on with the entries of the directories it just loaded.
+void load_directories(void){
+	for (int i = 0; i < numOf_entries; i++) {
+		if (rdir[i].file_name[0] != '\0' && (rdir[i].file_flags & FILE_DIRECTORY) && dir_load(i) == -1) {
+			fs_print("Failed to load a directory.\n");
+		}
+	}
+}
+
+// Function to find the entry named @name in directory @dir, looking only at the block the
+// name hashes to. Returns the entry, or -1 if there is none.
+int dir_lookup(int dir, const char *name){
+	size_t len = strlen(name);
+	if (len == 0 || len > FS_FILENAME_LEN) {
+		return -1;
+	}
+	struct rootDirEntry *bucket = dir_bucket(dir, name);
+	for (int i = 0; i < DIR_ENTRIES; i++) {
+		if (bucket[i].file_name[0] != '\0' && strncmp(bucket[i].file_name, name, FS_FILENAME_LEN) == 0) {
+			return bucket - rdir + i;
+		}
+	}
+	return -1;
+}
+
+// Function to move directory entry @from to the free entry @to, along with the open file
+// descriptors, cluster cache and subdirectory that refer to it
+void move_entry(int from, int to){
+	rdir[to] = rdir[from];
+	memset(&rdir[from], 0, sizeof(struct rootDirEntry));
+	openCount[to] = openCount[from];
+	openCount[from] = 0;
+	ccache[to] = ccache[from];
+	ccache[from] = NULL;
+	entryDir[to] = entryDir[from];
+	entryDir[from] = 0;
+	if (entryDir[to] != 0) {
+		dirs[entryDir[to]].rIndex = to;
+	}
+	for (int c = 0; openCount[to] > 0 && c < numOf_fdChunks; c++) {
+		for (int i = 0; i < FD_CHUNK; i++) {
+			struct fileDescriptor *file = &fdChunks[c]->fds[i];
+			if (file->fdIndex != -1 && file->rIndex == from) {
+				file->rIndex = to;
+			}
+		}
+	}
+}
+
+// Function to double the buckets of subdirectory @dir. The entries of an old bucket can only
+// hash to two of the new ones, so they always fit. Returns -1 if the directory cannot grow.
+int dir_grow(int dir){
+	int oldBuckets = dirs[dir].numOf_buckets;
+	int newBuckets = oldBuckets * 2;
+	if (dir == 0 || newBuckets > DIR_MAX_BUCKETS) {
+		return -1;
+	}
+	int *newPages = malloc(newBuckets * sizeof(int));
+	int first = newPages == NULL ? -1 : allocate_chain(newBuckets);
+	if (first == -1) {
+		free(newPages);
+		return -1;
+	}
+	int current = first;
+	for (int b = 0; b < newBuckets; b++) {
+		newPages[b] = page_alloc(dir, current);
+		if (newPages[b] == -1) {
+			while (--b >= 0) {
+				page_free(newPages[b]);
+			}
+			free(newPages);
+			free_chain(first);
+			return -1;
+		}
+		current = fat[current].content;
+	}
+
+	for (int b = 0; b < oldBuckets; b++) {
+		int from = dirs[dir].pages[b] * DIR_ENTRIES;
+		for (int i = from; i < from + DIR_ENTRIES; i++) {
+			if (rdir[i].file_name[0] == '\0') {
+				continue;
+			}
+			int to = newPages[string_hash(rdir[i].file_name, FS_FILENAME_LEN) % newBuckets] * DIR_ENTRIES;
+			while (rdir[to].file_name[0] != '\0') {
+				to++;
+			}
+			move_entry(i, to);
+		}
+		page_free(dirs[dir].pages[b]);
+	}
+
+	int rIndex = dirs[dir].rIndex;
+	free_chain(rdir[rIndex].firstDataBlock_index);
+	rdir[rIndex].firstDataBlock_index = first;
+	rdir[rIndex].file_size = newBuckets * BLOCK_SIZE;
+	free(dirs[dir].pages);
+	dirs[dir].pages = newPages;
+	dirs[dir].numOf_buckets = newBuckets;
+	pathCacheGen++;		// entries moved
+	return 0;
+}
+
+// Function to find a free entry for a new file named @name in directory @dir, in the block the
+// name hashes to. A subdirectory grows when that block is full. Returns -1 if there is none.
+int dir_insert(int dir, const char *name){
+	while (1) {
+		struct rootDirEntry *bucket = dir_bucket(dir, name);
+		for (int i = 0; i < DIR_ENTRIES; i++) {
+			if (bucket[i].file_name[0] == '\0') {
+				return bucket - rdir + i;
+			}
+		}
+		if (dir_grow(dir) == -1) {
+			return -1;
+		}
+	}
+}
+
+// Function to find the entry @path leads to. Components are separated by slashes, and a path
+// without any names a file of the root directory. Deep paths are looked up in a cache first,
+// and their parent directory is resolved the same way, so that walking from the root only
+// goes as far up as the cache does not know. Returns the entry, or -1 if there is none.
+int path_lookup(const char *path){
+	if (path[0] == '/') {
+		path++;
+	}
+	if (strchr(path, '/') == NULL) {
+		return dir_lookup(0, path);
+	}
+
+	struct pathCacheEntry *cached = &pathCache[string_hash(path, PATH_CACHE_LEN) % PATH_CACHE_SLOTS];
+	if (cached->gen == pathCacheGen && strcmp(cached->path, path) == 0) {
+		return cached->rIndex;
+	}
+
+	const char *name;
+	int dir = path_parent(path, &name);
+	int rIndex = dir == -1 ? -1 : dir_lookup(dir, name);
+	if (rIndex != -1 && strlen(path) < PATH_CACHE_LEN) {
+		strcpy(cached->path, path);
+		cached->rIndex = rIndex;
+		cached->gen = pathCacheGen;
+	}
+	return rIndex;
+}
+
+// Function to find the directory @path leads to. The empty path and "/" are the root directory.
+// Returns the directory, or -1 if @path does not lead to one.
+int path_dir(const char *path){
+	if (path[0] == '/') {
+		path++;
+	}
+	if (path[0] == '\0') {
+		return 0;
+	}
+	int rIndex = path_lookup(path);
+	if (rIndex == -1 || !(rdir[rIndex].file_flags & FILE_DIRECTORY) || entryDir[rIndex] == 0) {
+		return -1;
+	}
+	return entryDir[rIndex];
+}
+
+// Function to split @path into the directory it names a file in, which is returned, and the
+// name of the file, pointed to by @name. Returns -1 if the directory does not exist, or if
+// the name is empty or does not fit in an entry with its NULL character.
+int path_parent(const char *path, const char **name){
+	if (path[0] == '/') {
+		path++;
+	}
+	const char *slash = strrchr(path, '/');
+	*name = slash == NULL ? path : slash + 1;
+	size_t len = strlen(*name);
+	if (len == 0 || len >= FS_FILENAME_LEN) {
+		return -1;
+	}
+	if (slash == NULL) {
+		return 0;
+	}
+	if (slash - path >= FS_PATH_MAX) {
+		return -1;
+	}
+	char prefix[FS_PATH_MAX];
+	memcpy(prefix, path, slash - path);
+	prefix[slash - path] = '\0';
+	return path_dir(prefix);
+}
+
+
+/* Hot-block tiering */
+
+// Function to point whatever points at data block @dataIndex of a FAT chain at @newIndex
+// instead: the FAT entry of the previous block, or the directory entry of the file
+int relink_block(int dataIndex, int newIndex){
+	for (int i = 0; i < sblock.numOf_dataBlocks; i++) {
+		if (fat[i].content == dataIndex) {
+			fat[i].content = newIndex;
+			return 0;
+		}
+	}
+	for (int i = 0; i < numOf_entries; i++) {
+		if (rdir[i].file_name[0] != '\0' && !(rdir[i].file_flags & FILE_MAPPED) &&
+		    rdir[i].firstDataBlock_index == dataIndex) {
+			rdir[i].firstDataBlock_index = newIndex;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Function to move data block @src of a FAT chain into the free data block @dst. The block
+// keeps its place in the chain, its heat, checksum and fingerprint. @src stays allocated
+// until the caller has written the new links to disk, so that it cannot be reused while
+// the chain on disk still goes through it.
+int move_block(int src, int dst, void *bBuf){
+	uint16_t srcHeat = heat != NULL ? heat[src] : 0;
+	if (data_block_read(src, bBuf) == -1 || data_block_write(dst, bBuf) == -1 ||
+	    relink_block(src, dst) == -1) {
+		return -1;
+	}
+	fat[dst].content = fat[src].content;
+	fat[src].content = FAT_EOC;
+
+	if (fprint != NULL && fprint[src] != 0) {
+		uint32_t f = fprint[src];
+		fprint_forget(src);
+		fprint_record(dst, f);
+	}
+	if (csum != NULL) {
+		csum[src] = 0;
+	}
+	if (heat != NULL) {
+		heat[dst] = srcHeat;
+		heat[src] = 0;
+	}
+	return 0;
+}
+
+// Function to flag, in @movable, the data blocks that move_block() can move: those of
+// FAT chain files that are referenced by that file only. Directory blocks are not, the
+// directory table points at them.
+void mark_movable_blocks(uint8_t *movable){
+	int numOf_blocks = sblock.numOf_dataBlocks;
+	for (int i = 0; i < numOf_entries; i++) {
+		if (rdir[i].file_name[0] == '\0' || (rdir[i].file_flags & (FILE_MAPPED | FILE_DIRECTORY))) {
+			continue;
+		}
+		int current = rdir[i].firstDataBlock_index;
+		for (int n = 0; current != FAT_EOC && current < numOf_blocks && n < numOf_blocks; n++) {
+			movable[current] = !block_is_shared(current);
+			current = fat[current].content;
+		}
+	}
+}
+
+// Function to write the links of the blocks moved by move_block() to disk, then release
+// the blocks they were moved from
+int commit_moves(uint16_t *sources, int numOf_sources){
+	if (numOf_sources == 0) {
+		return 0;
+	}
+	if (write_fat_blocks() == -1 || write_rdir() == -1) {
+		return -1;
+	}
+	for (int i = 0; i < numOf_sources; i++) {
+		fat[sources[i]].content = FAT_FREE;
+	}
+	return 0;
+}
+
+// Comparison functions for qsort() over data block indices: hottest first, coldest first
+int compare_hotter(const void *a, const void *b){
+	return heat[*(const uint16_t *)b] - heat[*(const uint16_t *)a];
+}
+
+int compare_colder(const void *a, const void *b){
+	return heat[*(const uint16_t *)a] - heat[*(const uint16_t *)b];
+}
+
+// Function to run a tiering pass: the blocks that were read at least TIER_HOT times since
+// the last pass move from the slow tier to the fast one, hottest first. When the fast tier
+// is full, its coldest blocks make room by moving to the slow tier, as long as they are
+// clearly colder (by half) than the block that takes their place. Only blocks of FAT chain
+// files that are not shared with a clone move. Heat is halved at the end of the pass, so
+// blocks that are no longer read cool down over time.
+int tier_rebalance(size_t io_budget){
+	int numOf_blocks = sblock.numOf_dataBlocks;
+	uint8_t *movable = calloc(numOf_blocks, 1);
+	uint16_t *hot = malloc(numOf_blocks * sizeof(uint16_t));
+	uint16_t *cold = malloc(numOf_blocks * sizeof(uint16_t));
+	uint16_t *sources = malloc(numOf_blocks * sizeof(uint16_t));
+	void *bBuf = malloc(BLOCK_SIZE);
+	int numOf_hot = 0, numOf_cold = 0, numOf_sources = 0;
+	int moved = -1;
+
+	if (movable == NULL || hot == NULL || cold == NULL || sources == NULL || bBuf == NULL) {
+		goto out;
+	}
+
+	mark_movable_blocks(movable);
+	for (int i = 0; i < numOf_blocks; i++) {
+		if (!movable[i]) {
+			continue;
+		}
+		if (i >= fastBlocks && heat[i] >= TIER_HOT) {
+			hot[numOf_hot++] = i;
+		} else if (i < fastBlocks) {
+			cold[numOf_cold++] = i;
+		}
+	}
+	qsort(hot, numOf_hot, sizeof(uint16_t), compare_hotter);
+	qsort(cold, numOf_cold, sizeof(uint16_t), compare_colder);
+	numOf_hot = min((size_t)numOf_hot, io_budget);
+
+	// Demote the cold blocks whose place the hot blocks need, beyond the free fast blocks
+	int freeFast = fat_count_free(fat, fastBlocks);
+	int numOf_demoted = 0;
+	moved = 0;
+	for (int i = freeFast; i < numOf_hot && numOf_demoted < numOf_cold; i++) {
+		int victim = cold[numOf_demoted];
+		if ((size_t)moved + 2 > io_budget || heat[victim] * 2 >= heat[hot[i]]) {
+			break;
+		}
+		int dst = fat_find_free(fat, fastBlocks, numOf_blocks);
+		if (dst == -1) {
+			break;
+		}
+		if (move_block(victim, dst, bBuf) == -1) {
+			moved = -1;
+			goto out;
+		}
+		sources[numOf_sources++] = victim;
+		numOf_demoted++;
+		moved++;
+	}
+	if (commit_moves(sources, numOf_sources) == -1) {
+		moved = -1;
+		goto out;
+	}
+
+	// Promote the hot blocks into the free fast blocks
+	numOf_sources = 0;
+	for (int i = 0; i < numOf_hot && (size_t)moved < io_budget; i++) {
+		int dst = fat_find_free(fat, 0, fastBlocks);
+		if (dst == -1) {
+			break;
+		}
+		if (move_block(hot[i], dst, bBuf) == -1) {
+			moved = -1;
+			goto out;
+		}
+		sources[numOf_sources++] = hot[i];
+		moved++;
+	}
+	if (commit_moves(sources, numOf_sources) == -1) {
+		moved = -1;
+		goto out;
+	}
+
+	for (int i = 0; i < numOf_blocks; i++) {
+		heat[i] /= 2;
+	}
+	tierReads = 0;
+
+out:
+	free(movable);
+	free(hot);
+	free(cold);
+	free(sources);
+	free(bBuf);
+	return moved;
+}
+
+int fs_tier(size_t io_budget)
+{
+	perf_scope(FS_TIER);
+	fs_lock_scope();
+	metaDirty = 1;
+
 	// Check if no FS is currently mounted
-    if(isMounted == 0){
-        fprintf(stderr, "No FS currently mounted.\n");
-        return -1;
-    }
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
 
-	// Display the lists of all the files in the file system.
-	printf("FS Ls:\n");
+	if (heat == NULL) {
+		return 0;
+	}
+	return tier_rebalance(io_budget != 0 ? io_budget : SIZE_MAX);
+}
 
-	// Iterate over the entries in the root directory
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		// If the filename is not empty, print out
-		if(rdir[i].file_name[0] != '\0'){
-			printf("file: %s, size: %d, data_blk: %d\n", 
-			rdir[i].file_name, rdir[i].file_size, rdir[i].firstDataBlock_index);
+/* Log-structured mode */
+
+// Function to run a pass of the segment cleaner. The data region is cut in segments of
+// SEGMENT_BLOCKS blocks, and the log is written sequentially through the free blocks. When
+// fewer than CLEAN_RESERVE segments are entirely free, the live blocks of the emptiest
+// segments are moved to the head of the log, so that the log finds long free runs again.
+// Segments holding blocks that cannot move (block maps, tables, mapped files) are skipped.
+// Returns the number of blocks moved, or -1 on error.
+int clean_segments(int maxSegments){
+	int numOf_blocks = sblock.numOf_dataBlocks;
+	int numOf_segments = numOf_blocks / SEGMENT_BLOCKS;
+	uint8_t *movable = calloc(numOf_blocks, 1);
+	int *live = calloc(numOf_segments + 1, sizeof(int));
+	uint16_t *sources = malloc(SEGMENT_BLOCKS * sizeof(uint16_t));
+	void *bBuf = malloc(BLOCK_SIZE);
+	int moved = -1;
+
+	if (movable == NULL || live == NULL || sources == NULL || bBuf == NULL) {
+		goto out;
+	}
+
+	// Count the live blocks of each segment, with -1 for the segments that cannot be emptied
+	mark_movable_blocks(movable);
+	int numOf_free = 0;
+	for (int seg = 0; seg < numOf_segments; seg++) {
+		for (int i = seg * SEGMENT_BLOCKS; i < (seg + 1) * SEGMENT_BLOCKS && live[seg] != -1; i++) {
+			if (fat[i].content != FAT_FREE) {
+				live[seg] = movable[i] ? live[seg] + 1 : -1;
+			}
+		}
+		numOf_free += (live[seg] == 0);
+	}
+
+	moved = 0;
+	for (int n = 0; n < maxSegments && numOf_free + n < CLEAN_RESERVE; n++) {
+		// The emptiest segment that is not being written by the log, and less than half full
+		int victim = -1;
+		for (int seg = 0; seg < numOf_segments; seg++) {
+			if (live[seg] > 0 && live[seg] <= SEGMENT_BLOCKS / 2 && logHead / SEGMENT_BLOCKS != seg &&
+			    (victim == -1 || live[seg] < live[victim])) {
+				victim = seg;
+			}
+		}
+		if (victim == -1) {
+			break;
+		}
+
+		int numOf_sources = 0;
+		for (int i = victim * SEGMENT_BLOCKS; i < (victim + 1) * SEGMENT_BLOCKS; i++) {
+			if (fat[i].content == FAT_FREE) {
+				continue;
+			}
+			int dst = allocate_new_data_block();
+			if (dst == -1 || dst / SEGMENT_BLOCKS == victim) {
+				break;	// no room outside of the segment
+			}
+			if (move_block(i, dst, bBuf) == -1) {
+				moved = -1;
+				goto out;
+			}
+			sources[numOf_sources++] = i;
+		}
+		if (commit_moves(sources, numOf_sources) == -1) {
+			moved = -1;
+			goto out;
+		}
+		moved += numOf_sources;
+		live[victim] = -1;	// done with it, whether it could be emptied or not
+	}
+
+out:
+	free(movable);
+	free(live);
+	free(sources);
+	free(bBuf);
+	return moved;
+}
 
+// Function run by the segment cleaner thread of a mount in log mode
+void *cleaner(void *arg){
+	unsigned int gen = (uintptr_t)arg;
+
+	pthread_mutex_lock(&fsLock);
+	while(flusherGen == gen){
+		struct timespec deadline;
+		deadline_after(&deadline, CLEAN_INTERVAL);
+		pthread_cond_timedwait(&flusherCond, &fsLock, &deadline);
+
+		// The file system this thread was started for may be gone, or out of log mode
+		if(flusherGen == gen && (sblock.feature_flags & FEATURE_LOG)){
+			int moved = clean_segments(CLEAN_SEGMENTS);
+			if(moved == -1){
+				fs_print("Segment cleaning failed.\n");
+			} else if(moved > 0){
+				metaDirty = 1;
+			}
 		}
 	}
+	pthread_mutex_unlock(&fsLock);
+	return NULL;
+}
+
+// Function to start the segment cleaner thread, unless it already runs for this mount
+int start_cleaner(void){
+	if(cleanerStarted){
+		return 0;
+	}
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, cleaner, (void*)(uintptr_t)flusherGen) != 0){
+		return -1;
+	}
+	pthread_detach(thread);
+	cleanerStarted = 1;
 	return 0;
 }
 
-/* TODO: Phase 3 */
-int fs_open(const char *filename)
+int fs_log(int enable)
 {
-/**
- * fs_open - Open a file
- * @filename: File name
- *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
- */	
+	perf_scope(FS_LOG);
+	fs_lock_scope();
+	metaDirty = 1;
 
 	// Check if no FS is currently mounted
-    if(isMounted == 0){
-        fs_print("No FS currently mounted.\n");
-        return -1;
-    }
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	// Data already on disk stays where it is, only writes from now on go to the log
+	if(enable){
+		sblock.feature_flags |= FEATURE_LOG;
+		if(start_cleaner() == -1){
+			fs_print("Failed to start the segment cleaner.\n");
+		}
+	} else {
+		sblock.feature_flags &= ~FEATURE_LOG;
+	}
+
+	if(block_write(SUPERBLOCK_INDEX, &sblock) == -1){
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Copy-on-write clones */
+
+// Function to give file @dstIndex a copy of the block map of file @srcIndex. Map blocks are
+// copied, data blocks are shared by taking an extra reference on them. A data block whose
+// reference count is saturated is copied instead.
+int copy_block_map(int srcIndex, int dstIndex){
+	uint16_t *index = malloc(BLOCK_SIZE);
+	uint16_t *newIndex = calloc(1, BLOCK_SIZE);
+	uint16_t *entries = malloc(BLOCK_SIZE);
+	void *bBuf = malloc(BLOCK_SIZE);
+	int ret = -1;
+
+	if (index == NULL || newIndex == NULL || entries == NULL || bBuf == NULL) {
+		goto out;
+	}
+	if (data_block_read(rdir[srcIndex].firstDataBlock_index, index) == -1) {
+		goto out;
+	}
+
+	int newIndexBlock = allocate_standalone_block();
+	if (newIndexBlock == -1) {
+		goto out;
+	}
+	rdir[dstIndex].firstDataBlock_index = newIndexBlock;
+
+	int full = 0;
+	for (size_t i = 0; i < MAP_ENTRIES && !full; i++) {
+		if (index[i] == MAP_HOLE) {
+			continue;
+		}
+		int newMapBlock = allocate_standalone_block();
+		if (newMapBlock == -1 ||
+		    data_block_read(index[i], entries) == -1) {
+			if (newMapBlock != -1) {
+				fat[newMapBlock].content = FAT_FREE;
+			}
+			full = 1;
+			break;
+		}
+
+		for (size_t j = 0; j < MAP_ENTRIES; j++) {
+			if (entries[j] == MAP_HOLE) {
+				continue;
+			}
+			if (full) {
+				entries[j] = MAP_HOLE;	// never shared, must not be released on cleanup
+				continue;
+			}
+			if (rdir[srcIndex].file_flags & FILE_COMPRESSED) {
+				// Entries go by pairs: stored cluster, then its compressed length.
+				// The whole chain of the cluster is shared, or the clone fails.
+				if (j % 2 == 1) {
+					continue;
+				}
+				int saturated = 0;
+				for (int b = entries[j]; b != FAT_EOC; b = fat[b].content) {
+					saturated |= (refcnt[b] == UINT8_MAX);
+				}
+				if (saturated) {
+					entries[j] = MAP_HOLE;
+					full = 1;
+					continue;
+				}
+				for (int b = entries[j]; b != FAT_EOC; b = fat[b].content) {
+					refcnt[b]++;
+				}
+				continue;
+			}
+			if (refcnt[entries[j]] < UINT8_MAX) {
+				refcnt[entries[j]]++;
+				continue;
+			}
+			int copy = allocate_standalone_block();
+			if (copy == -1 ||
+			    data_block_read(entries[j], bBuf) == -1 ||
+			    data_block_write(copy, bBuf) == -1) {
+				if (copy != -1) {
+					fat[copy].content = FAT_FREE;
+				}
+				entries[j] = MAP_HOLE;
+				full = 1;
+				continue;
+			}
+			entries[j] = copy;
+		}
+
+		if (data_block_write(newMapBlock, entries) == -1) {
+			full = 1;
+		}
+		newIndex[i] = newMapBlock;
+	}
+
+	if (data_block_write(newIndexBlock, newIndex) == -1) {
+		fat[newIndexBlock].content = FAT_FREE;
+		rdir[dstIndex].firstDataBlock_index = FAT_EOC;
+		goto out;
+	}
+
+	// Out of space: drop whatever part of the clone was built
+	if (full) {
+		free_file_blocks(dstIndex);
+		rdir[dstIndex].firstDataBlock_index = FAT_EOC;
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(index);
+	free(newIndex);
+	free(entries);
+	free(bBuf);
+	return ret;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	perf_scope(FS_CLONE);
+	fs_lock_scope();
+	metaDirty = 1;
+	capture_call(CLONE, -1, 0, 0, src, dst);
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	// Check if the filenames are valid or too long
+	const char *name, *srcName;
+	int dir = (src == NULL || dst == NULL) ? -1 : path_parent(dst, &name);
+	if(dir == -1 || path_parent(src, &srcName) == -1){
+		fs_print("Invalid filename.\n");
+		return -1;
+	}
+
+	// Make sure the destination does not exist yet, and take its entry. Making room for it
+	// can move the entries of its directory, so the source is only looked up afterwards.
+	if(dir_lookup(dir, name) != -1){
+		fs_print("File with the same name already exists.\n");
+		return -1;
+	}
+	int dstIndex = dir_insert(dir, name);
+	if(dstIndex == -1){
+		return -1;
+	}
+
+	// Find the source file
+	int srcIndex = path_lookup(src);
+	if(srcIndex == -1){
+		fs_print("Filename does not exist.\n");
+		return -1;
+	}
+	if(rdir[srcIndex].file_flags & FILE_DIRECTORY){
+		fs_print("Is a directory.\n");
+		return -1;
+	}
+
+	// Sharing data blocks needs the reference count table, and a block map on the source
+	if(refcnt == NULL && create_refcnt_table() == -1){
+		return -1;
+	}
+	if(flush_file_cluster(srcIndex) == -1){
+		return -1;
+	}
+	if(rdir[srcIndex].firstDataBlock_index != FAT_EOC && !(rdir[srcIndex].file_flags & FILE_MAPPED)){
+		if(convert_to_mapped(srcIndex) == -1){
+			return -1;
+		}
+	}
+
+	// Create the clone with its own copy of the block map
+	strncpy(rdir[dstIndex].file_name, name, FS_FILENAME_LEN);
+	rdir[dstIndex].file_size = rdir[srcIndex].file_size;
+	rdir[dstIndex].file_flags = rdir[srcIndex].file_flags;
+	rdir[dstIndex].firstDataBlock_index = FAT_EOC;
+	if(rdir[srcIndex].firstDataBlock_index != FAT_EOC && copy_block_map(srcIndex, dstIndex) == -1){
+		memset(&rdir[dstIndex], 0, sizeof(struct rootDirEntry));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Block-level deduplication */
+
+int fs_dedup(int enable)
+{
+	perf_scope(FS_DEDUP);
+	fs_lock_scope();
+	metaDirty = 1;
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	if (enable && fprint == NULL) {
+		// Shared blocks are tracked with the same reference counts as clones
+		if (refcnt == NULL && create_refcnt_table() == -1) {
+			return -1;
+		}
+
+		int numOf_blocks = (sblock.numOf_dataBlocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		fprint = calloc(numOf_blocks, BLOCK_SIZE);
+		int first = (fprint == NULL) ? -1 : allocate_chain(numOf_blocks);
+		if (first == -1 || build_fprint_index() == -1) {
+			if (first != -1) {
+				free_chain(first);
+			}
+			free(fprint);
+			fprint = NULL;
+			return -1;
+		}
+
+		// Persist the empty table, then make the superblock point to it
+		sblock.fprint_blockIndex = first;
+		if (transfer_table(first, fprint, 1) == -1 || block_write(SUPERBLOCK_INDEX, &sblock) == -1) {
+			return -1;
+		}
+	} else if (!enable && fprint != NULL) {
+		// Blocks already shared stay shared, only new writes stop being deduplicated
+		free_chain(sblock.fprint_blockIndex);
+		sblock.fprint_blockIndex = 0;
+		free(fprint);
+		free(fprintIndex);
+		free(fprintShadow);
+		fprint = NULL;
+		fprintIndex = NULL;
+		fprintShadow = NULL;
+		if (block_write(SUPERBLOCK_INDEX, &sblock) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Transparent compression */
+
+int fs_compress(int enable)
+{
+	perf_scope(FS_COMPRESS);
+	fs_lock_scope();
+	metaDirty = 1;
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	// Only files created from now on are affected
+	if(enable){
+		sblock.feature_flags |= FEATURE_COMPRESS;
+	} else {
+		sblock.feature_flags &= ~FEATURE_COMPRESS;
+	}
+
+	if(block_write(SUPERBLOCK_INDEX, &sblock) == -1){
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Block checksums */
+
+int fs_checksum(int enable)
+{
+	perf_scope(FS_CHECKSUM);
+	fs_lock_scope();
+	metaDirty = 1;
+
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
+
+	if (enable && csum == NULL) {
+		int numOf_blocks = (sblock.numOf_dataBlocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		void *bBuf = malloc(BLOCK_SIZE);
+		uint32_t *table = calloc(numOf_blocks, BLOCK_SIZE);
+		int first = (bBuf == NULL || table == NULL) ? -1 : allocate_chain(numOf_blocks);
+
+		// Checksum what the disk already holds, metadata tables included: their entries
+		// are dropped again whenever a table is written back
+		for (int i = 1; first != -1 && i < sblock.numOf_dataBlocks; i++) {
+			if (fat[i].content != FAT_FREE) {
+				if (block_read(sblock.dataBlock_startIndex + i, bBuf) == -1) {
+					free_chain(first);
+					first = -1;
+					break;
+				}
+				table[i] = block_checksum(bBuf);
+			}
+		}
+		free(bBuf);
+		if (first == -1) {
+			free(table);
+			return -1;
+		}
+		csum = table;
+
+		// Persist the table, then make the superblock point to it
+		sblock.csum_blockIndex = first;
+		if (transfer_table(first, csum, 1) == -1 || block_write(SUPERBLOCK_INDEX, &sblock) == -1) {
+			return -1;
+		}
+	} else if (!enable && csum != NULL) {
+		free_chain(sblock.csum_blockIndex);
+		sblock.csum_blockIndex = 0;
+		free(csum);
+		free(csumShadow);
+		csum = NULL;
+		csumShadow = NULL;
+		if (block_write(SUPERBLOCK_INDEX, &sblock) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Consistency checker */
+
+// A FAT chain walked by fs_check(): the chain of a file, or of a metadata table
+struct checkChain {
+	int first;				// first data block of the chain
+	int rIndex;				// file the chain belongs to (-1 for a table)
+	const char *table;		// name of the table (NULL for a file)
+	int expected;			// number of blocks the chain should have
+	int length;				// number of blocks walked
+	int last;				// last block walked (-1 if none)
+	int problem;			// CHECK_* result of the walk
+	int other;				// owner of the block the chain ran into (CHECK_CROSSLINK)
+};
+
+// A mapped file checked by fs_check()
+struct checkMapped {
+	int rIndex;				// index of the file in root directory
+	int badIndex;			// the index block is invalid or used by something else
+	int badEntries;			// number of invalid entries in the index and map blocks
+};
+
+// State shared by the threads of fs_check(). Work items are the chains, then the mapped
+// files; the owner of a block is the item that claimed it first, plus one.
+struct checkState {
+	struct checkChain *chains;	// one per directory entry, plus the tables
+	int numOf_chains;
+	struct checkMapped *mapped;	// one per directory entry
+	int numOf_mapped;
+	int next;				// next work item to take
+	uint32_t *owner;		// item that claimed each block exclusively, plus one (0 if none)
+	uint16_t *refs;			// references to each data block of a mapped file
+	int repair;				// fix invalid map entries while walking
+};
+
+// Function to claim data block @dataIndex for work item @id. Returns 0 if it was not
+// claimed yet, otherwise the previous owner plus one.
+int check_claim(struct checkState *st, int dataIndex, int id){
+	uint32_t expected = 0;
+	if (__atomic_compare_exchange_n(&st->owner[dataIndex], &expected, id + 1, 0,
+	                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	return expected;
+}
 
-	// Check if the filename is valid or too long
-	if(filename == NULL || strlen(filename) > FS_FILENAME_LEN){
-		fs_print("Invalid filename.\n");
-		return -1;
+// Function to tell if @dataIndex can be the index of a data block in use (block 0 is reserved)
+int check_valid(int dataIndex){
+	return dataIndex > 0 && dataIndex < sblock.numOf_dataBlocks;
+}
+
+// Function to walk a FAT chain, claiming its blocks, until it ends or goes wrong
+void check_chain(struct checkState *st, int id){
+	struct checkChain *chain = &st->chains[id];
+	int current = chain->first;
+
+	chain->length = 0;
+	chain->last = -1;
+	chain->problem = CHECK_OK;
+	while (current != FAT_EOC) {
+		if (!check_valid(current)) {
+			chain->problem = CHECK_BAD_POINTER;
+			return;
+		}
+		int previous = check_claim(st, current, id);
+		if (previous != 0) {
+			chain->problem = (previous == id + 1) ? CHECK_CYCLE : CHECK_CROSSLINK;
+			chain->other = previous - 1;
+			return;
+		}
+		chain->length++;
+		chain->last = current;
+		current = fat[current].content;
 	}
+}
 
-	// Check if the given input @filename exists in root directory 
-	int found = -1;		
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(strcmp(rdir[i].file_name, filename) == 0){	// Iterate through 128 files and compare their filenames
-			found = i;	// update root directory index 
-			break;
+// Function to tell if the cluster chain of a compressed file starting at @first is sound.
+// Cluster chains may be shared by clones, so their blocks are counted, not claimed.
+int check_cluster(int first){
+	int current = first;
+	for (int n = 0; current != FAT_EOC; n++) {
+		if (!check_valid(current) || n == CLUSTER_BLOCKS) {
+			return 0;
 		}
+		current = fat[current].content;
 	}
-	// If the filename is not found, return -1.
-	if(found == -1){	
-		fs_print("Filename does not exist.\n");
-		return -1;	
+	return 1;
+}
+
+// Function to check the index and map blocks of a mapped file, and to count the references
+// to its data blocks. Invalid entries become holes when repairing, and the repaired blocks
+// are written with their new checksum. Blocks are claimed by one item only, so the workers
+// never record the checksum of the same block.
+void check_mapped(struct checkState *st, int m, uint16_t *index, uint16_t *entries){
+	struct checkMapped *mapped = &st->mapped[m];
+	int id = st->numOf_chains + m;
+	int compressed = rdir[mapped->rIndex].file_flags & FILE_COMPRESSED;
+	int indexBlock = rdir[mapped->rIndex].firstDataBlock_index;
+
+	if (indexBlock == FAT_EOC) {
+		return;
+	}
+	if (!check_valid(indexBlock) || check_claim(st, indexBlock, id) != 0 ||
+	    block_read(sblock.dataBlock_startIndex + indexBlock, index) == -1) {
+		mapped->badIndex = 1;
+		return;
 	}
 
-	// Check if there are already FS_OPEN_MAX_COUNT files currently open
-	if(count_open_fds() >= FS_OPEN_MAX_COUNT){
-		fs_print("Maximum open file limit reached.\n");
-		return -1;
+	int indexDirty = 0;
+	for (size_t i = 0; i < MAP_ENTRIES; i++) {
+		if (index[i] == MAP_HOLE) {
+			continue;
+		}
+		if (!check_valid(index[i]) || check_claim(st, index[i], id) != 0 ||
+		    block_read(sblock.dataBlock_startIndex + index[i], entries) == -1) {
+			mapped->badEntries++;
+			index[i] = MAP_HOLE;
+			indexDirty = 1;
+			continue;
+		}
+
+		int entriesDirty = 0;
+		for (size_t j = 0; j < MAP_ENTRIES; j++) {
+			if (entries[j] == MAP_HOLE || (compressed && j % 2 == 1)) {
+				continue;	// compressed lengths are not block indices
+			}
+			if (compressed ? !check_cluster(entries[j]) : !check_valid(entries[j])) {
+				mapped->badEntries++;
+				entries[j] = MAP_HOLE;
+				if (compressed) {
+					entries[j + 1] = 0;
+				}
+				entriesDirty = 1;
+				continue;
+			}
+			for (int b = entries[j]; b != FAT_EOC; b = compressed ? fat[b].content : FAT_EOC) {
+				__atomic_fetch_add(&st->refs[b], 1, __ATOMIC_RELAXED);
+			}
+		}
+		if (entriesDirty && st->repair && data_block_write(index[i], entries) == -1) {
+			fs_print("Failed to repair a map block.\n");
+		}
+	}
+	if (indexDirty && st->repair && data_block_write(indexBlock, index) == -1) {
+		fs_print("Failed to repair an index block.\n");
 	}
+}
 
-	// Find the first availabe location in file descriptor data structure
-	int loc = -1;
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(fds[i].fdIndex == -1){		// if unused index is found,
-			loc = i;					// return the location.
+// Function run by each thread of fs_check(): take work items until there are none left
+void *check_worker(void *arg){
+	struct checkState *st = arg;
+	uint16_t *index = malloc(BLOCK_SIZE);
+	uint16_t *entries = malloc(BLOCK_SIZE);
+
+	while (index != NULL && entries != NULL) {
+		int item = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED);
+		if (item < st->numOf_chains) {
+			check_chain(st, item);
+		} else if (item < st->numOf_chains + st->numOf_mapped) {
+			check_mapped(st, item - st->numOf_chains, index, entries);
+		} else {
 			break;
 		}
 	}
 
-	// Initialize the file descriptor's values at the available location
-	fds[loc].fdOffset = 0;
-	fds[loc].fdIndex = loc;		
-	fds[loc].rIndex = found;	// assign it to the file Index that matches with the input filename in rd.
-
+	free(index);
+	free(entries);
+	return NULL;
+}
 
-	return fds[loc].fdIndex;	// return open fd 
+// Function to name the owner of a block for the report of fs_check()
+const char *check_owner_name(struct checkState *st, int id){
+	if (id < st->numOf_chains) {
+		struct checkChain *chain = &st->chains[id];
+		return chain->table != NULL ? chain->table : rdir[chain->rIndex].file_name;
+	}
+	return rdir[st->mapped[id - st->numOf_chains].rIndex].file_name;
 }
 
-/* TODO: Phase 3 */
-int fs_close(int fd)
-{
-/**
- * fs_close - Close a file
- * @fd: File descriptor
- *
- * Close file descriptor @fd.
- *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
- */
+// Function to add a metadata table to the chains that fs_check() walks
+void check_add_table(struct checkState *st, int first, const char *name, size_t entrySize){
+	if (first == 0) {
+		return;
+	}
+	struct checkChain *chain = &st->chains[st->numOf_chains++];
+	chain->first = first;
+	chain->rIndex = -1;
+	chain->table = name;
+	chain->expected = (sblock.numOf_dataBlocks * entrySize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
 
-	// Check if no FS is currently mounted
-    if(isMounted == 0){
-        fs_print("No FS currently mounted.\n");
-        return -1;
-    }
+// Function to check the superblock against the disk. Returns the number of problems.
+int check_superblock(void){
+	int problems = 0;
+	int fatBlocks = (sblock.numOf_dataBlocks * sizeof(struct fatEntry) + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-	// Check if @fd is valid (out of bounds or not currently open)
-	// if @fd is non-negative integer, invalid.
-	// if @fd exceeds maximum open count, invalid.
-	// if @fd is -1, it means unused or closed.
-	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fds[fd].fdIndex == -1){
-		return -1;
+	if (sblock.total_disk_blocks != block_disk_count()) {
+		printf("superblock: %d blocks, disk has %d\n", sblock.total_disk_blocks, block_disk_count());
+		problems++;
 	}
-
-	// Close the file descriptor by setting to -1 and offset to 0
-	fds[fd].fdIndex = -1;
-	fds[fd].rIndex = -1;
-	fds[fd].fdOffset = 0;
-			
-	return 0;	// success 
+	if (sblock.numOf_fatBlocks != fatBlocks || sblock.rootDir_blockIndex != FAT_BLOCK_INDEX + fatBlocks ||
+	    sblock.dataBlock_startIndex != sblock.rootDir_blockIndex + 1 ||
+	    sblock.dataBlock_startIndex + sblock.numOf_dataBlocks != sblock.total_disk_blocks) {
+		printf("superblock: inconsistent layout\n");
+		problems++;
+	}
+	if (fat[0].content != FAT_EOC) {
+		printf("fat: reserved entry 0 is not EOC\n");
+		problems++;
+	}
+	return problems;
 }
 
-/* TODO: Phase 3 */
-int fs_stat(int fd)
+int fs_check(int repair)
 {
-/**
- * fs_stat - Get file status
- * @fd: File descriptor
- *
- * Get the current size of the file pointed by file descriptor @fd.
- *
- * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
- */
+	perf_scope(FS_CHECK);
+	fs_lock_scope();
+	metaDirty = 1;
 
 	// Check if no FS is currently mounted
-    if(isMounted == 0){
-        fs_print("No FS currently mounted.\n");
-        return -1;
-    }
-
-	// Check if @fd is valid (out of bounds or not currently open)
-	// if @fd is non-negative integer, invalid.
-	// if @fd exceeds maximum open count, invalid.
-	// if @fd is -1, it means unused or closed.
-	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fds[fd].fdIndex == -1){
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
 		return -1;
 	}
 
-	// Get the index in the root directory to access the file size
-	int rootIndex = fds[fd].rIndex;
-
-	// Return the file size from the corresponding root directory entry
-	return rdir[rootIndex].file_size;
-}
-
-/* TODO: Phase 3 */
-int fs_lseek(int fd, size_t offset)
-{
-/**
- * fs_lseek - Set file offset
- * @fd: File descriptor
- * @offset: File offset
- *
- * Set the file offset (used for read and write operations) associated with file
- * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
- *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
- */
-
-	// Check if FS is currently mounted
-	if(isMounted == 0){
-        fs_print("No FS currently mounted.\n");
-        return -1;
-    }
+	// Cached clusters of compressed files hold blocks that are only linked in once stored
+	for (int i = 0; i < numOf_entries; i++) {
+		if (ccache[i] != NULL && flush_file_cluster(i) == -1) {
+			return -1;
+		}
+	}
 
-	// Check if @fd is valid (out of bounds, or not currently open)
-	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fds[fd].fdIndex == -1){
+	struct checkState *st = calloc(1, sizeof(struct checkState));
+	if (st == NULL) {
 		return -1;
 	}
-
-	// Check the file size 
-	int check_fileSize = fs_stat(fd);
-	if(check_fileSize == -1){
-		// If fs_stat returns -1, there was an error getting the file size
+	st->chains = calloc(numOf_entries + 3, sizeof(struct checkChain));
+	st->mapped = calloc(numOf_entries, sizeof(struct checkMapped));
+	st->owner = calloc(sblock.numOf_dataBlocks, sizeof(uint32_t));
+	st->refs = calloc(sblock.numOf_dataBlocks, sizeof(uint16_t));
+	if (st->chains == NULL || st->mapped == NULL || st->owner == NULL || st->refs == NULL) {
+		free(st->chains);
+		free(st->mapped);
+		free(st->owner);
+		free(st->refs);
+		free(st);
 		return -1;
 	}
+	st->repair = repair;
 
-	size_t current_fileSize = (size_t) check_fileSize;
+	printf("FS Check:\n");
+	int problems = check_superblock();
+	int repaired = 0;
 
-	// Check if @offset is larger than the current file size
-	if(offset > current_fileSize){
-		return -1;
+	// Every file is a FAT chain or a block map, and directories and tables are FAT chains too
+	for (int i = 0; i < numOf_entries; i++) {
+		if (rdir[i].file_name[0] == '\0') {
+			continue;
+		}
+		if (rdir[i].file_flags & FILE_MAPPED) {
+			st->mapped[st->numOf_mapped++].rIndex = i;
+			continue;
+		}
+		struct checkChain *chain = &st->chains[st->numOf_chains++];
+		chain->first = rdir[i].firstDataBlock_index;
+		chain->rIndex = i;
+		chain->expected = (rdir[i].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+	check_add_table(st, sblock.refcnt_blockIndex, "refcnt", sizeof(uint8_t));
+	check_add_table(st, sblock.fprint_blockIndex, "fprint", sizeof(uint32_t));
+	check_add_table(st, sblock.csum_blockIndex, "csum", sizeof(uint32_t));
+
+	// Walk everything in parallel
+	pthread_t threads[CHECK_THREADS];
+	int numOf_threads = min(sysconf(_SC_NPROCESSORS_ONLN), CHECK_THREADS);
+	int started = 0;
+	for (int i = 1; i < numOf_threads; i++) {
+		if (pthread_create(&threads[started], NULL, check_worker, st) == 0) {
+			started++;
+		}
+	}
+	check_worker(st);
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
 	}
 
-	// Update the offset in the file descriptor
-	fds[fd].fdOffset = offset;
-
-    return 0;
-}
+	// Broken chains are cut where they go wrong, and files match the length of their chain
+	static const char *chainProblems[] = { "", "cyclic FAT chain", "FAT chain cross-linked with",
+	                                       "invalid block in FAT chain" };
+	for (int c = 0; c < st->numOf_chains; c++) {
+		struct checkChain *chain = &st->chains[c];
+		const char *name = check_owner_name(st, c);
+		const char *kind = chain->table != NULL ? "table" : "file";
+		// The blocks of a directory are its hash buckets, cutting them would lose entries
+		int fixable = repair && chain->table == NULL && !(rdir[chain->rIndex].file_flags & FILE_DIRECTORY);
+
+		if (chain->problem != CHECK_OK) {
+			problems++;
+			printf("%s: %s, %s", kind, name, chainProblems[chain->problem]);
+			if (chain->problem == CHECK_CROSSLINK) {
+				printf(" %s", check_owner_name(st, chain->other));
+			}
+			if (fixable) {
+				if (chain->last == -1) {
+					rdir[chain->rIndex].firstDataBlock_index = FAT_EOC;
+				} else {
+					fat[chain->last].content = FAT_EOC;
+				}
+				repaired++;
+			}
+			printf("%s\n", fixable ? " (cut)" : "");
+		}
 
-/* TODO: Phase 4 */
-int fs_write(int fd, void *buf, size_t count)
-{
-/**
- * fs_write - Write to a file
- * @fd: File descriptor
- * @buf: Data buffer to write in the file
- * @count: Number of bytes of data to be written
- *
- * Attempt to write @count bytes of data from buffer pointer by @buf into the
- * file referenced by file descriptor @fd. It is assumed that @buf holds at
- * least @count bytes.
- *
- * When the function attempts to write past the end of the file, the file is
- * automatically extended to hold the additional bytes. If the underlying disk
- * runs out of space while performing a write operation, fs_write() should write
- * as many bytes as possible. The number of written bytes can therefore be
- * smaller than @count (it can even be 0 if there is no more space on disk).
- *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually written.
- */
+		if (chain->length != chain->expected) {
+			problems++;
+			printf("%s: %s, %d blocks, expected %d", kind, name, chain->length, chain->expected);
+			if (fixable && chain->length < chain->expected) {
+				rdir[chain->rIndex].file_size = chain->length * BLOCK_SIZE;
+				repaired++;
+				printf(" (size reduced)");
+			} else if (fixable) {
+				// Release the blocks past the end of the file
+				int current = chain->first;
+				for (int n = 1; n < chain->expected; n++) {
+					current = fat[current].content;
+				}
+				int extra = chain->expected == 0 ? chain->first : fat[current].content;
+				if (chain->expected == 0) {
+					rdir[chain->rIndex].firstDataBlock_index = FAT_EOC;
+				} else {
+					fat[current].content = FAT_EOC;
+				}
+				while (extra != FAT_EOC) {
+					int next = fat[extra].content;
+					fat[extra].content = FAT_FREE;
+					st->owner[extra] = 0;
+					extra = next;
+				}
+				repaired++;
+				printf(" (truncated)");
+			}
+			printf("\n");
+		}
+	}
 
-	// Check if FS is currently mounted
-	if(isMounted == 0){
-		fs_print("No FS currently mounted.\n");
-		return 0;
+	for (int m = 0; m < st->numOf_mapped; m++) {
+		struct checkMapped *mapped = &st->mapped[m];
+		const char *name = rdir[mapped->rIndex].file_name;
+		if (mapped->badIndex) {
+			problems++;
+			printf("file: %s, invalid index block", name);
+			if (repair) {
+				rdir[mapped->rIndex].firstDataBlock_index = FAT_EOC;
+				rdir[mapped->rIndex].file_size = 0;
+				repaired++;
+				printf(" (emptied)");
+			}
+			printf("\n");
+		}
+		if (mapped->badEntries > 0) {
+			problems++;
+			printf("file: %s, %d invalid map entries%s\n", name, mapped->badEntries,
+			       repair ? " (made holes)" : "");
+			repaired += repair;
+		}
 	}
 
-	// Check if file descriptor is valid or out of bounds or not currently open
-	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fds[fd].fdIndex == -1){
-		fs_print("Invalid file descriptor.\n");
-		return -1;
+	// Every data block is either free, claimed once, or referenced as often as it is counted
+	int numOf_leaked = 0, numOf_miscounted = 0, numOf_unmarked = 0, numOf_shared = 0;
+	for (int b = 1; b < sblock.numOf_dataBlocks; b++) {
+		int used = st->owner[b] != 0 || st->refs[b] != 0;
+		int extra = st->refs[b] > 0 ? st->refs[b] - 1 : 0;
+
+		if (st->owner[b] != 0 && st->refs[b] != 0) {
+			numOf_shared++;
+		}
+		if (!used && fat[b].content != FAT_FREE) {
+			numOf_leaked++;
+			if (repair) {
+				fat[b].content = FAT_FREE;
+			}
+		}
+		if (used && fat[b].content == FAT_FREE) {
+			numOf_unmarked++;
+			if (repair) {
+				fat[b].content = FAT_EOC;
+			}
+		}
+		if (refcnt != NULL && refcnt[b] != min(extra, UINT8_MAX)) {
+			numOf_miscounted++;
+			if (repair) {
+				refcnt[b] = min(extra, UINT8_MAX);
+			}
+		} else if (refcnt == NULL && extra > 0) {
+			numOf_miscounted++;
+		}
+	}
+	if (fat[0].content != FAT_EOC && repair) {
+		fat[0].content = FAT_EOC;
+		repaired++;
 	}
 
-	// Check if the buffer is NULL
-	if(buf == NULL){
-		fs_print("Buffer is NULL.\n");
-		return 0;
+	const char *fixed = repair ? " (fixed)" : "";
+	if (numOf_leaked > 0) {
+		printf("leaked_blocks=%d%s\n", numOf_leaked, fixed);
+		problems++;
+		repaired += repair;
+	}
+	if (numOf_unmarked > 0) {
+		printf("used_free_blocks=%d%s\n", numOf_unmarked, fixed);
+		problems++;
+		repaired += repair;
+	}
+	if (numOf_miscounted > 0) {
+		printf("refcnt_mismatches=%d%s\n", numOf_miscounted, refcnt != NULL ? fixed : "");
+		problems++;
+		repaired += repair && refcnt != NULL;
+	}
+	if (numOf_shared > 0) {
+		printf("cross_linked_blocks=%d\n", numOf_shared);
+		problems++;
 	}
+	printf("problems=%d repaired=%d\n", problems, repaired);
 
-	size_t current_offset = fds[fd].fdOffset;
-    size_t remainingBytes  = count;
-    size_t bytesWritten = 0;
+	free(st->chains);
+	free(st->mapped);
+	free(st->owner);
+	free(st->refs);
+	free(st);
 
-    int rootIndex = fds[fd].rIndex;
-    int dataIndex = rdir[rootIndex].firstDataBlock_index;
+	return problems - repaired;
+}
 
-    int dataBlock_realIndex = sblock.dataBlock_startIndex + dataIndex;
+/* Tracing */
 
-    void *bBuf = malloc(BLOCK_SIZE);
-    if (bBuf == NULL) {
-        return -1;
-    }
+int fs_trace_start(void)
+{
+	perf_scope(FS_TRACE_START);
 
-    while (remainingBytes > 0) {
-        size_t bytesInCurrentBlock = BLOCK_SIZE - (current_offset % BLOCK_SIZE);
-        size_t bytesToWrite = min(bytesInCurrentBlock, remainingBytes);
+	trace_start();
+	return 0;
+}
 
-        if (current_offset % BLOCK_SIZE != 0 || bytesToWrite < BLOCK_SIZE) {
-            if (block_read(dataBlock_realIndex, bBuf) == -1) {
-                free(bBuf);
-                return -1;
-            }
-        }
+int fs_trace_stop(const char *filename)
+{
+	perf_scope(FS_TRACE_STOP);
 
-        memcpy((char*)bBuf + (current_offset % BLOCK_SIZE), (char*)buf + bytesWritten, bytesToWrite);
+	return trace_stop(filename);
+}
 
-        if (block_write(dataBlock_realIndex, bBuf) == -1) {
-            free(bBuf);
-            return -1;
-        }
+/* Workload capture */
 
-        bytesWritten += bytesToWrite;
-        remainingBytes -= bytesToWrite;
-        current_offset += bytesToWrite;
-
-        if (remainingBytes > 0) {
-            if (fat[dataIndex].content == FAT_EOC) {
-                int newBlock = allocate_new_data_block();
-                if (newBlock == -1) {
-                    break;
-                }
-                fat[dataIndex].content = newBlock;
-                dataIndex = newBlock;
-                fat[dataIndex].content = FAT_EOC;
-            } else {
-                dataIndex = fat[dataIndex].content;
-            }
-            dataBlock_realIndex = sblock.dataBlock_startIndex + dataIndex;
-        }
-    }
+int fs_capture_start(const char *filename)
+{
+	perf_scope(FS_CAPTURE_START);
 
-    fds[fd].fdOffset = current_offset;
+	if(filename == NULL){
+		return -1;
+	}
+	return capture_start(filename);
+}
 
-    free(bBuf);
+int fs_capture_stop(void)
+{
+	perf_scope(FS_CAPTURE_STOP);
 
-    return bytesWritten;
-	
+	return capture_stop();
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/* Write-back */
+
+int fs_sync_policy(int policy, unsigned int interval_ms)
 {
-    fs_print("fs_read called with fd=%d, buf=%p, count=%zu\n", fd, buf, count);
+	perf_scope(FS_SYNC_POLICY);
+	fs_lock_scope();
 
-    // Check if FS is currently mounted
-    if(isMounted == 0){
-        fs_print("No FS currently mounted.\n");
-        return 0;
-    }
+	// The policy takes effect at the next mount
+	if(isMounted){
+		return -1;
+	}
+	if(policy != FS_SYNC_NONE && policy != FS_SYNC_INTERVAL && policy != FS_SYNC_ALWAYS){
+		return -1;
+	}
+	if(policy == FS_SYNC_INTERVAL && interval_ms == 0){
+		return -1;
+	}
 
-    // Check if file descriptor is valid or out of bounds or not currently open
-    if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fds[fd].fdIndex == -1){
-        fs_print("Invalid file descriptor.\n");
-        return -1;
-    }
+	syncPolicy = policy;
+	if(policy == FS_SYNC_INTERVAL){
+		syncInterval = interval_ms;
+	}
+	return 0;
+}
 
-    // Check if the buffer is NULL
-    if(buf == NULL){
-        fs_print("Buffer is NULL.\n");
-        return 0;
-    }
+int fs_sync(void)
+{
+	perf_scope(FS_SYNC);
+	fs_lock_scope();
 
-    // Retrieve the file descriptor's current offset
-    size_t current_offset = fds[fd].fdOffset;
-    size_t remainingBytes = count;
-    size_t bytesRead = 0;
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
 
-    // Retrieve first data block index stored in root directory
-    int rootIndex = fds[fd].rIndex; 
-    int dataIndex = rdir[rootIndex].firstDataBlock_index;
+	// Report a failure of an earlier write-back even if this one succeeds
+	int ret = write_back();
+	if(syncError){
+		syncError = 0;
+		ret = -1;
+	}
+	return ret;
+}
 
-    // Find he actual index of the data block correspond to @fd on disk
-    int dataBlock_realIndex = sblock.dataBlock_startIndex + dataIndex;
+/* RAM disk snapshots */
 
-    // Allocate the bounce buffer
-    void *bBuf = malloc(BLOCK_SIZE);
-    if (bBuf == NULL) {
-        return -1; // Failed to allocate memory
-    }
+int fs_snapshot(const char *imagename)
+{
+	perf_scope(FS_SNAPSHOT);
+	fs_lock_scope();
 
-    // Read the data from the data blocks to bounce buffer (one block at a time)
-    while(remainingBytes > 0){
-        fs_print("Reading block %d from disk\n", dataBlock_realIndex);
-        int result = block_read(dataBlock_realIndex, bBuf);
-        if (result == -1){
-            free(bBuf);
-            return -1; // Error reading block from disk
-        }
-        // Calculate the remaining bytes in the current block
-        size_t bytesInCurrentBlock = BLOCK_SIZE - (current_offset % BLOCK_SIZE);
-
-        // Determine how many bytes to read in this iteration
-        size_t bytesToRead = min(bytesInCurrentBlock, remainingBytes);
-        fs_print("Copying %zu bytes from bounce buffer to user buffer\n", bytesToRead);
-        // Copy the appropriate amount of data from the bounce buffer to the user buffer
-        memcpy((char*)buf + bytesRead, (char*)bBuf + current_offset % BLOCK_SIZE, bytesToRead);
-
-        // Update the total bytes read, remainingBytes, and the file descriptor offset
-        bytesRead += bytesToRead;
-        remainingBytes -= bytesToRead;
-        current_offset += bytesToRead;
-
-        // Proceed to next data block if there are still remaining bytes to read
-        if(remainingBytes > 0) {
-            dataIndex = fat[dataIndex].content;
-            if(dataIndex == FAT_EOC){
-                break; // reach end of chain
-            }
-            dataBlock_realIndex = sblock.dataBlock_startIndex + dataIndex;
-            printf("Moving to next data block at index %d\n", dataBlock_realIndex);
-        }
-    }
+	// Check if no FS is currently mounted
+	if(isMounted == 0){
+		fs_print("No FS currently mounted.\n");
+		return -1;
+	}
 
-    // Cleanup: Free the bounce buffer
-    free(bBuf);
+	// Make the disk hold the whole file system before copying it
+	if(write_metadata() == -1){
+		return -1;
+	}
 
-    printf("fs_read returning with bytesRead=%zu\n", bytesRead);
-    // Return the total number of bytes read into the buffer
-    return bytesRead;
+	return block_disk_save(imagename);
+}
+
+/* Performance statistics */
+
+int fs_perf_stats(void)
+{
+	perf_print();
+	return 0;
+}
+
+int fs_perf_reset(void)
+{
+	perf_reset();
+	return 0;
 }
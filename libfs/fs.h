@@ -13,8 +13,19 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
+/**
+ * Maximum length of a path (including the NULL character). A path names a file
+ * of a subdirectory, as in "dir/subdir/file", and a name without any slash
+ * names a file of the root directory. Subdirectories grow as files are created
+ * in them, they are not limited to %FS_FILE_MAX_COUNT files.
+ */
+#define FS_PATH_MAX 256
+
+/**
+ * Maximum number of open files. The table of file descriptors starts empty and
+ * grows as files are opened, so only the files actually open cost memory.
+ */
+#define FS_OPEN_MAX_COUNT 65536
 
 /**
  * fs_mount - Mount a file system
@@ -54,13 +65,14 @@ int fs_info(void);
  * @filename: File name
  *
  * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * mounted file system, or at path @filename in a subdirectory. String @filename
+ * must be NULL-terminated and the name of the file cannot exceed
+ * %FS_FILENAME_LEN characters (including the NULL character).
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if its directory does not exist, or if the root directory already contains
+ * %FS_FILE_MAX_COUNT files. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -68,8 +80,8 @@ int fs_create(const char *filename);
  * fs_delete - Delete a file
  * @filename: File name
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file named @filename, or at path @filename, from the mounted file
+ * system. Directories are removed with fs_rmdir().
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
@@ -86,17 +98,80 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * struct fsDirEntry - File returned by fs_readdir()
+ * @name: File name (including the NULL character)
+ * @size: Size of the file in bytes
+ * @first_block: Data block the file starts at, as fs_ls() shows it (the index
+ * block of a mapped or compressed file)
+ * @blocks: Number of data blocks the file occupies, block map included
+ * @directory: 1 if the entry is a subdirectory, 0 if it is a file
+ */
+struct fsDirEntry {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	unsigned int first_block;
+	size_t blocks;
+	int directory;
+};
+
+/**
+ * fs_readdir - Read entries from a directory
+ * @dirname: Path of the directory, NULL or "/" for the root directory
+ * @cookie: Position to read from, 0 to start from the first file
+ * @entries: Array of at least @count entries to fill
+ * @count: Maximum number of entries to return
+ *
+ * Fill @entries with the files of directory @dirname found from position
+ * @cookie on, and advance @cookie past them, so that repeated calls walk the
+ * whole directory without opening any file. A file created or deleted while
+ * the directory is walked may or may not be returned, and so may be a file of
+ * a subdirectory that grew meanwhile.
+ *
+ * Return: -1 if no FS is currently mounted, or if @cookie or @entries is NULL,
+ * or if there is no directory @dirname. Otherwise return the number of entries
+ * filled, 0 once every file was returned.
+ */
+int fs_readdir(const char *dirname, size_t *cookie, struct fsDirEntry *entries, size_t count);
+
+/**
+ * fs_mkdir - Create a directory
+ * @dirname: Path of the new directory
+ *
+ * Create an empty directory at path @dirname. A directory is stored as hashed
+ * blocks of entries: a file is found by reading the one block its name hashes
+ * to, and the number of blocks doubles when that block is full. The name of
+ * the directory cannot exceed %FS_FILENAME_LEN characters (including the NULL
+ * character).
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid or
+ * already exists, or if its parent directory does not exist or is full, or if
+ * the disk is full. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @dirname: Path of the directory
+ *
+ * Remove the empty directory at path @dirname.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory
+ * @dirname, or if it is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *dirname);
+
 /**
  * fs_open - Open a file
  * @filename: File name
  *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * Open file named @filename, or at path @filename, for reading and writing, and
+ * return the corresponding file descriptor. The file descriptor is a
+ * non-negative integer that is used subsequently to access the contents of the
+ * file. The file offset of the file descriptor is set to 0 initially (beginning
+ * of the file). If the same file is opened multiple files, fs_open() must
+ * return distinct file descriptors. A maximum of %FS_OPEN_MAX_COUNT files can
+ * be open simultaneously.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to open, or if there are already
@@ -109,10 +184,12 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Data of a compressed file that is still buffered
+ * is compressed and stored on disk.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if buffered data could not
+ * be stored. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -137,9 +214,13 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * Seeking past the end of the file is allowed: a following write leaves a
+ * hole between the old end of the file and @offset. Holes take no space on
+ * disk and read back as zeros.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * invalid (i.e., out of bounds, or not currently open), or if @offset is
+ * larger than the maximum file size. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -186,4 +267,285 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_defrag_info - Display fragmentation of files on file system
+ *
+ * List, for every file located in the root directory, the number of data
+ * blocks in its FAT chain and the number of contiguous runs (extents) these
+ * blocks form on disk. A file made of a single extent is not fragmented.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_defrag_info(void);
+
+/**
+ * fs_defrag - Defragment files on file system
+ * @io_budget: Maximum number of blocks to write (0 for no limit)
+ *
+ * Relocate the most fragmented files of the file system into contiguous
+ * runs of free data blocks. Each file is moved as a whole: its data is copied
+ * first, then the new FAT chain is written, and the file's directory entry is
+ * switched over to the new chain before the old chain is released. Moving a
+ * file costs its data blocks, the FAT blocks of its new and old chains and
+ * its directory block out of @io_budget. Files that would exceed what is left
+ * of @io_budget, or for which no large enough free run exists, are left
+ * untouched, and so are mapped (sparse) files. Open files may be relocated.
+ *
+ * Return: -1 if no FS is currently mounted, or if relocating a file failed.
+ * Otherwise return the number of data blocks that were relocated.
+ */
+int fs_defrag(size_t io_budget);
+
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst, or at path @dst, with the same content as the
+ * file named @src. No data is copied: both files share the data blocks of
+ * @src, and only the block map describing the file is duplicated. A shared data
+ * block is copied the first time either file writes to it (copy-on-write), and
+ * is only freed once no file references it anymore.
+ *
+ * Return: -1 if no FS is currently mounted, or if @src or @dst is invalid, or
+ * if there is no file named @src, or if a file named @dst already exists, or if
+ * the directory of @dst is full, or if there is not enough space left for the
+ * block map. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_dedup - Enable or disable block-level deduplication
+ * @enable: Non-zero to enable deduplication, zero to disable it
+ *
+ * When deduplication is enabled on the mounted file system, every full block
+ * written with fs_write() is fingerprinted with a fast hash. If a data block
+ * with the exact same content already exists on disk, it is shared with the
+ * file instead of being written again, in the same copy-on-write way as blocks
+ * shared by fs_clone(). The setting and the fingerprints are kept on disk, so
+ * deduplication stays enabled across mounts until it is disabled. Disabling it
+ * does not unshare blocks that were already deduplicated.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is not enough space
+ * left on disk for the fingerprint table. 0 otherwise.
+ */
+int fs_dedup(int enable);
+
+/**
+ * fs_compress - Enable or disable compression of new files
+ * @enable: Non-zero to create compressed files, zero to create plain files
+ *
+ * Set the compression option of the mounted file system, which is kept on
+ * disk. Files created while the option is set store their data compressed:
+ * the file is split into clusters of 32KiB which are compressed with a fast
+ * LZ codec, and stored uncompressed if that does not save any block. Reads
+ * decompress clusters transparently, and writes are buffered one cluster per
+ * file and compressed when the cluster is flushed, i.e. when another cluster
+ * of the file is accessed or when the file is closed. Existing files are left
+ * as they are.
+ *
+ * Return: -1 if no FS is currently mounted, or if the option cannot be saved
+ * on disk. 0 otherwise.
+ */
+int fs_compress(int enable);
+
+/**
+ * fs_checksum - Enable or disable block checksums
+ * @enable: Non-zero to checksum data blocks, zero to stop
+ *
+ * Set the checksum option of the mounted file system, which is kept on disk.
+ * While it is set, a CRC-32C of every data block is recorded when the block is
+ * written, and checked when it is read back, so that silent corruption of the
+ * disk image makes fs_read() fail instead of returning bad data. Enabling the
+ * option checksums the blocks already in use. The checksums are kept in memory
+ * while the file system is mounted and saved by fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, or if there is not enough space
+ * left on the disk for the checksums. 0 otherwise.
+ */
+int fs_checksum(int enable);
+
+/**
+ * fs_trace_start - Start tracing
+ *
+ * Start logging file system events (operations, block allocations, disk
+ * accesses, errors) into per-thread ring buffers in memory. Tracing can also
+ * be turned on without calling this function, by setting the FS_TRACE
+ * environment variable to the name of a trace file: tracing then starts at
+ * fs_mount() and the trace is saved to that file by fs_umount().
+ *
+ * Return: 0.
+ */
+int fs_trace_start(void);
+
+/**
+ * fs_trace_stop - Stop tracing
+ * @filename: File to save the trace to, or NULL to discard it
+ *
+ * Stop logging events and save the latest events of every thread to
+ * @filename. The trace can be printed with fs_trace.x.
+ *
+ * Return: -1 if the trace cannot be saved to @filename. 0 otherwise.
+ */
+int fs_trace_stop(const char *filename);
+
+/**
+ * fs_capture_start - Start capturing the workload
+ * @filename: Log file to create
+ *
+ * Record every call to fs_mount(), fs_umount(), fs_create(), fs_delete(),
+ * fs_open(), fs_close(), fs_stat(), fs_lseek(), fs_write(), fs_read(),
+ * fs_clone(), fs_mkdir() and fs_rmdir(), with its arguments (whole paths), the
+ * calling thread and a timestamp, into @filename. Data buffers are not
+ * recorded. The log can be played back on another disk with fs_replay.x.
+ * Capture can also be turned on for a whole mount by setting the FS_CAPTURE
+ * environment variable to the log file name.
+ *
+ * Return: -1 if capture is already on or if @filename cannot be created. 0
+ * otherwise.
+ */
+int fs_capture_start(const char *filename);
+
+/**
+ * fs_capture_stop - Stop capturing the workload
+ *
+ * Stop recording calls and close the log file.
+ *
+ * Return: -1 if capture is off or if the log cannot be written. 0 otherwise.
+ */
+int fs_capture_stop(void);
+
+/** Sync policies, see fs_sync_policy() */
+#define FS_SYNC_NONE 0
+#define FS_SYNC_INTERVAL 1
+#define FS_SYNC_ALWAYS 2
+
+/**
+ * fs_sync_policy - Choose when changes are written back
+ * @policy: %FS_SYNC_NONE, %FS_SYNC_INTERVAL or %FS_SYNC_ALWAYS
+ * @interval_ms: Milliseconds between write-backs with %FS_SYNC_INTERVAL
+ *
+ * The library keeps the FAT, the root directory and the other metadata in
+ * memory. With %FS_SYNC_ALWAYS (the default), every call that modifies the file
+ * system writes its changes through to the disk before returning. With
+ * %FS_SYNC_INTERVAL, changes are written back, and the disk is flushed, by a
+ * background thread every @interval_ms milliseconds. With %FS_SYNC_NONE, they
+ * are only written back by fs_sync() and fs_umount(). Only fs_sync() and the
+ * %FS_SYNC_INTERVAL thread wait for the disk to store what was written. The
+ * policy applies from the next fs_mount(). It can also be set from the FS_SYNC
+ * environment variable, read at mount: "none", "always", "interval" or
+ * "interval:<milliseconds>".
+ *
+ * Return: -1 if a file system is currently mounted, or if @policy or
+ * @interval_ms is invalid. 0 otherwise.
+ */
+int fs_sync_policy(int policy, unsigned int interval_ms);
+
+/**
+ * fs_sync - Write back all changes
+ *
+ * Write the metadata held in memory back to disk and wait until the disk has
+ * stored everything written so far.
+ *
+ * Return: -1 if no FS is currently mounted, or if this write-back or a
+ * background write-back since the last call to fs_sync() failed. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_snapshot - Save a RAM disk
+ * @imagename: Name of the image file to create
+ *
+ * Write the file system mounted on a RAM disk (a disk name starting with
+ * "ram:", see block_disk_open()) into image file @imagename, including the
+ * data still held in memory by the library. The image can be mounted later,
+ * either directly or as a RAM disk again.
+ *
+ * Return: -1 if no FS is currently mounted, if it is not on a RAM disk, or if
+ * @imagename cannot be written. 0 otherwise.
+ */
+int fs_snapshot(const char *imagename);
+
+/**
+ * fs_tier - Move hot data blocks to the fast tier
+ * @io_budget: Maximum number of data blocks to move (0 for no limit)
+ *
+ * On a disk opened as a tiered volume, the file system counts how often each
+ * data block is read. A tiering pass moves the blocks read most since the last
+ * pass from the slow tier to the fast one, and moves the coldest blocks of the
+ * fast tier to the slow one when room is needed. Blocks keep their place in the
+ * FAT chain of their file, so files are not affected. Passes also run on their
+ * own from fs_read() every few thousand block reads. Blocks of mapped files,
+ * and blocks shared by cloned files, stay where they are.
+ *
+ * Return: -1 if no FS is currently mounted, or if moving a block failed.
+ * Otherwise return the number of data blocks that were moved (0 if the disk is
+ * not tiered).
+ */
+int fs_tier(size_t io_budget);
+
+/**
+ * fs_log - Enable or disable log-structured writes
+ * @enable: Non-zero to enable log mode, zero to disable it
+ *
+ * In log mode, data blocks are never overwritten in place: new and modified
+ * blocks are written at the head of a log that moves sequentially through the
+ * free blocks of the disk, so that scattered small writes turn into long
+ * sequential runs. A background cleaner empties the least used segments of the
+ * disk when free segments run low, so that the log keeps finding long runs of
+ * free blocks. The setting is recorded on disk, and the cleaner starts again
+ * when the file system is mounted later. Data already on disk is not moved when
+ * log mode is enabled.
+ *
+ * Return: -1 if no FS is currently mounted, or if the setting cannot be
+ * written. 0 otherwise.
+ */
+int fs_log(int enable);
+
+/**
+ * fs_check - Check the consistency of the file system
+ * @repair: Non-zero to fix the problems that are found
+ *
+ * Check the superblock against the disk, walk the FAT chain of every file and
+ * of every metadata table, and the block map of every mapped file, and make
+ * sure that each data block in use is referenced as often as it should be.
+ * Cyclic chains, chains that run into another one or out of the data blocks,
+ * files whose size does not match their chain, leaked blocks and wrong
+ * reference counts are reported. Chains are walked by several threads.
+ *
+ * With @repair, broken chains are cut where they go wrong, file sizes are
+ * reduced to what their chain holds (or chains truncated to the file size),
+ * invalid map entries become holes, leaked blocks are freed and reference
+ * counts are set to the number of references found. Problems in the superblock
+ * and in the chains of metadata tables are only reported.
+ *
+ * Return: -1 if no FS is currently mounted. Otherwise return the number of
+ * problems left, which is 0 if the file system is consistent or was repaired.
+ */
+int fs_check(int repair);
+
+/**
+ * fs_perf_stats - Display performance statistics
+ *
+ * Display, for every function of this API and of the block API that was
+ * called since the statistics were last reset, the number of calls, the number
+ * of bytes read or written, and the 50th, 99th and 99.9th percentiles and the
+ * maximum of the call latency in nanoseconds. Latencies are recorded in
+ * histograms with a precision of about 6%. Calls made by every thread are
+ * counted.
+ *
+ * Return: 0.
+ */
+int fs_perf_stats(void);
+
+/**
+ * fs_perf_reset - Reset performance statistics
+ *
+ * Start a new sampling interval: statistics displayed afterwards only cover
+ * the calls made after the reset.
+ *
+ * Return: 0.
+ */
+int fs_perf_reset(void);
+
 #endif /* _FS_H */
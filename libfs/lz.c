@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4			// shortest back-reference worth encoding
+#define LZ_LAST_LITERALS 5		// the end of the input is always stored as literals
+#define LZ_MAX_OFFSET 65535		// back-references are encoded on 2 bytes
+#define LZ_HASH_BITS 13			// size of the match finder table (8192 entries)
+#define LZ_RUN_MASK 15			// length nibbles saturate here and continue in extra bytes
+
+/*
+ * Compressed data is a sequence of sequences. Each sequence starts with a token
+ * byte: the high nibble is the number of literals, the low nibble the length of
+ * the match minus LZ_MIN_MATCH. A nibble of LZ_RUN_MASK is followed by extra
+ * length bytes, added up until one is not 255. Then come the literals, and the
+ * 2-byte little-endian offset of the match. The last sequence only has literals.
+ */
+
+// Function to read 4 bytes from a possibly unaligned location
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Function to hash the 4 bytes at the current position into the match finder table
+static uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Function to write the extra bytes of a length that did not fit in its nibble
+static uint8_t *write_length(uint8_t *op, const uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend) {
+			return NULL;
+		}
+		*op++ = 255;
+	}
+	if (op >= oend) {
+		return NULL;
+	}
+	*op++ = len;
+	return op;
+}
+
+// Function to write one sequence: literals from @lit, then a match (if @matchLen is not 0)
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+                               size_t litLen, size_t offset, size_t matchLen)
+{
+	if (op >= oend) {
+		return NULL;
+	}
+
+	uint8_t *token = op++;
+	size_t matchCode = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+	*token = ((litLen < LZ_RUN_MASK ? litLen : LZ_RUN_MASK) << 4) |
+	         (matchCode < LZ_RUN_MASK ? matchCode : LZ_RUN_MASK);
+
+	if (litLen >= LZ_RUN_MASK && (op = write_length(op, oend, litLen - LZ_RUN_MASK)) == NULL) {
+		return NULL;
+	}
+	if ((size_t)(oend - op) < litLen) {
+		return NULL;
+	}
+	memcpy(op, lit, litLen);
+	op += litLen;
+
+	if (matchLen == 0) {
+		return op;
+	}
+
+	if (oend - op < 2) {
+		return NULL;
+	}
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+	if (matchCode >= LZ_RUN_MASK && (op = write_length(op, oend, matchCode - LZ_RUN_MASK)) == NULL) {
+		return NULL;
+	}
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t srcLen, void *dst, size_t dstCap)
+{
+	const uint8_t *in = src;
+	const uint8_t *end = in + srcLen;
+	const uint8_t *anchor = in;			// start of the literals not emitted yet
+	const uint8_t *ip = in;
+	uint8_t *op = dst;
+	const uint8_t *oend = op + dstCap;
+
+	// Positions (plus one, 0 meaning empty) of the last 4-byte sequence seen for each hash
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	if (srcLen > LZ_MIN_MATCH + LZ_LAST_LITERALS) {
+		const uint8_t *matchLimit = end - LZ_LAST_LITERALS;
+
+		while (ip + LZ_MIN_MATCH <= matchLimit) {
+			uint32_t sequence = read32(ip);
+			uint32_t h = hash32(sequence);
+			const uint8_t *ref = table[h] ? in + table[h] - 1 : NULL;
+			table[h] = ip - in + 1;
+
+			if (ref == NULL || ip - ref > LZ_MAX_OFFSET || read32(ref) != sequence) {
+				ip++;
+				continue;
+			}
+
+			// Extend the match as far as it goes
+			const uint8_t *mp = ip + LZ_MIN_MATCH;
+			const uint8_t *rp = ref + LZ_MIN_MATCH;
+			while (mp < matchLimit && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+
+			op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+			if (op == NULL) {
+				return 0;
+			}
+			ip = mp;
+			anchor = ip;
+		}
+	}
+
+	// Whatever is left goes out as literals
+	op = write_sequence(op, oend, anchor, end - anchor, 0, 0);
+	if (op == NULL) {
+		return 0;
+	}
+	return op - (uint8_t *)dst;
+}
+
+// Function to read the extra bytes of a length whose nibble saturated
+static int read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t byte;
+	do {
+		if (*ip >= iend) {
+			return -1;
+		}
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+int lz_decompress(const void *src, size_t srcLen, void *dst, size_t dstCap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + srcLen;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dstCap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+
+		// Literals
+		size_t litLen = token >> 4;
+		if (litLen == LZ_RUN_MASK && read_length(&ip, iend, &litLen) == -1) {
+			return -1;
+		}
+		if ((size_t)(iend - ip) < litLen || (size_t)(oend - op) < litLen) {
+			return -1;
+		}
+		memcpy(op, ip, litLen);
+		ip += litLen;
+		op += litLen;
+
+		// The last sequence has no match
+		if (ip == iend) {
+			break;
+		}
+
+		// Match
+		if (iend - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+			return -1;
+		}
+		size_t matchLen = token & LZ_RUN_MASK;
+		if (matchLen == LZ_RUN_MASK && read_length(&ip, iend, &matchLen) == -1) {
+			return -1;
+		}
+		matchLen += LZ_MIN_MATCH;
+		if ((size_t)(oend - op) < matchLen) {
+			return -1;
+		}
+
+		// Overlapping matches repeat the last @offset bytes, so they are copied byte by byte
+		const uint8_t *ref = op - offset;
+		if (offset >= matchLen) {
+			memcpy(op, ref, matchLen);
+			op += matchLen;
+		} else {
+			while (matchLen--) {
+				*op++ = *ref++;
+			}
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
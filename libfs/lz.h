@@ -0,0 +1,38 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @srcLen: Number of bytes of data in @src (at most 65535 bytes can be referred
+ * back to, longer buffers compress less well)
+ * @dst: Buffer to be filled with the compressed data
+ * @dstCap: Number of bytes available in @dst
+ *
+ * Compress @srcLen bytes of @src with a byte-oriented LZ77 codec (LZ4-style
+ * sequences of literals followed by a back-reference).
+ *
+ * Return: 0 if the compressed data does not fit in @dstCap bytes. Otherwise
+ * return the number of bytes of compressed data written to @dst.
+ */
+size_t lz_compress(const void *src, size_t srcLen, void *dst, size_t dstCap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed data
+ * @srcLen: Number of bytes of compressed data in @src
+ * @dst: Buffer to be filled with the decompressed data
+ * @dstCap: Number of bytes available in @dst
+ *
+ * Decompress data produced by lz_compress(). Malformed input is detected and
+ * never causes reads or writes out of the given buffers.
+ *
+ * Return: -1 if @src is not valid compressed data or if the decompressed data
+ * does not fit in @dstCap bytes. Otherwise return the number of bytes written
+ * to @dst.
+ */
+int lz_decompress(const void *src, size_t srcLen, void *dst, size_t dstCap);
+
+#endif /* _LZ_H */
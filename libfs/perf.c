@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "perf.h"
+
+/*
+ * Latencies go into HDR-style log-linear histograms: values below PERF_SUB
+ * nanoseconds have their own bucket, and every power of two above is split
+ * into PERF_SUB buckets. Any latency is thus known within 1/PERF_SUB (6%),
+ * from nanoseconds up to 2^PERF_MAX_EXP nanoseconds (over a minute).
+ */
+#define PERF_SUB_BITS 4
+#define PERF_SUB (1 << PERF_SUB_BITS)
+#define PERF_MAX_EXP 36
+#define PERF_BUCKETS ((PERF_MAX_EXP - PERF_SUB_BITS + 1) * PERF_SUB)
+
+// Counters of one thread, or totals of all threads
+struct perfShard {
+	struct perfShard *next;
+	uint64_t calls[PERF_NUM_OPS];
+	uint64_t bytes[PERF_NUM_OPS];
+	uint64_t histogram[PERF_NUM_OPS][PERF_BUCKETS];
+};
+
+static const char *op_names[] = {
+#define PERF_NAME(name, str) str,
+	PERF_OPS(PERF_NAME)
+#undef PERF_NAME
+};
+
+static struct perfShard *shards = NULL;		// shard of every thread that ever made a call
+static struct perfShard baseline;				// totals at the last perf_reset()
+static __thread struct perfShard *myShard = NULL;
+
+// Function to get the shard of the calling thread, creating it on its first call
+static struct perfShard *perf_shard(void)
+{
+	if (myShard != NULL) {
+		return myShard;
+	}
+
+	struct perfShard *shard = calloc(1, sizeof(struct perfShard));
+	if (shard == NULL) {
+		return NULL;
+	}
+	shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, 1,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		;	// shard->next was refreshed with the current list head
+	}
+	myShard = shard;
+	return shard;
+}
+
+// Function to add to a counter only the calling thread writes, while others may read it
+static void perf_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+// Function to find the histogram bucket of a latency
+static int perf_bucket(uint64_t ns)
+{
+	if (ns < PERF_SUB) {
+		return ns;
+	}
+	int exp = 63 - __builtin_clzll(ns);
+	if (exp >= PERF_MAX_EXP) {
+		return PERF_BUCKETS - 1;
+	}
+	int mantissa = (ns >> (exp - PERF_SUB_BITS)) & (PERF_SUB - 1);
+	return (exp - PERF_SUB_BITS + 1) * PERF_SUB + mantissa;
+}
+
+// Function to get the middle of the range of latencies that fall into a bucket
+static uint64_t perf_bucket_value(int bucket)
+{
+	if (bucket < PERF_SUB) {
+		return bucket;
+	}
+	int exp = bucket / PERF_SUB + PERF_SUB_BITS - 1;
+	uint64_t width = 1ull << (exp - PERF_SUB_BITS);
+	uint64_t low = (uint64_t)(PERF_SUB + bucket % PERF_SUB) * width;
+	return low + width / 2;
+}
+
+uint64_t perf_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void perf_end(struct perfTimer *timer)
+{
+	struct perfShard *shard = perf_shard();
+	if (shard == NULL) {
+		return;
+	}
+	perf_add(&shard->calls[timer->op], 1);
+	perf_add(&shard->histogram[timer->op][perf_bucket(perf_now() - timer->start)], 1);
+}
+
+void perf_bytes(enum perfOp op, uint64_t bytes)
+{
+	struct perfShard *shard = perf_shard();
+	if (shard != NULL) {
+		perf_add(&shard->bytes[op], bytes);
+	}
+}
+
+// Function to add up the shards of every thread into @total
+static void perf_total(struct perfShard *total)
+{
+	memset(total, 0, sizeof(struct perfShard));
+	struct perfShard *list = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+	for (struct perfShard *shard = list; shard != NULL; shard = shard->next) {
+		for (int op = 0; op < PERF_NUM_OPS; op++) {
+			total->calls[op] += __atomic_load_n(&shard->calls[op], __ATOMIC_RELAXED);
+			total->bytes[op] += __atomic_load_n(&shard->bytes[op], __ATOMIC_RELAXED);
+			for (int b = 0; b < PERF_BUCKETS; b++) {
+				total->histogram[op][b] += __atomic_load_n(&shard->histogram[op][b], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+// Function to find the latency under which a fraction @quantile of the calls completed
+static uint64_t perf_quantile(const uint64_t *histogram, uint64_t calls, double quantile)
+{
+	uint64_t rank = (uint64_t)(quantile * calls);
+	if (rank >= calls) {
+		rank = calls - 1;
+	}
+	uint64_t seen = 0;
+	for (int b = 0; b < PERF_BUCKETS; b++) {
+		seen += histogram[b];
+		if (seen > rank) {
+			return perf_bucket_value(b);
+		}
+	}
+	return perf_bucket_value(PERF_BUCKETS - 1);
+}
+
+void perf_print(void)
+{
+	struct perfShard *total = malloc(sizeof(struct perfShard));
+	if (total == NULL) {
+		return;
+	}
+	perf_total(total);
+
+	printf("FS Perf:\n");
+	for (int op = 0; op < PERF_NUM_OPS; op++) {
+		uint64_t calls = total->calls[op] - baseline.calls[op];
+		if (calls == 0) {
+			continue;
+		}
+		uint64_t histogram[PERF_BUCKETS];
+		int last = 0;
+		for (int b = 0; b < PERF_BUCKETS; b++) {
+			histogram[b] = total->histogram[op][b] - baseline.histogram[op][b];
+			if (histogram[b] != 0) {
+				last = b;
+			}
+		}
+		printf("op=%s calls=%llu bytes=%llu p50_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu\n",
+		       op_names[op], (unsigned long long)calls,
+		       (unsigned long long)(total->bytes[op] - baseline.bytes[op]),
+		       (unsigned long long)perf_quantile(histogram, calls, 0.5),
+		       (unsigned long long)perf_quantile(histogram, calls, 0.99),
+		       (unsigned long long)perf_quantile(histogram, calls, 0.999),
+		       (unsigned long long)perf_bucket_value(last));
+	}
+	free(total);
+}
+
+void perf_reset(void)
+{
+	perf_total(&baseline);
+}
@@ -0,0 +1,98 @@
+#ifndef _PERF_H
+#define _PERF_H
+
+#include <stdint.h>
+
+/*
+ * Performance counters of the public entry points of fs.h and disk.h: number
+ * of calls, bytes moved, and a latency histogram. Each thread counts into its
+ * own shard, so instrumented calls never contend on shared counters; shards
+ * are only added up when the statistics are printed.
+ */
+#define PERF_OPS(X)									\
+	X(FS_MOUNT,			"fs_mount")					\
+	X(FS_UMOUNT,		"fs_umount")				\
+	X(FS_INFO,			"fs_info")					\
+	X(FS_CREATE,		"fs_create")				\
+	X(FS_DELETE,		"fs_delete")				\
+	X(FS_LS,			"fs_ls")					\
+	X(FS_OPEN,			"fs_open")					\
+	X(FS_CLOSE,			"fs_close")					\
+	X(FS_STAT,			"fs_stat")					\
+	X(FS_LSEEK,			"fs_lseek")					\
+	X(FS_WRITE,			"fs_write")					\
+	X(FS_READ,			"fs_read")					\
+	X(FS_DEFRAG_INFO,	"fs_defrag_info")			\
+	X(FS_DEFRAG,		"fs_defrag")				\
+	X(FS_CLONE,			"fs_clone")					\
+	X(FS_DEDUP,			"fs_dedup")					\
+	X(FS_COMPRESS,		"fs_compress")				\
+	X(FS_CHECKSUM,		"fs_checksum")				\
+	X(FS_TRACE_START,	"fs_trace_start")			\
+	X(FS_TRACE_STOP,	"fs_trace_stop")			\
+	X(FS_CAPTURE_START,	"fs_capture_start")			\
+	X(FS_CAPTURE_STOP,	"fs_capture_stop")			\
+	X(FS_SNAPSHOT,		"fs_snapshot")				\
+	X(FS_SYNC_POLICY,	"fs_sync_policy")			\
+	X(FS_SYNC,			"fs_sync")					\
+	X(FS_TIER,			"fs_tier")					\
+	X(FS_LOG,			"fs_log")					\
+	X(FS_CHECK,			"fs_check")					\
+	X(FS_READDIR,		"fs_readdir")				\
+	X(FS_MKDIR,			"fs_mkdir")					\
+	X(FS_RMDIR,			"fs_rmdir")					\
+	X(BLOCK_DISK_OPEN,	"block_disk_open")			\
+	X(BLOCK_DISK_CLOSE,	"block_disk_close")			\
+	X(BLOCK_DISK_LOAD,	"block_disk_load")			\
+	X(BLOCK_DISK_SAVE,	"block_disk_save")			\
+	X(BLOCK_DISK_SYNC,	"block_disk_sync")			\
+	X(BLOCK_DISK_COUNT,	"block_disk_count")			\
+	X(BLOCK_DISK_FAST_COUNT, "block_disk_fast_count")	\
+	X(BLOCK_VOLUME_CREATE, "block_volume_create")	\
+	X(BLOCK_WRITE,		"block_write")				\
+	X(BLOCK_READ,		"block_read")				\
+	X(BLOCK_SUBMIT,		"block_submit")
+
+enum perfOp {
+#define PERF_ENUM(name, str) PERF_##name,
+	PERF_OPS(PERF_ENUM)
+#undef PERF_ENUM
+	PERF_NUM_OPS
+};
+
+// Latency measurement of the call in progress, see perf_scope()
+struct perfTimer {
+	enum perfOp op;
+	uint64_t start;			// nanoseconds, CLOCK_MONOTONIC
+};
+
+uint64_t perf_now(void);
+void perf_end(struct perfTimer *timer);
+
+// Count a call to @op and measure its latency until the enclosing function returns
+#define perf_scope(op)																\
+	struct perfTimer perfTimer __attribute__((cleanup(perf_end))) = { PERF_##op, perf_now() }
+
+/**
+ * perf_bytes - Count bytes moved by an operation
+ * @op: Operation that moved the bytes
+ * @bytes: Number of bytes read or written
+ */
+void perf_bytes(enum perfOp op, uint64_t bytes);
+
+/**
+ * perf_print - Print the statistics of every operation called since the last
+ * reset
+ */
+void perf_print(void);
+
+/**
+ * perf_reset - Start a new sampling interval
+ *
+ * Statistics printed afterwards only cover the calls made after the reset.
+ * The shards of the threads are left untouched: the totals at the time of the
+ * reset are recorded and subtracted from later totals.
+ */
+void perf_reset(void);
+
+#endif /* _PERF_H */
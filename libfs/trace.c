@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_RING_SIZE 4096		// records per thread (128KiB), must be a power of two
+
+/*
+ * Each thread owns a ring it alone writes to, so logging needs no lock: the
+ * record is filled in, then the head is published with a release store. Rings
+ * are linked into a global list the first time their thread logs an event,
+ * and are kept for the life of the process so that a trace can be saved after
+ * the threads that wrote it are gone.
+ */
+struct traceRing {
+	struct traceRing *next;
+	uint64_t head;					// number of records written to the ring during this trace
+	uint64_t generation;			// trace the records belong to
+	uint16_t thread;
+	struct traceRecord records[TRACE_RING_SIZE];
+};
+
+int trace_enabled = 0;
+static struct traceRing *rings = NULL;				// every ring ever created
+static uint16_t numOf_threads = 0;
+static uint64_t generation = 1;						// bumped by trace_start() to empty the rings
+static __thread struct traceRing *myRing = NULL;
+
+// Function to create the ring of the calling thread and add it to the global list
+static struct traceRing *trace_new_ring(void)
+{
+	struct traceRing *ring = calloc(1, sizeof(struct traceRing));
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->thread = __atomic_fetch_add(&numOf_threads, 1, __ATOMIC_RELAXED);
+
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		;	// ring->next was refreshed with the current list head
+	}
+	return ring;
+}
+
+void trace_record(enum traceEvent event, uint32_t arg0, uint64_t arg1, uint64_t arg2)
+{
+	if (myRing == NULL && (myRing = trace_new_ring()) == NULL) {
+		return;
+	}
+
+	// A new trace was started since this thread last logged: drop its old records
+	uint64_t current = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+	if (myRing->generation != current) {
+		__atomic_store_n(&myRing->head, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&myRing->generation, current, __ATOMIC_RELEASE);
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	uint64_t head = myRing->head;
+	struct traceRecord *rec = &myRing->records[head & (TRACE_RING_SIZE - 1)];
+	rec->timestamp = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+	rec->event = event;
+	rec->thread = myRing->thread;
+	rec->arg0 = arg0;
+	rec->arg1 = arg1;
+	rec->arg2 = arg2;
+	__atomic_store_n(&myRing->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_start(void)
+{
+	__atomic_fetch_add(&generation, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+}
+
+int trace_stop(const char *filename)
+{
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+	if (filename == NULL) {
+		return 0;
+	}
+
+	FILE *file = fopen(filename, "wb");
+	if (file == NULL) {
+		return -1;
+	}
+
+	// Count the records first, for the header. Rings that did not log anything since
+	// trace_start() still hold the records of an older trace, and are skipped.
+	uint64_t current = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+	struct traceHeader header;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.recordSize = sizeof(struct traceRecord);
+	header.numOf_records = 0;
+	struct traceRing *list = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (struct traceRing *ring = list; ring != NULL; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ring->generation, __ATOMIC_ACQUIRE) == current) {
+			header.numOf_records += head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+		}
+	}
+
+	int ret = fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+	for (struct traceRing *ring = list; ring != NULL && ret == 0; ring = ring->next) {
+		if (__atomic_load_n(&ring->generation, __ATOMIC_ACQUIRE) != current) {
+			continue;
+		}
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		for (uint64_t i = first; i < head && ret == 0; i++) {
+			if (fwrite(&ring->records[i & (TRACE_RING_SIZE - 1)], sizeof(struct traceRecord), 1, file) != 1) {
+				ret = -1;
+			}
+		}
+	}
+
+	if (fclose(file) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
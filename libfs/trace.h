@@ -0,0 +1,89 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Static tracepoints. Each thread logs binary records into its own ring
+ * buffer, without locks and without formatting anything; fs_trace.x turns a
+ * saved trace into text. When tracing is off, a tracepoint costs a single
+ * predictable branch on a global flag.
+ *
+ * Each event is listed below with the format the decoder uses to print its
+ * three arguments.
+ */
+#define TRACE_EVENTS(X)																\
+	X(MOUNT,		"blocks=%llu")													\
+	X(UMOUNT,		"")																\
+	X(CREATE,		"rdir=%llu")													\
+	X(DELETE,		"rdir=%llu")													\
+	X(OPEN,			"fd=%llu rdir=%llu")											\
+	X(CLOSE,		"fd=%llu")														\
+	X(READ,			"fd=%llu offset=%llu count=%llu")								\
+	X(READ_DONE,	"fd=%llu bytes=%llu")											\
+	X(WRITE,		"fd=%llu offset=%llu count=%llu")								\
+	X(WRITE_DONE,	"fd=%llu bytes=%llu")											\
+	X(NEXT_BLOCK,	"rdir=%llu data=%llu")											\
+	X(ALLOC,		"data=%llu")													\
+	X(BLOCK_READ,	"block=%llu")													\
+	X(BLOCK_WRITE,	"block=%llu")													\
+	X(BLOCK_SUBMIT,	"block=%llu count=%llu write=%llu")								\
+	X(ERROR,		"fs.c:%llu")
+
+enum traceEvent {
+#define TRACE_ENUM(name, fmt) TRACE_##name,
+	TRACE_EVENTS(TRACE_ENUM)
+#undef TRACE_ENUM
+	TRACE_NUM_EVENTS
+};
+
+// One trace record, as stored in the ring buffers and in trace files
+struct traceRecord {
+	uint64_t timestamp;		// nanoseconds, CLOCK_MONOTONIC
+	uint16_t event;			// enum traceEvent
+	uint16_t thread;		// thread number, in the order threads first logged an event
+	uint32_t arg0;
+	uint64_t arg1;
+	uint64_t arg2;
+};
+
+// Header of a trace file, followed by the records of every thread
+struct traceHeader {
+	char magic[8];			// "FSTRACE1"
+	uint32_t recordSize;	// sizeof(struct traceRecord)
+	uint32_t numOf_records;
+};
+
+#define TRACE_MAGIC "FSTRACE1"
+
+extern int trace_enabled;
+
+void trace_record(enum traceEvent event, uint32_t arg0, uint64_t arg1, uint64_t arg2);
+
+// Tracepoint: log @event with up to three arguments if tracing is on
+#define trace_point(event, arg0, arg1, arg2)										\
+do {																				\
+	if (__builtin_expect(trace_enabled, 0))											\
+		trace_record(TRACE_##event, (arg0), (arg1), (arg2));						\
+} while (0)
+
+/**
+ * trace_start - Start tracing
+ *
+ * Empty the ring buffers and start logging events.
+ */
+void trace_start(void);
+
+/**
+ * trace_stop - Stop tracing and save the trace
+ * @filename: File to write the trace to, or NULL to discard it
+ *
+ * Stop logging events, and write the events still held by the ring buffers of
+ * every thread to @filename. Each ring keeps the latest events of its thread.
+ * Threads should not be logging events while the trace is saved.
+ *
+ * Return: -1 if the trace file cannot be written. 0 otherwise.
+ */
+int trace_stop(const char *filename);
+
+#endif /* _TRACE_H */